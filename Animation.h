@@ -0,0 +1,94 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Scene.h"
+
+// Camera and sphere keyframes for batch renders, read from a text file:
+//   frames <count>
+//   camera <frame> <pos x y z> <lookAt x y z>
+//   sphere <frame> <index> <pos x y z>
+// Values are interpolated linearly between keyframes and held before the
+// first and after the last one. Lines starting with # are comments.
+class Animation {
+private:
+	struct Key {
+		int frame;
+		double v[6];
+	};
+
+	std::vector<Key> cameraKeys;
+	std::map<int, std::vector<Key>> sphereKeys;
+
+	// keys are sorted by frame
+	static void sample(const std::vector<Key>& keys, int frame, int n, double* out) {
+		size_t i = 0;
+		while (i + 1 < keys.size() && keys[i + 1].frame <= frame) i++;
+		const Key& a = keys[i];
+		const Key& b = i + 1 < keys.size() ? keys[i + 1] : a;
+		double t = b.frame > a.frame ? std::min(std::max((double)(frame - a.frame) / (b.frame - a.frame), 0.0), 1.0) : 0;
+		for (int j = 0; j < n; j++) out[j] = a.v[j] + (b.v[j] - a.v[j]) * t;
+	}
+
+	static void insert(std::vector<Key>& keys, const Key& key) {
+		auto it = keys.begin();
+		while (it != keys.end() && it->frame < key.frame) it++;
+		keys.insert(it, key);
+	}
+
+public:
+	int frameCount = 0;
+
+	bool load(const std::string& path) {
+		std::ifstream in(path);
+		if (!in) return false;
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string kind;
+			if (!(fields >> kind) || kind[0] == '#') continue;
+			Key key;
+			if (kind == "frames") {
+				fields >> frameCount;
+			} else if (kind == "camera") {
+				fields >> key.frame;
+				for (int i = 0; i < 6; i++) fields >> key.v[i];
+				if (fields) insert(cameraKeys, key);
+			} else if (kind == "sphere") {
+				int index;
+				fields >> key.frame >> index;
+				for (int i = 0; i < 3; i++) fields >> key.v[i];
+				if (fields) insert(sphereKeys[index], key);
+			}
+		}
+		return frameCount > 0;
+	}
+
+	// Poses cam and the spheres for the given frame. lookAt is normalized and
+	// up made orthogonal to it again, as the kernels expect.
+	void apply(int frame, Camera& cam, Sphere sphere[], int sphereSize) const {
+		if (!cameraKeys.empty()) {
+			double v[6];
+			sample(cameraKeys, frame, 6, v);
+			cam.pos = cl_double3{ v[0], v[1], v[2] };
+			double len = sqrt(v[3] * v[3] + v[4] * v[4] + v[5] * v[5]);
+			cam.lookAt = cl_double3{ v[3] / len, v[4] / len, v[5] / len };
+			double d = cam.up.x * cam.lookAt.x + cam.up.y * cam.lookAt.y + cam.up.z * cam.lookAt.z;
+			cl_double3 up = cl_double3{ cam.up.x - cam.lookAt.x * d, cam.up.y - cam.lookAt.y * d,
+				cam.up.z - cam.lookAt.z * d };
+			len = sqrt(up.x * up.x + up.y * up.y + up.z * up.z);
+			if (len > 1e-9) cam.up = cl_double3{ up.x / len, up.y / len, up.z / len };
+		}
+		for (const auto& it : sphereKeys) {
+			if (it.first < 0 || it.first >= sphereSize) continue;
+			double v[3];
+			sample(it.second, frame, 3, v);
+			sphere[it.first].pos = cl_double3{ v[0], v[1], v[2] };
+		}
+	}
+};
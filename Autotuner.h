@@ -0,0 +1,250 @@
+#pragma once
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#include "CLManager.h"
+
+struct TuneResult {
+	std::string options;
+	// 0 lets the driver choose
+	size_t localSize[2] = { 0, 0 };
+	double ms = 0;
+};
+
+// Everything the tuner needs to launch a kernel on its own.
+struct TuneTarget {
+	std::string name;
+	cl_uint dims;
+	size_t globalSize[2];
+	// persistent kernels launch this many work-groups whatever the local size
+	size_t groups = 0;
+	std::function<bool(cl_kernel kernel, cl_uint seed)> bindArgs;
+	std::function<void()> reset;
+	cl_mem output;
+	size_t outputCount;
+};
+
+// Benchmarks work-group shapes and build options per kernel and device.
+// Winners are cached in autotuneFile keyed by device, driver and source hash.
+class Autotuner {
+private:
+	const std::string autotuneFile = "autotune.cache";
+	const int timedRuns = 3;
+	const cl_uint refSeed = 12345, noiseSeed = 54321;
+	const std::vector<size_t> shapes2D = { 0, 0, 8, 8, 16, 8, 16, 16, 32, 4, 32, 8, 64, 1, 64, 4 };
+	const std::vector<size_t> sizes1D = { 0, 32, 64, 128, 256 };
+
+	CLManager& cl;
+	std::vector<cl_double3> ref;
+	double refMean, noiseRmse;
+
+	std::string key(const std::string& sourceHash, const std::string& name) {
+		std::string ret = cl.getDeviceString(CL_DEVICE_NAME) + "|" + cl.getDeviceString(CL_DRIVER_VERSION)
+			+ "|" + sourceHash + "|" + name;
+		for (char& c : ret) if (c == '\t' || c == '\n') c = ' ';
+		return ret;
+	}
+
+	bool launch(cl_kernel kernel, TuneTarget& target, const size_t* localSize, cl_uint seed, double* ms) {
+		target.reset();
+		if (!target.bindArgs(kernel, seed)) return false;
+
+		size_t globalSize[2];
+		bool useLocal = localSize[0] != 0;
+		for (cl_uint i = 0; i < target.dims; i++) {
+			if (target.groups) globalSize[i] = (useLocal ? localSize[i] : 64) * target.groups;
+			else if (useLocal) globalSize[i] = (target.globalSize[i] + localSize[i] - 1) / localSize[i] * localSize[i];
+			else globalSize[i] = target.globalSize[i];
+		}
+
+		cl_event kernelEvent;
+		cl_int err = clEnqueueNDRangeKernel(cl.queue, kernel, target.dims, nullptr, globalSize,
+			useLocal ? localSize : nullptr, 0, nullptr, &kernelEvent);
+		if (err != CL_SUCCESS) return false;
+		clWaitForEvents(1, &kernelEvent);
+
+		cl_ulong startTime, endTime;
+		clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, nullptr);
+		clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, nullptr);
+		clReleaseEvent(kernelEvent);
+		if (ms) *ms = (endTime - startTime) * 1e-6;
+		return true;
+	}
+
+	void readOutput(TuneTarget& target, std::vector<cl_double3>& img) {
+		img.resize(target.outputCount);
+		clEnqueueReadBuffer(cl.queue, target.output, CL_TRUE, 0, img.size() * sizeof(cl_double3),
+			img.data(), 0, nullptr, nullptr);
+	}
+
+	static double mean(const std::vector<cl_double3>& img) {
+		double sum = 0;
+		for (const cl_double3& c : img) sum += c.x + c.y + c.z;
+		return sum / (3.0 * img.size());
+	}
+
+	static double rmse(const std::vector<cl_double3>& a, const std::vector<cl_double3>& b) {
+		double sum = 0;
+		for (size_t i = 0; i < a.size(); i++)
+			sum += pow(a[i].x - b[i].x, 2) + pow(a[i].y - b[i].y, 2) + pow(a[i].z - b[i].z, 2);
+		return sqrt(sum / (3.0 * a.size()));
+	}
+
+	void reportResources(cl_kernel kernel, const std::string& name, const std::string& options) {
+		cl_ulong privateMem = 0, localMem = 0;
+		size_t multiple = 0, maxGroupSize = 0;
+		clGetKernelWorkGroupInfo(kernel, cl.device, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(cl_ulong), &privateMem, nullptr);
+		clGetKernelWorkGroupInfo(kernel, cl.device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, nullptr);
+		clGetKernelWorkGroupInfo(kernel, cl.device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+			sizeof(size_t), &multiple, nullptr);
+		clGetKernelWorkGroupInfo(kernel, cl.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroupSize, nullptr);
+		std::cout << name << " [" << options << "]: private " << privateMem << " B, local " << localMem
+			<< " B, work-group multiple " << multiple << ", max work-group " << maxGroupSize << std::endl;
+	}
+
+public:
+	const std::vector<std::string> buildOptionSets = {
+		"",
+		"-cl-mad-enable",
+		"-cl-fast-relaxed-math",
+		"-cl-mad-enable -D UNROLL_SPHERES",
+		"-cl-fast-relaxed-math -D UNROLL_SPHERES"
+	};
+
+	Autotuner(CLManager& cl) : cl(cl) {}
+
+	bool lookup(const std::string& sourceHash, const std::string& name, TuneResult& ret) {
+		std::ifstream in(autotuneFile);
+		std::string line, k = key(sourceHash, name);
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string fieldKey, options, l0, l1, ms;
+			if (!std::getline(fields, fieldKey, '\t') || fieldKey != k) continue;
+			std::getline(fields, options, '\t');
+			std::getline(fields, l0, '\t');
+			std::getline(fields, l1, '\t');
+			std::getline(fields, ms, '\t');
+			ret.options = options;
+			ret.localSize[0] = std::stoul(l0);
+			ret.localSize[1] = std::stoul(l1);
+			ret.ms = std::stod(ms);
+			return true;
+		}
+		return false;
+	}
+
+	void store(const std::string& sourceHash, const std::string& name, const TuneResult& result) {
+		std::vector<std::string> lines;
+		std::string line, k = key(sourceHash, name);
+		std::ifstream in(autotuneFile);
+		while (std::getline(in, line))
+			if (line.compare(0, k.size() + 1, k + "\t") != 0) lines.push_back(line);
+		in.close();
+
+		std::ofstream out(autotuneFile);
+		for (const std::string& l : lines) out << l << "\n";
+		out << k << "\t" << result.options << "\t" << result.localSize[0] << "\t" << result.localSize[1]
+			<< "\t" << result.ms << "\n";
+	}
+
+	// Renders the reference image with the base options and the driver's
+	// work-group size, plus a second seed to measure the noise floor.
+	bool prepareReference(const std::vector<std::string>& files, const std::string& baseOptions, TuneTarget& target) {
+		CLProgram program = cl.buildProgram(files, baseOptions);
+		if (!program) return false;
+		cl_int err;
+		CLKernel kernel(clCreateKernel(program, target.name.c_str(), &err));
+		bool ok = err == CL_SUCCESS;
+		size_t noLocal[2] = { 0, 0 };
+		std::vector<cl_double3> noise;
+		if (ok) ok = launch(kernel, target, noLocal, refSeed, nullptr);
+		if (ok) readOutput(target, ref);
+		if (ok) ok = launch(kernel, target, noLocal, noiseSeed, nullptr);
+		if (ok) readOutput(target, noise);
+		if (ok) {
+			refMean = mean(ref);
+			noiseRmse = rmse(ref, noise);
+		}
+		return ok;
+	}
+
+	// Average kernel time with the given options and the driver's work-group
+	// size, -1 if it does not build.
+	double time(const std::vector<std::string>& files, const std::string& options, TuneTarget& target) {
+		CLProgram program = cl.buildProgram(files, options);
+		if (!program) return -1;
+		cl_int err;
+		CLKernel kernel(clCreateKernel(program, target.name.c_str(), &err));
+		size_t noLocal[2] = { 0, 0 };
+		double total = 0, ms;
+		bool ok = err == CL_SUCCESS && launch(kernel, target, noLocal, refSeed, nullptr);
+		for (int i = 0; ok && i < timedRuns; i++) {
+			ok = launch(kernel, target, noLocal, refSeed, &ms);
+			total += ms;
+		}
+		return ok ? total / timedRuns : -1;
+	}
+
+	// Tries every option set with every work-group shape. Candidates whose
+	// image drifts from the reference by more than the sampling noise, or
+	// whose mean brightness moves by more than 1%, are rejected.
+	TuneResult tune(const std::vector<std::string>& files, const std::string& baseOptions,
+		const std::vector<std::string>& optionSets, TuneTarget& target) {
+		TuneResult best;
+		best.ms = -1;
+		const std::vector<size_t>& shapes = target.dims == 2 ? shapes2D : sizes1D;
+		size_t stride = target.dims;
+
+		for (const std::string& options : optionSets) {
+			CLProgram program = cl.buildProgram(files, baseOptions + " " + options);
+			if (!program) {
+				std::cout << target.name << " [" << options << "]: build failed" << std::endl;
+				continue;
+			}
+			cl_int err;
+			CLKernel kernel(clCreateKernel(program, target.name.c_str(), &err));
+			if (err != CL_SUCCESS) continue;
+			reportResources(kernel, target.name, options);
+
+			size_t maxGroupSize = 0;
+			clGetKernelWorkGroupInfo(kernel, cl.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroupSize, nullptr);
+
+			for (size_t i = 0; i < shapes.size(); i += stride) {
+				size_t localSize[2] = { shapes[i], stride == 2 ? shapes[i + 1] : 1 };
+				if (localSize[0] * localSize[1] > maxGroupSize) continue;
+
+				std::vector<cl_double3> img;
+				if (!launch(kernel, target, localSize, refSeed, nullptr)) continue;
+				readOutput(target, img);
+				double error = rmse(img, ref);
+				double drift = fabs(mean(img) - refMean) / std::max(refMean, 1e-12);
+				bool accurate = error <= noiseRmse * 1.1 + 1e-9 && drift < 0.01;
+
+				double total = 0, ms;
+				bool ok = launch(kernel, target, localSize, refSeed, nullptr);
+				for (int j = 0; ok && j < timedRuns; j++) {
+					ok = launch(kernel, target, localSize, refSeed, &ms);
+					total += ms;
+				}
+				if (!ok) continue;
+				ms = total / timedRuns;
+
+				std::cout << "  local " << localSize[0] << "x" << localSize[1] << ": " << ms << " ms, rmse "
+					<< error << " (noise " << noiseRmse << ")" << (accurate ? "" : " rejected") << std::endl;
+				if (accurate && (best.ms < 0 || ms < best.ms)) {
+					best.options = options;
+					best.localSize[0] = localSize[0];
+					best.localSize[1] = stride == 2 ? localSize[1] : 0;
+					best.ms = ms;
+				}
+			}
+		}
+
+		if (best.ms < 0) best = TuneResult();
+		std::cout << target.name << " winner: [" << best.options << "] local " << best.localSize[0] << "x"
+			<< best.localSize[1] << ", " << best.ms << " ms" << std::endl;
+		return best;
+	}
+};
@@ -0,0 +1,403 @@
+// Bidirectional path tracing, built after Common.cl. Every sample traces a
+// subpath from the eye and one from an emitter and joins them in each way
+// that can carry light: the eye subpath reaching an emitter, next event
+// estimation from an eye vertex, a connection between two inner vertices,
+// and light tracing, which connects a light vertex to the eye and splats it
+// into whatever pixel it lands in. The balance heuristic weighs them, so a
+// caustic seen on a diffuse surface comes mostly from light tracing while
+// direct light still comes from next event estimation.
+//
+// Only diffuse vertices can be connected; mirrors, glass and fuzzed metal
+// are always sampled. Fuzzed metal has no density to weigh, so light
+// subpaths end on it and the strategies that would need one to cross it
+// drop out of the weights. Light subpaths start on the part of an emitter
+// seen from the camera position: the emitters are large spheres mostly
+// hidden behind walls, and the rest of them still lights the scene through
+// the strategies starting at the eye. Light tracing writes to other pixels,
+// so every write to sumColor is atomic.
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+// A subpath vertex. beta is the subpath's throughput on arrival, before the
+// vertex's own BSDF.
+typedef struct PathVertex {
+	double3 pos;
+	// the hit's normal, the view direction for the eye
+	double3 nd;
+	double3 beta;
+	double3 color;
+	// material type, -1 for the eye
+	int type;
+	// sphere hit, -1 for shapes and the eye
+	int sphere;
+	// for emitters, the probability of the alias table drawing this one
+	double pick;
+} PathVertex;
+
+void atomicAddDouble(volatile __global double* p, double v) {
+	volatile __global ulong* bits = (volatile __global ulong*)p;
+	ulong old = *bits, seen;
+	do {
+		seen = old;
+		old = atom_cmpxchg(bits, seen, as_ulong(as_double(seen) + v));
+	} while (old != seen);
+}
+
+void splat(__global double3* sumColor, uint slot, double3 color) {
+	volatile __global double* p = (volatile __global double*)&sumColor[slot];
+	if (color.x != 0) atomicAddDouble(&p[0], color.x);
+	if (color.y != 0) atomicAddDouble(&p[1], color.y);
+	if (color.z != 0) atomicAddDouble(&p[2], color.z);
+}
+
+double cameraDistance(__constant Cam* cam) {
+	return cam->height / 2 / tan(cam->theta / 2);
+}
+
+// The eye getPixelRay shoots from.
+double3 cameraEye(__constant Cam* cam) {
+	return cam->pos - normalize(cam->lookAt) * cameraDistance(cam);
+}
+
+// Density over solid angle at the eye of getPixelRay's directions, 0 outside
+// the launch's window. pixel and film get the pixel and the point on the
+// film the direction passes through.
+double cameraPdf(__constant Cam* cam, double3 dir, int width, int height, int2* pixel, double3* film) {
+	double3 w = -normalize(cam->lookAt);
+	double3 v = normalize(cam->up);
+	double3 u = cross(v, w);
+	double distance = cameraDistance(cam);
+	double cosTheta = -dot(dir, w);
+	if (cosTheta <= 0) return 0;
+
+	*film = cam->pos + w * distance + dir * distance / cosTheta;
+	double3 corner = *film - (cam->pos - v * cam->height / 2 - u * cam->width / 2);
+	double fx = (dot(corner, u) / cam->width - cam->window.x) / cam->window.z;
+	double fy = (1 - dot(corner, v) / cam->height - cam->window.y) / cam->window.w;
+	if (fx < 0 || fx >= 1 || fy < 0 || fy >= 1) return 0;
+	*pixel = (int2)(min((int)(fx * width), width - 1), min((int)(fy * height), height - 1));
+	double area = cam->width * cam->window.z * cam->height * cam->window.w;
+	return distance * distance / (area * pow(cosTheta, 3));
+}
+
+// Probability of the alias table drawing the light on sphere id, for an
+// emitter found by chance; sampled ones keep what pickLight returned. The
+// entries are in sphere order.
+double lightPdf(__global const LightEntry* lights, const int lightCount, int id) {
+	int lo = 0, hi = lightCount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (lights[mid].sphere < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < lightCount && lights[lo].sphere == id ? lights[lo].pdf : 0;
+}
+
+// Density over area at y, with normal ny, of sampleSphereLight from p. 0 if
+// y faces away from p.
+double lightAreaPdf(double3 p, const Sphere* light, double3 y, double3 ny) {
+	double r2 = light->radius * light->radius, c2 = norm2(light->pos - p);
+	if (c2 <= r2) return 0;
+	double3 toP = p - y;
+	double d2 = norm2(toP);
+	double cosY = dot(ny, toP) / sqrt(d2);
+	if (cosY <= 0) return 0;
+	return cosY / (2 * M_PI * (1 - sqrt(1 - r2 / c2)) * d2);
+}
+
+// Whether the first thing seen from p towards y is the light on sphere id.
+bool lightVisible(double3 p, int id, double3 y, __constant Sphere* sphere, const int sphereSize,
+	__constant Shape* shape, const int shapeSize) {
+	Ray ray;
+	ray.pos = p;
+	ray.dir = normalize(y - p);
+	Hit hit;
+	return intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit) && hit.sphere == id;
+}
+
+// Whether nothing lies between a and b.
+bool visible(double3 a, double3 b, __constant Sphere* sphere, const int sphereSize, __constant Shape* shape,
+	const int shapeSize) {
+	Ray ray;
+	double d = length(b - a);
+	ray.pos = a;
+	ray.dir = (b - a) / d;
+	Hit hit;
+	return !intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit) || length(hit.pos - a) > d - 2 * EPS;
+}
+
+bool connectable(const PathVertex* v) {
+	return v->type <= 1;
+}
+
+// BSDF of a diffuse vertex between the directions to prev and next.
+double3 diffuseBsdf(const PathVertex* v, double3 prev, double3 next) {
+	if (v->type != 1 || dot(prev - v->pos, v->nd) * dot(next - v->pos, v->nd) <= 0) return (double3)(0, 0, 0);
+	return v->color / M_PI;
+}
+
+// Density over solid angle of v scattering light that arrives from prev
+// towards next. Specular types count as 0, their densities are deltas.
+double scatterPdf(double3 prev, const PathVertex* v, double3 next) {
+	if (v->type != 1) return 0;
+	double3 ns = dot(prev - v->pos, v->nd) > 0 ? v->nd : -v->nd;
+	return max(0.0, dot(ns, normalize(next - v->pos))) / M_PI;
+}
+
+// A solid angle density at from, as a density over area at to.
+double toArea(double pdf, double3 from, const PathVertex* to) {
+	double3 d = to->pos - from;
+	double d2 = norm2(d);
+	return pdf * fabs(dot(to->nd, d)) / (sqrt(d2) * d2);
+}
+
+// Densities next to a specular vertex are deltas on both sides and cancel.
+double remap0(double pdf) {
+	return pdf != 0 ? pdf : 1;
+}
+
+// Ratio of the densities of strategies j and j + 1, see misWeight.
+double misRatio(int j, const double* pl, const double* pc, double pNee, double pEmit) {
+	if (j == 0) return remap0(pc[0]) / pNee;
+	if (j == 1) return pNee * remap0(pc[1]) / (pEmit * remap0(pl[1]));
+	return remap0(pc[j]) / remap0(pl[j]);
+}
+
+// Balance heuristic weight of strategy s for the path x[0] (on an emitter)
+// to x[n - 1] (the eye). Strategy j takes x[0..j-1] from the light subpath
+// and the rest from the eye subpath; j = 1 is next event estimation, which
+// samples x[0] from x[1] rather than by emission. pEmit is the density of
+// emission at x[0]. Russian roulette is left out of the densities.
+double misWeight(const PathVertex* x, int n, int s, double pEmit, __constant Cam* cam, int width, int height,
+	__constant Sphere* sphere) {
+	// density over area of x[i] sampled from the light and from the eye
+	double pl[MAX_DEPTH + 1], pc[MAX_DEPTH + 1];
+	for (int i = 1; i < n - 1; i++) {
+		double3 from = x[i - 1].pos;
+		double pdf = i == 1 ? max(0.0, dot(x[0].nd, normalize(x[1].pos - from))) / M_PI
+			: scatterPdf(x[i - 2].pos, &x[i - 1], x[i].pos);
+		pl[i] = toArea(pdf, from, &x[i]);
+	}
+	for (int i = 0; i < n - 1; i++) {
+		double3 from = x[i + 1].pos;
+		double pdf;
+		if (i == n - 2) {
+			int2 pixel;
+			double3 film;
+			pdf = cameraPdf(cam, normalize(x[i].pos - from), width, height, &pixel, &film);
+		} else {
+			pdf = scatterPdf(x[i + 2].pos, &x[i + 1], x[i].pos);
+		}
+		pc[i] = toArea(pdf, from, &x[i]);
+	}
+	Sphere light = sphere[x[0].sphere];
+	double pNee = max(x[0].pick * lightAreaPdf(x[1].pos, &light, x[0].pos, x[0].nd), 1e-300);
+
+	double sum = 1, r = 1;
+	for (int j = s - 1; j >= 0; j--) {
+		r *= misRatio(j, pl, pc, pNee, pEmit);
+		if (j == 0 || (connectable(&x[j - 1]) && connectable(&x[j]) && (j > 1 || n > 2))) sum += r;
+	}
+	r = 1;
+	for (int j = s + 1; j < n; j++) {
+		// x[j - 1] would join the light subpath
+		if (j >= 2 && (pEmit == 0 || x[j - 1].type == 4)) break;
+		r /= misRatio(j - 1, pl, pc, pNee, pEmit);
+		if (connectable(&x[j - 1]) && connectable(&x[j]) && (j > 1 || n > 2)) sum += r;
+	}
+	return 1 / sum;
+}
+
+// Density of emission at the emitter vertex y, whichever strategy found it.
+double emitPdf(const PathVertex* y, __constant Cam* cam, __constant Sphere* sphere, const int sphereSize,
+	__constant Shape* shape, const int shapeSize) {
+	Sphere light = sphere[y->sphere];
+	double pdf = y->pick * lightAreaPdf(cam->pos, &light, y->pos, y->nd);
+	if (pdf == 0 || !lightVisible(cam->pos, y->sphere, y->pos, sphere, sphereSize, shape, shapeSize)) return 0;
+	return pdf;
+}
+
+// Lays out s light and t eye subpath vertices from the emitter to the eye.
+int joinPath(const PathVertex* lightPath, int s, const PathVertex* eyePath, int t, PathVertex* x) {
+	for (int i = 0; i < s; i++) x[i] = lightPath[i];
+	for (int i = 0; i < t; i++) x[s + i] = eyePath[t - 1 - i];
+	return s + t;
+}
+
+// Extends a subpath of count vertices along ray, beta being the throughput
+// the next vertex receives, and returns the new count. The walk ends when
+// it leaves the scene, on russian roulette or absorption, after maxCount
+// vertices, or at an emitter, which an eye subpath keeps as its last vertex.
+// Light subpaths also end before fuzzed metal.
+int extendPath(Ray ray, double3 beta, PathVertex* path, int count, int maxCount, bool fromLight,
+	__constant Sphere* sphere, const int sphereSize, __constant Shape* shape, const int shapeSize, Seed64* seed) {
+	while (count < maxCount) {
+		if (count > 1) {
+			if (rand(seed) > RR_P) break;
+			beta /= RR_P;
+		}
+		Hit hit;
+		if (!intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit)) break;
+		if (fromLight && (hit.mat.type == 0 || hit.mat.type == 4)) break;
+		// emitters only shine outwards
+		if (hit.mat.type == 0 && dot(hit.nd, ray.dir) >= 0) break;
+
+		PathVertex* v = &path[count++];
+		v->pos = hit.pos;
+		v->nd = hit.nd;
+		v->beta = beta;
+		v->color = hit.mat.color;
+		v->type = hit.mat.type;
+		v->sphere = hit.sphere;
+		v->pick = 0;
+		if (v->type == 0) break;
+
+		beta *= hit.mat.color;
+		if (v->type == 1) {
+			double3 ns = dot(ray.dir, hit.nd) < 0 ? hit.nd : -hit.nd;
+			ray.pos = hit.pos;
+			ray.dir = normalize(rand3(seed) + ns);
+		} else {
+			bool tir = false;
+			if (!scatter(&ray, &hit, seed, &tir)) break;
+		}
+	}
+	return count;
+}
+
+// One bidirectional sample of pixel coord. Returns what lands in the pixel
+// itself and splats light tracing into sumColor.
+double3 tracePaths(int2 coord, __constant Cam* cam, const int width, const int height, __constant Sphere* sphere,
+	const int sphereSize, __constant Shape* shape, const int shapeSize, __global const LightEntry* lights,
+	__global const LightNode* lightNodes, const int lightCount, __global double3* sumColor, Seed64* seed) {
+	PathVertex eyePath[MAX_DEPTH + 1], lightPath[MAX_DEPTH], x[MAX_DEPTH + 1];
+	double3 color = (double3)(0, 0, 0);
+
+	eyePath[0].pos = cameraEye(cam);
+	eyePath[0].nd = normalize(cam->lookAt);
+	eyePath[0].beta = (double3)(1, 1, 1);
+	eyePath[0].color = (double3)(0, 0, 0);
+	eyePath[0].type = -1;
+	eyePath[0].sphere = -1;
+	eyePath[0].pick = 0;
+	Ray ray = getPixelRay(cam, coord.x, coord.y, width, height, seed);
+	int eyeLength = extendPath(ray, eyePath[0].beta, eyePath, 1, MAX_DEPTH + 1, false, sphere, sphereSize, shape,
+		shapeSize, seed);
+	// only the last eye vertex can be an emitter
+	PathVertex* last = &eyePath[eyeLength - 1];
+	if (last->type == 0) last->pick = lightPdf(lights, lightCount, last->sphere);
+
+	// emission from the part of a light seen from the camera position,
+	// cosine-weighted around its normal; the alias table picks the light
+	int lightLength = 0;
+	double pEmit = 0, pick;
+	int lightId = pickLight(cam->pos, lights, lightNodes, lightCount, 0, seed, &pick);
+	if (lightId != -1) {
+		Sphere light = sphere[lightId];
+		Hit hit;
+		ray.pos = cam->pos;
+		if (sampleSphereLight(cam->pos, &light, seed, &ray.dir) > 0
+			&& intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit) && hit.sphere == lightId)
+			pEmit = pick * lightAreaPdf(cam->pos, &light, hit.pos, hit.nd);
+		if (pEmit > 0) {
+			PathVertex* y = &lightPath[0];
+			y->pos = hit.pos;
+			y->nd = hit.nd;
+			y->color = light.mat.color;
+			y->beta = y->color / pEmit;
+			y->type = 0;
+			y->sphere = lightId;
+			y->pick = pick;
+			ray.pos = y->pos;
+			ray.dir = normalize(rand3(seed) + y->nd);
+			lightLength = extendPath(ray, y->beta * M_PI, lightPath, 1, MAX_DEPTH, true, sphere, sphereSize, shape,
+				shapeSize, seed);
+		}
+	}
+
+	for (int t = 2; t <= eyeLength; t++) {
+		const PathVertex* pt = &eyePath[t - 1];
+
+		// the eye subpath reaching an emitter
+		if (pt->type == 0) {
+			int n = joinPath(lightPath, 0, eyePath, t, x);
+			double p = emitPdf(&x[0], cam, sphere, sphereSize, shape, shapeSize);
+			color += pt->beta * pt->color * misWeight(x, n, 0, p, cam, width, height, sphere);
+			continue;
+		}
+		if (!connectable(pt) || t > MAX_DEPTH) continue;
+		double3 prev = eyePath[t - 2].pos;
+
+		// next event estimation
+		int id = pickLight(pt->pos, lights, lightNodes, lightCount, 0, seed, &pick);
+		if (id != -1) {
+			Sphere light = sphere[id];
+			Hit hit;
+			ray.pos = pt->pos;
+			double solidAngle = sampleSphereLight(pt->pos, &light, seed, &ray.dir);
+			if (solidAngle > 0 && intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit) && hit.sphere == id
+				&& dot(hit.nd, ray.dir) < 0) {
+				PathVertex y;
+				y.pos = hit.pos;
+				y.nd = hit.nd;
+				y.color = light.mat.color;
+				y.beta = y.color;
+				y.type = 0;
+				y.sphere = id;
+				y.pick = pick;
+				double3 c = pt->beta * diffuseBsdf(pt, prev, y.pos) * fabs(dot(pt->nd, ray.dir)) * y.color
+					* solidAngle / pick;
+				if (c.x + c.y + c.z > 0) {
+					int n = joinPath(&y, 1, eyePath, t, x);
+					double p = emitPdf(&y, cam, sphere, sphereSize, shape, shapeSize);
+					color += c * misWeight(x, n, 1, p, cam, width, height, sphere);
+				}
+			}
+		}
+
+		// connections to the inner light vertices
+		for (int s = 2; s <= lightLength && s + t <= MAX_DEPTH + 1; s++) {
+			const PathVertex* qs = &lightPath[s - 1];
+			if (!connectable(qs)) continue;
+			double3 d = pt->pos - qs->pos;
+			double d2 = norm2(d);
+			double3 c = qs->beta * diffuseBsdf(qs, lightPath[s - 2].pos, pt->pos) * diffuseBsdf(pt, prev, qs->pos)
+				* pt->beta * fabs(dot(qs->nd, d) * dot(pt->nd, d)) / (d2 * d2);
+			if (c.x + c.y + c.z <= 0 || !visible(qs->pos, pt->pos, sphere, sphereSize, shape, shapeSize)) continue;
+			int n = joinPath(lightPath, s, eyePath, t, x);
+			color += c * misWeight(x, n, s, pEmit, cam, width, height, sphere);
+		}
+	}
+
+	// light tracing, into whichever pixel the eye sees the light vertex in
+	for (int s = 2; s <= lightLength; s++) {
+		const PathVertex* qs = &lightPath[s - 1];
+		if (!connectable(qs)) continue;
+		double3 d = qs->pos - eyePath[0].pos;
+		double d2 = norm2(d);
+		int2 pixel;
+		double3 film;
+		double pdf = cameraPdf(cam, d / sqrt(d2), width, height, &pixel, &film);
+		if (pdf == 0) continue;
+		double3 c = qs->beta * diffuseBsdf(qs, lightPath[s - 2].pos, eyePath[0].pos) * fabs(dot(qs->nd, d))
+			/ (sqrt(d2) * d2) * pdf;
+		if (c.x + c.y + c.z <= 0 || !visible(film, qs->pos, sphere, sphereSize, shape, shapeSize)) continue;
+		int n = joinPath(lightPath, s, eyePath, 1, x);
+		splat(sumColor, pixelSlot(pixel.x, pixel.y, width),
+			c * misWeight(x, n, s, pEmit, cam, width, height, sphere));
+	}
+	return color;
+}
+
+__kernel void kernelMain(TRACE_KERNEL_ARGS) {
+	uint idx;
+	int2 coord = workItemPixel(width, &idx);
+	if (coord.x >= width || coord.y >= height) return;
+
+	Seed64 seed = pixelSeed(Seed, coord.x, coord.y);
+	double3 color = (double3)(0, 0, 0);
+	for (int i = 0; i < sampleNum; i++)
+		color += tracePaths(coord, cam, width, height, sphere, sphereSize, shape, shapeSize, lights, lightNodes,
+			lightCount, sumColor, &seed);
+
+	splat(sumColor, idx, color);
+}
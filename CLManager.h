@@ -1,39 +1,60 @@
 #pragma once
 #include <CL/opencl.h>
+#include <functional>
 #include <iostream>
 #include <unordered_map>
+#include <vector>
 
+#include "CLResource.h"
+#include "GLInterop.h"
 #include "util.h"
+#include "DeviceSelector.h"
 
 class CLManager {
 protected:
 	cl_int err;
 
 private:
-	void initPlatform() {
-		err = clGetPlatformIDs(1, &platform, nullptr);
-		if (err != CL_SUCCESS) {
-			std::cerr << "Cannot get platform: " << TranslateOpenCLError(err) << std::endl;
-			return;
-		}
-	}
-
+	// Benchmark-driven choice among the devices of every platform, see
+	// DeviceSelector.h. Each calibration runs on a probe context of its own.
 	void initDevice() {
-		err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, nullptr);
-		if (err != CL_SUCCESS) {
+		DeviceSelector selector(hostCores);
+		int chosen = selector.select(devicePreference, calibrationKey, [this](const DeviceCandidate& c) {
+			if (!calibrate) return -1.0;
+			CLManager probe;
+			probe.initProbe(c.platform, c.device);
+			return probe.err == CL_SUCCESS ? calibrate(probe) : -1.0;
+		});
+		if (chosen < 0) {
+			err = CL_DEVICE_NOT_FOUND;
 			std::cerr << "Cannot get device: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
+		platform = selector.get(chosen).platform;
+		device = selector.get(chosen).device;
+		clRetainDevice(device);
 	}
 
+	// Shares with the current GL context when the device can, otherwise
+	// creates a plain context and the display copies through mapped buffers.
 	void initContext() {
-		cl_context_properties properties[] = {
-			CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-			CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-			CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-			0
-		};
-		context = clCreateContext(properties, 1, &device, nullptr, nullptr, &err);
+		std::vector<cl_context_properties> properties;
+		if (GLInterop::supportsSharing(device)) properties = GLInterop::sharingProperties(platform);
+		if (!properties.empty()) {
+			context = clCreateContext(properties.data(), 1, &device, nullptr, nullptr, &err);
+			glSharing = err == CL_SUCCESS;
+			if (!glSharing)
+				std::cerr << "Create shared context failed: " << TranslateOpenCLError(err) << std::endl;
+		}
+		if (glSharing) return;
+
+		std::cout << "No CL/GL sharing, displaying through mapped buffers" << std::endl;
+		initPlainContext();
+	}
+
+	void initPlainContext() {
+		cl_context_properties plain[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
+		context = clCreateContext(plain, 1, &device, nullptr, nullptr, &err);
 		if (err != CL_SUCCESS) {
 			std::cerr << "Create context failed: " << TranslateOpenCLError(err) << std::endl;
 			return;
@@ -41,11 +62,13 @@ private:
 	}
 
 	void initQueue() {
-		queue = clCreateCommandQueue(context, device, 0, &err);
+		queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
 		if (err != CL_SUCCESS) {
 			std::cerr << "Create command queue failed: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
+		pool.init(context, queue, device);
+		if (memoryBudget) pool.setBudget(memoryBudget);
 	}
 
 public:
@@ -54,17 +77,43 @@ public:
 	cl_context context = 0;
 	cl_command_queue queue = 0;
 	cl_program program = 0;
-	std::unordered_map<std::string, cl_kernel> kernels;
+	// context shares objects with the GL context (cl_khr_gl_sharing)
+	bool glSharing = false;
+	std::unordered_map<std::string, CLKernel> kernels;
+	// every program built by createProgramFromFiles, keyed by options and files
+	std::unordered_map<std::string, CLProgram> programCache;
+	BufferPool pool;
+
+	// device selection: a name to look for instead of calibrating, cores a
+	// CPU device leaves to the host, and the calibration render with the key
+	// its timings are cached under
+	std::string devicePreference;
+	cl_uint hostCores = 2;
+	std::function<double(CLManager& probe)> calibrate;
+	std::string calibrationKey;
+	// device memory the pool may use in bytes, 0 for all of it
+	size_t memoryBudget = 0;
 
 	void init() {
 		err = 0;
-		initPlatform();
 		initDevice();
+		if (err != CL_SUCCESS) return;
 		initContext();
 		initQueue();
 		program = 0;
 	}
 
+	// Context and queue on the given device, without GL, for calibration.
+	void initProbe(cl_platform_id p, cl_device_id d) {
+		err = 0;
+		platform = p;
+		device = d;
+		clRetainDevice(device);
+		initPlainContext();
+		if (err != CL_SUCCESS) return;
+		initQueue();
+	}
+
 	bool createKernels() {
 		cl_uint num = 0;
 		err = clCreateKernelsInProgram(program, 0, nullptr, &num);
@@ -73,71 +122,110 @@ public:
 			return false;
 		}
 
-		cl_kernel* tmpKernels = new cl_kernel[num];
-		const int bufferSize = 256;
-		char* kernalName = new char[bufferSize];
-		clCreateKernelsInProgram(program, num, tmpKernels, nullptr);
-		for (int i = 0; i < num; i++) {
-			clGetKernelInfo(tmpKernels[i], CL_KERNEL_FUNCTION_NAME, bufferSize, kernalName, nullptr);
-			kernels[kernalName] = tmpKernels[i];
+		std::vector<cl_kernel> tmpKernels(num);
+		char kernalName[256];
+		clCreateKernelsInProgram(program, num, tmpKernels.data(), nullptr);
+		for (cl_kernel kernel : tmpKernels) {
+			clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernalName), kernalName, nullptr);
+			kernels[kernalName] = CLKernel(kernel);
 		}
 
-		delete[] kernalName;
-
 		return true;
 	}
 
-	bool createProgramFromFiles(const std::vector<std::string>& fileNames) {
-		if (program) clReleaseProgram(program);
-
-		size_t num = fileNames.size();
-		char** buffers = new char* [num];
-		size_t* lens = new size_t[num];
-		for (int i = 0; i < num; i++) {
-			err = ReadSourceFromFile(fileNames[i].c_str(), &(buffers[i]), &(lens[i]));
-			if (err != CL_SUCCESS)
-			{
-				std::cerr << "Read source from file \"" << fileNames[i] << "\" failed: "
+	// Builds a program without touching program/kernels, empty on failure.
+	CLProgram buildProgram(const std::vector<std::string>& fileNames, const std::string& options = "") {
+		std::string sources;
+		for (const std::string& fileName : fileNames) {
+			char* buffer;
+			size_t len;
+			err = ReadSourceFromFile(fileName.c_str(), &buffer, &len);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Read source from file \"" << fileName << "\" failed: "
 					<< TranslateOpenCLError(err) << std::endl;
-				return false;
+				return CLProgram();
 			}
+			sources += buffer;
+			delete[] buffer;
 		}
 
-		program = clCreateProgramWithSource(context, num, (const char**)buffers, lens, &err);
+		const char* source = sources.c_str();
+		size_t len = sources.size();
+		CLProgram ret(clCreateProgramWithSource(context, 1, &source, &len, &err));
 		if (err != CL_SUCCESS) {
 			std::cerr << "Couldn't create the program: " << TranslateOpenCLError(err) << std::endl;
-			return false;
+			return CLProgram();
 		}
 
-		err = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
+		err = clBuildProgram(ret, 1, &device, options.c_str(), nullptr, nullptr);
 		if (err != CL_SUCCESS) {
 			size_t logSize;
-			clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
-			char* programLog = new char[logSize + 1];
-			programLog[logSize] = 0;
-			clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, programLog, &logSize);
-			std::cerr << programLog << std::endl;
-			delete[] programLog;
-			return false;
+			clGetProgramBuildInfo(ret, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+			std::string programLog(logSize, 0);
+			clGetProgramBuildInfo(ret, device, CL_PROGRAM_BUILD_LOG, logSize, &programLog[0], nullptr);
+			std::cerr << programLog.c_str() << std::endl;
+			return CLProgram();
 		}
 
-		for (int i = 0; i < num; i++) delete[] buffers[i];
-		delete[] buffers;
-		delete[] lens;
+		return ret;
+	}
+
+	// Cached build of the given files and options, 0 on failure. Building a
+	// variant ahead of time makes a later createProgramFromFiles free.
+	cl_program getProgram(const std::vector<std::string>& fileNames, const std::string& options = "") {
+		std::string key = options;
+		for (const std::string& fileName : fileNames) key += "|" + fileName;
+		auto it = programCache.find(key);
+		if (it != programCache.end()) return it->second;
+
+		CLProgram ret = buildProgram(fileNames, options);
+		cl_program raw = ret;
+		if (raw) programCache[key] = std::move(ret);
+		return raw;
+	}
+
+	// Switching back to a variant that was built before skips the compiler.
+	bool createProgramFromFiles(const std::vector<std::string>& fileNames, const std::string& options = "") {
+		clearKernels();
+
+		program = getProgram(fileNames, options);
+		if (!program) return false;
 
 		if (!createKernels()) return false;
 
 		return true;
 	}
 
+	// Concatenated sources, as the compiler sees them. Used to key cached results.
+	std::string readSources(const std::vector<std::string>& fileNames) {
+		std::string ret;
+		for (const std::string& fileName : fileNames) {
+			char* buffer;
+			size_t len;
+			if (ReadSourceFromFile(fileName.c_str(), &buffer, &len) != CL_SUCCESS) continue;
+			ret += buffer;
+			delete[] buffer;
+		}
+		return ret;
+	}
+
+	std::string getDeviceString(cl_device_info param) {
+		size_t len = 0;
+		clGetDeviceInfo(device, param, 0, nullptr, &len);
+		std::string ret(len, 0);
+		clGetDeviceInfo(device, param, len, &ret[0], nullptr);
+		if (!ret.empty() && ret.back() == 0) ret.pop_back();
+		return ret;
+	}
+
 	void clearKernels() {
-		for (auto& it : kernels)
-			if (it.second) clReleaseKernel(it.second);
+		kernels.clear();
 	}
 
 	~CLManager() {
 		clearKernels();
-		clReleaseProgram(program);
+		programCache.clear();
+		pool.trim();
 		clReleaseCommandQueue(queue);
 		clReleaseContext(context);
 		clReleaseDevice(device);
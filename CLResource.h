@@ -0,0 +1,283 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdint.h>
+#include <algorithm>
+#include <initializer_list>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+inline void releaseCL(cl_mem m) { clReleaseMemObject(m); }
+inline void releaseCL(cl_kernel k) { clReleaseKernel(k); }
+inline void releaseCL(cl_program p) { clReleaseProgram(p); }
+
+// Move-only owner of an OpenCL object, released when it goes out of scope.
+// Converts to the raw handle so it can be passed to the API as is.
+template <typename T>
+class CLHandle {
+private:
+	T handle = 0;
+
+public:
+	CLHandle() = default;
+	explicit CLHandle(T h) : handle(h) {}
+	CLHandle(CLHandle&& o) noexcept : handle(o.handle) { o.handle = 0; }
+	CLHandle& operator=(CLHandle&& o) noexcept {
+		if (this != &o) {
+			reset();
+			handle = o.handle;
+			o.handle = 0;
+		}
+		return *this;
+	}
+	CLHandle(const CLHandle&) = delete;
+	CLHandle& operator=(const CLHandle&) = delete;
+	~CLHandle() { reset(); }
+
+	void reset(T h = 0) {
+		if (handle) releaseCL(handle);
+		handle = h;
+	}
+
+	T get() const { return handle; }
+	operator T() const { return handle; }
+	// for clSetKernelArg
+	const T* ptr() const { return &handle; }
+};
+
+typedef CLHandle<cl_mem> CLMem;
+typedef CLHandle<cl_kernel> CLKernel;
+typedef CLHandle<cl_program> CLProgram;
+
+class BufferPool;
+
+// What device memory is spent on, for the footprint report.
+enum MemCategory { MemScene, MemAcceleration, MemAccumulation, MemOutput, MemScratch, MemCategories };
+
+inline const char* memCategoryName(MemCategory c) {
+	const char* names[] = { "scene", "acceleration", "accumulation", "output", "scratch" };
+	return names[c];
+}
+
+// A buffer on loan from a BufferPool, handed back when it goes out of scope.
+// It may be larger than asked for.
+class PooledBuffer {
+private:
+	BufferPool* pool = nullptr;
+	cl_mem mem = 0;
+	size_t bytes = 0, capacity = 0;
+	cl_mem_flags flags = 0;
+	MemCategory category = MemScratch;
+
+	friend class BufferPool;
+	PooledBuffer(BufferPool* p, cl_mem m, size_t size, size_t cap, cl_mem_flags f, MemCategory c)
+		: pool(p), mem(m), bytes(size), capacity(cap), flags(f), category(c) {}
+
+public:
+	PooledBuffer() = default;
+	PooledBuffer(PooledBuffer&& o) noexcept { *this = std::move(o); }
+	PooledBuffer& operator=(PooledBuffer&& o) noexcept {
+		if (this != &o) {
+			reset();
+			pool = o.pool;
+			mem = o.mem;
+			bytes = o.bytes;
+			capacity = o.capacity;
+			flags = o.flags;
+			category = o.category;
+			o.mem = 0;
+		}
+		return *this;
+	}
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+	~PooledBuffer() { reset(); }
+
+	inline void reset();
+
+	operator cl_mem() const { return mem; }
+	const cl_mem* ptr() const { return &mem; }
+	// bytes asked for
+	size_t size() const { return bytes; }
+};
+
+struct PoolStats {
+	// clCreateBuffer calls and their bytes, acquires served from the free list
+	size_t allocations = 0, reuses = 0;
+	size_t allocatedBytes = 0;
+	// in use (on loan or tracked), waiting in the free list, and the most
+	// the pool ever held
+	size_t liveBytes = 0, pooledBytes = 0, peakBytes = 0;
+	// in use per category and the most each ever used
+	size_t categoryBytes[MemCategories] = {}, categoryPeak[MemCategories] = {};
+	// refused for the budget or the device's largest allocation
+	size_t refusals = 0;
+};
+
+// Device buffers of one context. Returned buffers wait in a free list and
+// serve later requests with the same flags and a size between half and all
+// of theirs, so scene swaps and temporary render targets don't go back to
+// the driver. Host data is uploaded with a blocking write, so pooled
+// buffers never use CL_MEM_USE_HOST_PTR.
+//
+// Everything in use counts against a budget, by default the device's
+// global memory, and no buffer may exceed its largest allocation. Drivers
+// often allocate on first use, so exceeding the device shows up late as an
+// enqueue failure; the budget refuses up front, and callers ask fits()
+// before asking for memory they can do without. Objects the pool doesn't
+// own, such as GL-shared ones, are added with track().
+class BufferPool {
+private:
+	struct Free {
+		cl_mem mem;
+		size_t capacity;
+		cl_mem_flags flags;
+	};
+
+	cl_context context = 0;
+	cl_command_queue queue = 0;
+	std::vector<Free> freeList;
+	PoolStats stats;
+	size_t budget = SIZE_MAX, maxAlloc = SIZE_MAX;
+
+	void use(MemCategory category, size_t size) {
+		stats.liveBytes += size;
+		stats.categoryBytes[category] += size;
+		stats.categoryPeak[category] = std::max(stats.categoryPeak[category], stats.categoryBytes[category]);
+		stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes + stats.pooledBytes);
+	}
+
+	void unuse(MemCategory category, size_t size) {
+		stats.liveBytes -= size;
+		stats.categoryBytes[category] -= size;
+	}
+
+	static bool outOfMemory(cl_int ret) {
+		return ret == CL_MEM_OBJECT_ALLOCATION_FAILURE || ret == CL_OUT_OF_RESOURCES;
+	}
+
+public:
+	void init(cl_context c, cl_command_queue q, cl_device_id device) {
+		context = c;
+		queue = q;
+		cl_ulong global = 0, largest = 0;
+		if (clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global), &global, nullptr) == CL_SUCCESS
+			&& global)
+			budget = (size_t)std::min<cl_ulong>(global, SIZE_MAX);
+		if (clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(largest), &largest, nullptr) == CL_SUCCESS
+			&& largest)
+			maxAlloc = (size_t)std::min<cl_ulong>(largest, SIZE_MAX);
+	}
+
+	// Caps the budget below the device's global memory.
+	void setBudget(size_t bytes) {
+		budget = std::min(budget, bytes);
+	}
+
+	size_t getBudget() const { return budget; }
+	size_t getMaxAlloc() const { return maxAlloc; }
+
+	// Whether buffers of these sizes could be had on top of what is in use,
+	// counting the free list as reclaimable.
+	bool fits(std::initializer_list<size_t> sizes) const {
+		size_t total = stats.liveBytes;
+		for (size_t size : sizes) {
+			if (size > maxAlloc) return false;
+			total += size;
+		}
+		return total <= budget;
+	}
+
+	// Adds (or with a negative size removes) memory the pool doesn't own.
+	void track(MemCategory category, long long size) {
+		if (size >= 0) use(category, (size_t)size);
+		else unuse(category, (size_t)-size);
+	}
+
+	// A buffer of at least size bytes, filled from data if given. Failures
+	// are reported through err and leave the handle empty; going over the
+	// budget or the largest allocation is also logged with the footprint.
+	PooledBuffer acquire(size_t size, cl_mem_flags flags, MemCategory category, const void* data = nullptr,
+		cl_int* err = nullptr) {
+		cl_int ret = CL_SUCCESS;
+		flags &= ~(cl_mem_flags)CL_MEM_COPY_HOST_PTR;
+		size = std::max<size_t>(size, 1);
+		int best = -1;
+		for (size_t i = 0; i < freeList.size(); i++) {
+			const Free& f = freeList[i];
+			if (f.flags != flags || f.capacity < size || f.capacity / 2 > size) continue;
+			if (best < 0 || f.capacity < freeList[best].capacity) best = (int)i;
+		}
+
+		PooledBuffer buffer;
+		if (best >= 0) {
+			Free f = freeList[best];
+			freeList.erase(freeList.begin() + best);
+			stats.reuses++;
+			stats.pooledBytes -= f.capacity;
+			use(category, f.capacity);
+			buffer = PooledBuffer(this, f.mem, size, f.capacity, flags, category);
+		} else if (size > maxAlloc || stats.liveBytes + size > budget) {
+			ret = size > maxAlloc ? CL_INVALID_BUFFER_SIZE : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+			stats.refusals++;
+			std::cerr << "Can't fit " << size / 1024 << " KB of " << memCategoryName(category) << " device memory ("
+				<< (size > maxAlloc ? "largest allocation " : "budget ") << (size > maxAlloc ? maxAlloc : budget) / 1024
+				<< " KB)" << std::endl;
+			report(std::cerr);
+		} else {
+			// free buffers nobody asked for make room first
+			if (stats.liveBytes + stats.pooledBytes + size > budget) trim();
+			cl_mem mem = clCreateBuffer(context, flags, size, nullptr, &ret);
+			if (outOfMemory(ret) && !freeList.empty()) {
+				trim();
+				mem = clCreateBuffer(context, flags, size, nullptr, &ret);
+			}
+			if (ret == CL_SUCCESS) {
+				stats.allocations++;
+				stats.allocatedBytes += size;
+				use(category, size);
+				buffer = PooledBuffer(this, mem, size, size, flags, category);
+			}
+		}
+		if (ret == CL_SUCCESS && data)
+			ret = clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, size, data, 0, nullptr, nullptr);
+		if (ret != CL_SUCCESS) buffer.reset();
+		if (err) *err = ret;
+		return buffer;
+	}
+
+	void recycle(cl_mem mem, size_t capacity, cl_mem_flags flags, MemCategory category) {
+		freeList.push_back({ mem, capacity, flags });
+		unuse(category, capacity);
+		stats.pooledBytes += capacity;
+	}
+
+	// Releases the buffers nobody holds.
+	void trim() {
+		for (const Free& f : freeList) clReleaseMemObject(f.mem);
+		freeList.clear();
+		stats.pooledBytes = 0;
+	}
+
+	const PoolStats& getStats() const { return stats; }
+
+	void report(std::ostream& out) const {
+		out << "Device buffers: " << stats.allocations << " allocations (" << stats.allocatedBytes / 1024 << " KB), "
+			<< stats.reuses << " reused, " << stats.liveBytes / 1024 << " KB in use, " << stats.pooledBytes / 1024
+			<< " KB pooled, peak " << stats.peakBytes / 1024 << " KB";
+		if (budget != SIZE_MAX) out << " of " << budget / 1024 << " KB";
+		if (stats.refusals) out << ", " << stats.refusals << " refused";
+		out << std::endl << "  in use (peak):";
+		for (int c = 0; c < MemCategories; c++)
+			out << (c ? "," : "") << " " << memCategoryName((MemCategory)c) << " " << stats.categoryBytes[c] / 1024
+				<< " KB (" << stats.categoryPeak[c] / 1024 << ")";
+		out << std::endl;
+	}
+
+	~BufferPool() { trim(); }
+};
+
+inline void PooledBuffer::reset() {
+	if (mem) pool->recycle(mem, capacity, flags, category);
+	mem = 0;
+}
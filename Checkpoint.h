@@ -0,0 +1,202 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Everything a progressive render needs to carry on where it stopped: the
+// accumulation in its device layout, the sample counts, the launch seed
+// stream and a hash of what the accumulation depends on.
+struct Checkpoint {
+	cl_ulong sceneHash = 0;
+	cl_int width = 0, height = 0;
+	cl_ulong sampleCount = 0, tracedSamples = 0;
+	cl_uint seedBase = 0;
+	cl_ulong launchIndex = 0;
+	std::vector<cl_double3> accum;
+	// path guide schedule, histograms and distributions, empty unless guiding
+	std::vector<unsigned char> guide;
+};
+
+// Lossless packing of accumulation buffers. Each channel is XORed with the
+// same channel of the previous slot and the result split into byte planes:
+// neighbouring sums share sign, exponent and leading mantissa bits, so the
+// high planes are mostly zero, and zero runs are stored as a 0 byte and
+// their length.
+namespace CheckpointFile {
+	const char magic[4] = { 'R', 'T', 'C', 'K' };
+	const cl_uint version = 2;
+
+	static void putRun(std::vector<unsigned char>& out, size_t run) {
+		out.push_back(0);
+		while (run >= 0x80) {
+			out.push_back((run & 0x7f) | 0x80);
+			run >>= 7;
+		}
+		out.push_back(run);
+	}
+
+	static std::vector<unsigned char> pack(const std::vector<cl_double3>& accum) {
+		size_t count = accum.size() * 3;
+		std::vector<cl_ulong> delta(count);
+		cl_ulong prev[3] = { 0, 0, 0 };
+		for (size_t i = 0; i < accum.size(); i++) {
+			for (int c = 0; c < 3; c++) {
+				cl_ulong bits;
+				memcpy(&bits, &accum[i].s[c], sizeof(bits));
+				delta[i * 3 + c] = bits ^ prev[c];
+				prev[c] = bits;
+			}
+		}
+
+		std::vector<unsigned char> out;
+		size_t run = 0;
+		for (int plane = 7; plane >= 0; plane--) {
+			for (size_t i = 0; i < count; i++) {
+				unsigned char byte = (delta[i] >> (plane * 8)) & 0xff;
+				if (byte == 0) {
+					run++;
+					continue;
+				}
+				if (run) putRun(out, run);
+				run = 0;
+				out.push_back(byte);
+			}
+		}
+		if (run) putRun(out, run);
+		return out;
+	}
+
+	static bool unpack(const std::vector<unsigned char>& in, std::vector<cl_double3>& accum) {
+		size_t count = accum.size() * 3, total = count * 8, pos = 0, n = 0;
+		std::vector<cl_ulong> delta(count, 0);
+		while (pos < in.size() && n < total) {
+			unsigned char byte = in[pos++];
+			if (byte == 0) {
+				size_t run = 0;
+				for (int shift = 0; pos < in.size(); shift += 7) {
+					unsigned char b = in[pos++];
+					run |= (size_t)(b & 0x7f) << shift;
+					if (!(b & 0x80)) break;
+				}
+				n += run;
+				continue;
+			}
+			int plane = 7 - n / count;
+			delta[n % count] |= (cl_ulong)byte << (plane * 8);
+			n++;
+		}
+		if (n != total) return false;
+
+		cl_ulong prev[3] = { 0, 0, 0 };
+		for (size_t i = 0; i < accum.size(); i++) {
+			for (int c = 0; c < 3; c++) {
+				prev[c] ^= delta[i * 3 + c];
+				memcpy(&accum[i].s[c], &prev[c], sizeof(prev[c]));
+			}
+			accum[i].s[3] = 0;
+		}
+		return true;
+	}
+
+	template <typename T>
+	static void write(std::ofstream& out, const T& value) {
+		out.write((const char*)&value, sizeof(T));
+	}
+
+	template <typename T>
+	static bool read(std::ifstream& in, T& value) {
+		return (bool)in.read((char*)&value, sizeof(T));
+	}
+
+	// Written next to path and moved over it in one step, so a crash at any
+	// point leaves the previous checkpoint intact.
+	static bool save(const std::string& path, const Checkpoint& cp) {
+		std::vector<unsigned char> packed = pack(cp.accum);
+		std::string tmp = path + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::binary);
+			out.write(magic, sizeof(magic));
+			write(out, version);
+			write(out, cp.sceneHash);
+			write(out, cp.width);
+			write(out, cp.height);
+			write(out, cp.sampleCount);
+			write(out, cp.tracedSamples);
+			write(out, cp.seedBase);
+			write(out, cp.launchIndex);
+			write(out, (cl_ulong)cp.accum.size());
+			write(out, (cl_ulong)packed.size());
+			out.write((const char*)packed.data(), packed.size());
+			write(out, (cl_ulong)cp.guide.size());
+			out.write((const char*)cp.guide.data(), cp.guide.size());
+			if (!out) return false;
+		}
+#ifdef _WIN32
+		return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+	}
+
+	// Refuses files that don't hold expectedSlots accumulation slots, before
+	// allocating anything the header asks for.
+	static bool load(const std::string& path, size_t expectedSlots, Checkpoint& cp) {
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		cl_ulong fileSize = in ? (cl_ulong)in.tellg() : 0;
+		in.seekg(0);
+		char fileMagic[4];
+		cl_uint fileVersion;
+		cl_ulong slots, packedSize;
+		if (!in.read(fileMagic, sizeof(fileMagic)) || memcmp(fileMagic, magic, sizeof(magic)) != 0) return false;
+		if (!read(in, fileVersion) || fileVersion != version) return false;
+		bool ok = read(in, cp.sceneHash) && read(in, cp.width) && read(in, cp.height)
+			&& read(in, cp.sampleCount) && read(in, cp.tracedSamples) && read(in, cp.seedBase)
+			&& read(in, cp.launchIndex) && read(in, slots) && read(in, packedSize);
+		if (!ok || slots != expectedSlots || packedSize > fileSize - (cl_ulong)in.tellg()) return false;
+
+		std::vector<unsigned char> packed(packedSize);
+		cl_ulong guideSize;
+		if (!in.read((char*)packed.data(), packedSize) || !read(in, guideSize)
+			|| guideSize > fileSize - (cl_ulong)in.tellg())
+			return false;
+		cp.guide.resize(guideSize);
+		if (!in.read((char*)cp.guide.data(), guideSize)) return false;
+		cp.accum.resize(slots);
+		return unpack(packed, cp.accum);
+	}
+}
+
+// Packs and writes checkpoints on a thread of its own. A checkpoint that
+// comes in while the previous one is still being written is dropped rather
+// than queued, so the renderer never waits on the disk.
+class CheckpointWriter {
+private:
+	std::future<bool> pending;
+
+public:
+	bool busy() {
+		return pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+	}
+
+	bool write(const std::string& path, Checkpoint&& cp) {
+		if (busy()) return false;
+		if (pending.valid() && !pending.get()) std::cerr << "Writing checkpoint " << path << " failed" << std::endl;
+		pending = std::async(std::launch::async, [path](Checkpoint cp) {
+			return CheckpointFile::save(path, cp);
+		}, std::move(cp));
+		return true;
+	}
+
+	~CheckpointWriter() {
+		if (pending.valid()) pending.wait();
+	}
+};
@@ -0,0 +1,586 @@
+// Device library shared by every render mode. The host puts it in front of
+// the mode's own file, so all modes see the same scene layout, camera and
+// accumulation buffer, and toneMap/resampleAccum work for each of them.
+//
+// SPHERE_COUNT and SHAPE_COUNT may be passed by the host to fix (and fully
+// unroll) the sphere and shape loops for the loaded scene.
+#ifndef EPS
+#define EPS 1e-3
+#endif
+
+// Russian roulette survival probability and bounce limit of the path
+// tracing modes. MATERIAL_MASK has bit t set for every material type t in
+// the scene, so the other branches are compiled out.
+#ifndef RR_P
+#define RR_P 0.8
+#endif
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 10
+#endif
+#ifndef MATERIAL_MASK
+#define MATERIAL_MASK 0x1f
+#endif
+#define HAS_MATERIAL(t) ((MATERIAL_MASK >> (t)) & 1)
+
+// Order in which work items walk the image, and the matching sumColor layout:
+// 0 row-major, 1 Morton (Z-order) inside TILE_SIZE tiles, 2 row-major inside
+// TILE_SIZE tiles. TILE_SIZE has to be a power of two for Morton order.
+#ifndef PIXEL_ORDER
+#define PIXEL_ORDER 0
+#endif
+#ifndef TILE_SIZE
+#define TILE_SIZE 8
+#endif
+
+typedef ulong llu;
+
+typedef struct Seed64 {
+	llu k1, k2;
+} Seed64;
+
+typedef struct Ray {
+	double3 pos;
+	double3 dir;
+} Ray;
+
+typedef struct Cam {
+	double theta;
+	double width;
+	double height;
+	double3 pos;
+	double3 up;
+	double3 lookAt;
+	// part of the image a launch covers, (x, y, width, height) as fractions
+	// of the whole with y down; (0, 0, 1, 1) except for offline tiles
+	double4 window;
+} Cam;
+
+typedef struct Material {
+	double refractionCoefficient;
+	double reflectionWeight;
+	int type;
+	double3 color;
+} Material;
+
+typedef struct Sphere {
+	double radius;
+	double3 pos;
+	Material mat;
+} Sphere;
+
+// Flat primitives, kept apart from the spheres. What a, b and c hold
+// depends on the type.
+#define SHAPE_PLANE 0 // a: a point on the plane, b: its normal
+#define SHAPE_QUAD 1 // a: a corner, b and c: the edges leaving it
+#define SHAPE_BOX 2 // a: min corner, b: max corner (axis-aligned)
+
+typedef struct Shape {
+	int type;
+	double3 a;
+	double3 b;
+	double3 c;
+	Material mat;
+} Shape;
+
+// Closest intersection along a ray, see intersectScene.
+typedef struct Hit {
+	double3 pos;
+	// unit normal; outward for spheres and boxes, facing the ray for planes and quads
+	double3 nd;
+	Material mat;
+	// index of the sphere hit, -1 for a shape
+	int sphere;
+} Hit;
+
+// Emitters, built on the host when the scene loads (see LightList.h).
+typedef struct LightEntry {
+	double prob;
+	double pdf;
+	int alias;
+	int sphere;
+} LightEntry;
+
+typedef struct LightNode {
+	double3 center;
+	double radius;
+	double power;
+	int left;
+	int right;
+} LightNode;
+
+// Path guiding grid over the scene (PathGuide.h), used by the path tracer.
+typedef struct GuideGrid {
+	double3 lo;
+	double3 cellSize;
+	// probability of sampling the learned distribution instead of the BSDF
+	double mix;
+	// whether paths add what they find to the training histograms
+	int train;
+} GuideGrid;
+
+// Arguments every mode's kernelMain takes, so the host binds them the same way.
+#define TRACE_KERNEL_ARGS __constant Sphere* sphere, const int sphereSize, __constant Cam* cam, \
+	const uint Seed, const int sampleNum, __global double3* sumColor, __global ulong* utilization, \
+	const int width, const int height, __global const LightEntry* lights, __global const LightNode* lightNodes, \
+	const int lightCount, const int lightNodeCount, __constant Shape* shape, const int shapeSize
+
+static llu rand64(Seed64* seed)
+{
+	llu k3 = seed->k1, k4 = seed->k2;
+	seed->k1 = k4;
+	k3 ^= k3 << 11;
+	seed->k2 = k3 ^ k4 ^ (k3 >> 8) ^ (k4 >> 13);
+	return seed->k2 + k4;
+}
+
+static double rand(Seed64* seed) {
+	return (double)rand64(seed) / (-1lu);
+}
+
+static double norm2(double3 v) {
+	return v.x * v.x + v.y * v.y + v.z * v.z;
+}
+
+Ray getPixelRay(__constant Cam* cam, int x, int y, int width, int height, Seed64* seed) {
+	Ray ret;
+	double3 w = -normalize(cam->lookAt);
+	double3 v = normalize(cam->up);
+	double3 u = cross(v, w);
+	double halfHeight = cam->height / 2;
+	double halfWidth = cam->width / 2;
+	double distance = halfHeight / tan(cam->theta / 2);
+	double3 eyePos = cam->pos + w * distance;
+	double3 leftBottomPos = cam->pos - v * halfHeight - u * halfWidth;
+	double tu = cam->window.x + (x + rand(seed)) / width * cam->window.z;
+	double tv = 1.0 - (cam->window.y + (y + rand(seed)) / height * cam->window.w);
+
+	ret.pos = leftBottomPos + tu * cam->width * u + tv * cam->height * v;
+	ret.dir = normalize(ret.pos - eyePos);
+
+	return ret;
+}
+
+double getFirstCollideWithSphere(const Ray* ray, const Sphere* sphere) {
+	double a = pow(ray->dir.x, 2) + pow(ray->dir.y, 2) + pow(ray->dir.z, 2);
+	double b = 2 * (ray->dir.x * (ray->pos.x - sphere->pos.x)
+		+ ray->dir.y * (ray->pos.y - sphere->pos.y)
+		+ ray->dir.z * (ray->pos.z - sphere->pos.z));
+	double c = pow(ray->pos.x - sphere->pos.x, 2)
+		+ pow(ray->pos.y - sphere->pos.y, 2)
+		+ pow(ray->pos.z - sphere->pos.z, 2)
+		- pow(sphere->radius, 2);
+	double delta = b * b - 4 * a * c;
+	if (delta <= 0) return -1;
+	delta = sqrt(delta);
+	double t = (-b - delta) / (2 * a);
+	if (t > EPS) return t;
+	t = (-b + delta) / (2 * a);
+	if (t > EPS) return t;
+	return -1;
+}
+
+// Ray parameter of the closest sphere hit, 0 if there is none.
+double getFirstCollide(const Ray* ray, __constant Sphere* sphere, const int sphereSize, int* id) {
+	*id = -1;
+	double mm = 0;
+#if defined(SPHERE_COUNT)
+#pragma unroll
+	for (int i = 0; i < SPHERE_COUNT; i++)
+#else
+#ifdef UNROLL_SPHERES
+#pragma unroll 4
+#endif
+	for (int i = 0; i < sphereSize; i++)
+#endif
+	{
+		Sphere nows = sphere[i];
+		double t = getFirstCollideWithSphere(ray, &nows);
+		if (t == -1) continue;
+		if (mm == 0 || t < mm) {
+			mm = t;
+			*id = i;
+		}
+	}
+	return mm;
+}
+
+// Flat primitives: planes, parallelograms and axis-aligned boxes.
+double getFirstCollideWithPlane(const Ray* ray, double3 p, double3 n) {
+	double denom = dot(n, ray->dir);
+	if (fabs(denom) < 1e-12) return -1;
+	double t = dot(p - ray->pos, n) / denom;
+	return t > EPS ? t : -1;
+}
+
+double getFirstCollideWithQuad(const Ray* ray, double3 corner, double3 u, double3 v) {
+	double3 n = cross(u, v);
+	double t = getFirstCollideWithPlane(ray, corner, n);
+	if (t == -1) return -1;
+	// coordinates of the hit along u and v
+	double3 d = ray->pos + t * ray->dir - corner;
+	double3 w = n / dot(n, n);
+	double s = dot(w, cross(d, v)), r = dot(w, cross(u, d));
+	return s >= 0 && s <= 1 && r >= 0 && r <= 1 ? t : -1;
+}
+
+// Slab test. From inside the box the exit is returned, as for spheres.
+double getFirstCollideWithBox(const Ray* ray, double3 lo, double3 hi) {
+	double3 inv = 1.0 / ray->dir;
+	double3 t0 = (lo - ray->pos) * inv, t1 = (hi - ray->pos) * inv;
+	double3 tNear = fmin(t0, t1), tFar = fmax(t0, t1);
+	double enter = max(max(tNear.x, tNear.y), tNear.z), leave = min(min(tFar.x, tFar.y), tFar.z);
+	if (enter > leave) return -1;
+	if (enter > EPS) return enter;
+	if (leave > EPS) return leave;
+	return -1;
+}
+
+double getFirstCollideWithShape(const Ray* ray, const Shape* shape) {
+	if (shape->type == SHAPE_PLANE) return getFirstCollideWithPlane(ray, shape->a, shape->b);
+	if (shape->type == SHAPE_QUAD) return getFirstCollideWithQuad(ray, shape->a, shape->b, shape->c);
+	return getFirstCollideWithBox(ray, shape->a, shape->b);
+}
+
+double3 shapeNormal(const Ray* ray, const Shape* shape, double3 pos) {
+	if (shape->type == SHAPE_BOX) {
+		// the face whose slab the hit lies farthest out in
+		double3 p = (2 * pos - shape->a - shape->b) / (shape->b - shape->a);
+		double3 a = fabs(p);
+		if (a.x >= a.y && a.x >= a.z) return (double3)(sign(p.x), 0, 0);
+		if (a.y >= a.z) return (double3)(0, sign(p.y), 0);
+		return (double3)(0, 0, sign(p.z));
+	}
+	double3 n = normalize(shape->type == SHAPE_PLANE ? shape->b : cross(shape->b, shape->c));
+	return dot(n, ray->dir) > 0 ? -n : n;
+}
+
+// Closest hit among the spheres and shapes, false if the ray leaves the scene.
+bool intersectScene(const Ray* ray, __constant Sphere* sphere, const int sphereSize, __constant Shape* shape,
+	const int shapeSize, Hit* hit) {
+	int id, shapeId = -1;
+	double mm = getFirstCollide(ray, sphere, sphereSize, &id);
+#if defined(SHAPE_COUNT)
+#pragma unroll
+	for (int i = 0; i < SHAPE_COUNT; i++)
+#else
+	for (int i = 0; i < shapeSize; i++)
+#endif
+	{
+		Shape nows = shape[i];
+		double t = getFirstCollideWithShape(ray, &nows);
+		if (t == -1) continue;
+		if (mm == 0 || t < mm) {
+			mm = t;
+			shapeId = i;
+		}
+	}
+	if (mm == 0) return false;
+
+	hit->pos = ray->pos + mm * ray->dir;
+	if (shapeId != -1) {
+		Shape o = shape[shapeId];
+		hit->nd = shapeNormal(ray, &o, hit->pos);
+		hit->mat = o.mat;
+		hit->sphere = -1;
+	} else {
+		hit->nd = normalize(hit->pos - sphere[id].pos);
+		hit->mat = sphere[id].mat;
+		hit->sphere = id;
+	}
+	return true;
+}
+
+uint part1By1(uint x) {
+	x &= 0x0000ffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+uint compact1By1(uint x) {
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
+// Number of sumColor slots, including the padding of partial edge tiles.
+uint slotCount(int width, int height) {
+#if PIXEL_ORDER == 0
+	return width * height;
+#else
+	uint tilesX = (width + TILE_SIZE - 1) / TILE_SIZE, tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	return tilesX * tilesY * TILE_SIZE * TILE_SIZE;
+#endif
+}
+
+uint pixelSlot(int x, int y, int width) {
+#if PIXEL_ORDER == 0
+	return y * width + x;
+#else
+	uint tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	uint tile = y / TILE_SIZE * tilesX + x / TILE_SIZE;
+#if PIXEL_ORDER == 1
+	uint i = part1By1(x % TILE_SIZE) | (part1By1(y % TILE_SIZE) << 1);
+#else
+	uint i = y % TILE_SIZE * TILE_SIZE + x % TILE_SIZE;
+#endif
+	return tile * TILE_SIZE * TILE_SIZE + i;
+#endif
+}
+
+// Inverse of pixelSlot. Slots in the padding map outside the image.
+int2 slotPixel(uint slot, int width) {
+#if PIXEL_ORDER == 0
+	return (int2)(slot % width, slot / width);
+#else
+	uint tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	uint tile = slot / (TILE_SIZE * TILE_SIZE), i = slot % (TILE_SIZE * TILE_SIZE);
+#if PIXEL_ORDER == 1
+	int2 local = (int2)(compact1By1(i), compact1By1(i >> 1));
+#else
+	int2 local = (int2)(i % TILE_SIZE, i / TILE_SIZE);
+#endif
+	return (int2)(tile % tilesX * TILE_SIZE + local.x, tile / tilesX * TILE_SIZE + local.y);
+#endif
+}
+
+// Pulls slots off the queue until one maps into the image, -1 once drained.
+int nextSlot(volatile __global int* workCounter, int width, int height, int2* coord) {
+	uint slots = slotCount(width, height);
+	for (;;) {
+		int slot = atomic_inc(workCounter);
+		if (slot >= slots) return -1;
+		*coord = slotPixel(slot, width);
+		if (coord->x < width && coord->y < height) return slot;
+	}
+}
+
+Seed64 pixelSeed(const uint Seed, int x, int y) {
+	Seed64 seed;
+	llu magic = x * (1e9 + 7) + (x * y) * (1e9 + 9) + 998244353;
+	seed.k1 = (llu)(Seed ^ magic) * (Seed ^ magic);
+	seed.k2 = (llu)magic * magic * (1e5 + 7);
+	return seed;
+}
+
+double lightImportance(double3 pos, __global const LightNode* node) {
+	double d2 = norm2(node->center - pos);
+	return node->power / max(d2, node->radius * node->radius);
+}
+
+// Draws one light for a shading point. Returns its sphere index and the
+// probability of having drawn it, -1 if the scene has no lights. The alias
+// table costs O(1); the light tree, used when lightNodeCount > 0, descends
+// towards the lights that matter most from pos in O(log n).
+int pickLight(double3 pos, __global const LightEntry* lights, __global const LightNode* lightNodes,
+	const int lightCount, const int lightNodeCount, Seed64* seed, double* pdf) {
+	if (lightCount == 0) return -1;
+	if (lightNodeCount == 0) {
+		int i = min((int)(rand(seed) * lightCount), lightCount - 1);
+		if (rand(seed) >= lights[i].prob) i = lights[i].alias;
+		*pdf = lights[i].pdf;
+		return lights[i].sphere;
+	}
+
+	int n = 0;
+	*pdf = 1;
+	while (lightNodes[n].right != -1) {
+		int left = lightNodes[n].left, right = lightNodes[n].right;
+		double wl = lightImportance(pos, &lightNodes[left]), wr = lightImportance(pos, &lightNodes[right]);
+		double pl = wl + wr > 0 ? wl / (wl + wr) : 0.5;
+		if (rand(seed) < pl) {
+			n = left;
+			*pdf *= pl;
+		} else {
+			n = right;
+			*pdf *= 1 - pl;
+		}
+	}
+	return lights[lightNodes[n].left].sphere;
+}
+
+// Uniform direction inside the cone a sphere light subtends from pos.
+// Returns the cone's solid angle, 0 if pos is inside the light.
+double sampleSphereLight(double3 pos, const Sphere* light, Seed64* seed, double3* dir) {
+	double3 axis = light->pos - pos;
+	double d2 = norm2(axis), r2 = light->radius * light->radius;
+	if (d2 <= r2) return 0;
+	axis /= sqrt(d2);
+
+	double cosMax = sqrt(1 - r2 / d2);
+	double cosTheta = 1 - rand(seed) * (1 - cosMax);
+	double sinTheta = sqrt(max(0.0, 1 - cosTheta * cosTheta));
+	double phi = 2 * M_PI * rand(seed);
+	double3 u = normalize(cross(fabs(axis.x) > 0.1 ? (double3)(0, 1, 0) : (double3)(1, 0, 0), axis));
+	double3 v = cross(axis, u);
+	*dir = normalize((u * cos(phi) + v * sin(phi)) * sinTheta + axis * cosTheta);
+	return 2 * M_PI * (1 - cosMax);
+}
+
+// One light drawn from the light list and sampled over the cone it covers
+// from pos, for a surface with normal nd facing the viewer. Returns the
+// light's radiance times the cosine over the sample's density, to be scaled
+// by the BRDF at *ld; 0 for a sample below the surface or, with shadows, an
+// occluded one.
+double3 sampleDirectLight(double3 pos, double3 nd, __constant Sphere* sphere, const int sphereSize,
+	__constant Shape* shape, const int shapeSize, __global const LightEntry* lights,
+	__global const LightNode* lightNodes, const int lightCount, const int lightNodeCount, bool shadows,
+	Seed64* seed, double3* ld) {
+	double3 black = (double3)(0, 0, 0);
+	*ld = nd;
+	double pdf;
+	int lightId = pickLight(pos, lights, lightNodes, lightCount, lightNodeCount, seed, &pdf);
+	if (lightId == -1) return black;
+	Sphere light = sphere[lightId];
+	double solidAngle = sampleSphereLight(pos, &light, seed, ld);
+	if (solidAngle == 0) return black;
+	double cosTheta = dot(nd, *ld);
+	if (cosTheta <= 0) return black;
+
+	if (shadows) {
+		Ray shadowRay;
+		shadowRay.dir = *ld;
+		shadowRay.pos = pos;
+		Hit blocker;
+		if (!intersectScene(&shadowRay, sphere, sphereSize, shape, shapeSize, &blocker) || blocker.sphere != lightId)
+			return black;
+	}
+	return light.mat.color * cosTheta * solidAngle / pdf;
+}
+
+// Normalized Blinn-Phong: a Lambertian term plus a specular lobe for metals
+// (or whatever reflection weight the material sets).
+double3 blinnPhongBrdf(const Material* mat, double3 nd, double3 ld, double3 vd) {
+	const double shininess = 10;
+	double ks = (mat->type == 2 || mat->type == 4) ? 1.0 : mat->reflectionWeight;
+	double3 hd = normalize(ld + vd);
+	double specular = ks * (shininess + 8) / (8 * M_PI) * pow(max(0.0, dot(nd, hd)), shininess);
+	return mat->color / M_PI + specular;
+}
+
+static double3 rand3(Seed64* seed) {
+	double3 ret;
+	do {
+		ret = 2 * (double3)(rand(seed), rand(seed), rand(seed)) - (double3)(1, 1, 1);
+	} while (norm2(ret) >= 1);
+	return normalize(ret);
+}
+
+double3 reflect(const double3 id, const double3 nd) {
+	return id - 2.0 * dot(id, nd) * nd;
+}
+
+double3 refract(const double3 id, const double3 nd, const double co) {
+	double cosTheta = min(dot(-id, nd), 1.0);
+	double3 ra = co * (id + cosTheta * nd);
+	double3 rb = -sqrt(fabs(1.0 - dot(ra, ra))) * nd;
+	return ra + rb;
+}
+
+// Turns ray into the one leaving surface hit o: cosine-weighted around the
+// normal for diffuse (1), mirrored for metal (2) and fuzzed metal (4), and
+// reflected or refracted by Schlick's Fresnel term for dielectrics (3).
+// Returns false when a fuzzed reflection points into the surface; tir is set
+// on total internal reflection. The weight is the material color either way.
+bool scatter(Ray* ray, const Hit* o, Seed64* seed, bool* tir) {
+	bool isFront = (dot(ray->dir, o->nd) < 0);
+	double3 nd = o->nd;
+
+	ray->pos = o->pos;
+	if (HAS_MATERIAL(1) && o->mat.type == 1) {
+		ray->dir = normalize(rand3(seed) + nd);
+	} else if ((HAS_MATERIAL(2) && o->mat.type == 2) || (HAS_MATERIAL(4) && o->mat.type == 4)) {
+		double fuzz = 0.0;
+		if (HAS_MATERIAL(4) && o->mat.type == 4) fuzz = 0.4;
+		ray->dir = normalize(reflect(ray->dir, nd) + fuzz * rand3(seed));
+		if (dot(ray->dir, nd) < 0) return false;
+	} else if (HAS_MATERIAL(3) && o->mat.type == 3) {
+		double co = o->mat.refractionCoefficient;
+		if (isFront) co = 1.0 / co; else nd = -nd;
+		double cosTheta = min(dot(-ray->dir, nd), 1.0);
+		double sinTheta = sqrt(1 - pow(cosTheta, 2));
+		bool isReflect = false;
+		if (co * sinTheta > 1) {
+			isReflect = true;
+			*tir = true;
+		} else {
+			double R = pow((1 - co) / (1 + co), 2);
+			R += (1 - R) * pow(1 - cosTheta, 5);
+			if (rand(seed) < R) isReflect = true;
+		}
+		if (isReflect) {
+			ray->dir = reflect(ray->dir, nd);
+		} else {
+			ray->dir = normalize(refract(normalize(ray->dir), nd, co));
+		}
+	}
+	return true;
+}
+
+// Pixel and sumColor slot of this work item in a 2D launch of kernelMain.
+// The global size may be padded up to a multiple of the work-group size, so
+// the pixel can lie outside the image. In the tiled orders consecutive work
+// items of a group take consecutive slots, whatever the group's shape.
+int2 workItemPixel(int width, uint* slot) {
+#if PIXEL_ORDER == 0
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	*slot = coord.y * width + coord.x;
+	return coord;
+#else
+	*slot = (get_group_id(1) * get_num_groups(0) + get_group_id(0)) * get_local_size(0) * get_local_size(1)
+		+ get_local_id(1) * get_local_size(0) + get_local_id(0);
+	return slotPixel(*slot, width);
+#endif
+}
+
+// Gamma-corrects the running average for display. Runs once per shown frame,
+// however many sample launches went into it.
+__kernel void toneMap(__global uchar3* pixels, __global const double3* sumColor, const llu sampleCount) {
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	uint idx = coord.y * get_global_size(0) + coord.x;
+
+	double3 color = min(sqrt(sumColor[pixelSlot(coord.x, coord.y, get_global_size(0))] / sampleCount), 1.0);
+	pixels[idx].x = (float)color.x * 255;
+	pixels[idx].y = (float)color.y * 255;
+	pixels[idx].z = (float)color.z * 255;
+}
+
+// toneMap straight into the shared GL texture: aligned RGBA8 or half float
+// texels, and no PBO-to-texture copy afterwards.
+__kernel void toneMapImage(__write_only image2d_t image, __global const double3* sumColor, const llu sampleCount) {
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+
+	double3 color = min(sqrt(sumColor[pixelSlot(coord.x, coord.y, get_global_size(0))] / sampleCount), 1.0);
+	write_imagef(image, coord, (float4)((float)color.x, (float)color.y, (float)color.z, 1.0f));
+}
+
+// Row-major copy of the accumulation for the display side, whose program
+// doesn't follow PIXEL_ORDER.
+__kernel void snapshotAccum(__global const double3* src, __global double3* dst) {
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	dst[coord.y * get_global_size(0) + coord.x] = src[pixelSlot(coord.x, coord.y, get_global_size(0))];
+}
+
+// Carries the accumulation over to a new render resolution. Both buffers hold
+// sums over the same number of samples, so they can be filtered directly.
+__kernel void resampleAccum(__global const double3* src, const int srcWidth, const int srcHeight,
+	__global double3* dst) {
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	uint idx = pixelSlot(coord.x, coord.y, get_global_size(0));
+
+	double fx = (coord.x + 0.5) * srcWidth / get_global_size(0) - 0.5;
+	double fy = (coord.y + 0.5) * srcHeight / get_global_size(1) - 0.5;
+	int x0 = clamp((int)floor(fx), 0, srcWidth - 1), x1 = min(x0 + 1, srcWidth - 1);
+	int y0 = clamp((int)floor(fy), 0, srcHeight - 1), y1 = min(y0 + 1, srcHeight - 1);
+	double ax = clamp(fx - x0, 0.0, 1.0);
+	double ay = clamp(fy - y0, 0.0, 1.0);
+
+	double3 top = mix(src[pixelSlot(x0, y0, srcWidth)], src[pixelSlot(x1, y0, srcWidth)], ax);
+	double3 bottom = mix(src[pixelSlot(x0, y1, srcWidth)], src[pixelSlot(x1, y1, srcWidth)], ax);
+	dst[idx] = mix(top, bottom, ay);
+}
@@ -0,0 +1,241 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Error of a render against a reference. Images are row-major linear
+// radiance, i.e. accumulation over sample count. The metrics take an
+// optional mask of the pixels to count, all of them if it is empty; an
+// empty selection scores 0.
+namespace Convergence {
+	typedef std::vector<bool> Mask;
+
+	inline bool counts(const Mask& mask, size_t i) {
+		return mask.empty() || mask[i];
+	}
+
+	inline double rmse(const std::vector<cl_double3>& img, const std::vector<cl_double3>& ref, const Mask& mask = {}) {
+		double sum = 0;
+		size_t n = 0;
+		for (size_t i = 0; i < img.size(); i++) {
+			if (!counts(mask, i)) continue;
+			for (int c = 0; c < 3; c++) sum += pow(img[i].s[c] - ref[i].s[c], 2);
+			n++;
+		}
+		return n ? sqrt(sum / (3.0 * n)) : 0;
+	}
+
+	// Squared error relative to the reference, so dark regions count as much
+	// as bright ones.
+	inline double relMse(const std::vector<cl_double3>& img, const std::vector<cl_double3>& ref,
+		const Mask& mask = {}) {
+		double sum = 0;
+		size_t n = 0;
+		for (size_t i = 0; i < img.size(); i++) {
+			if (!counts(mask, i)) continue;
+			for (int c = 0; c < 3; c++) sum += pow(img[i].s[c] - ref[i].s[c], 2) / (pow(ref[i].s[c], 2) + 1e-2);
+			n++;
+		}
+		return n ? sum / (3.0 * n) : 0;
+	}
+
+	// Pixels where part carries at least share of the reference's luminance,
+	// e.g. the caustic regions given a render of the caustic paths alone.
+	inline Mask shareMask(const std::vector<cl_double3>& part, const std::vector<cl_double3>& ref, double share) {
+		auto luminance = [](const cl_double3& c) { return 0.2126 * c.s[0] + 0.7152 * c.s[1] + 0.0722 * c.s[2]; };
+		Mask mask(ref.size());
+		for (size_t i = 0; i < ref.size(); i++) {
+			double l = luminance(ref[i]);
+			mask[i] = l > 0 && luminance(part[i]) >= share * l;
+		}
+		return mask;
+	}
+
+	// Display colors as toneMap shows them, back to linear sRGB.
+	inline void displayLinear(const cl_double3& c, double rgb[3]) {
+		for (int j = 0; j < 3; j++) {
+			double v = std::min(sqrt(std::max(c.s[j], 0.0)), 1.0);
+			rgb[j] = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+		}
+	}
+
+	inline void linearToLab(const double rgb[3], double lab[3]) {
+		double xyz[3] = {
+			(0.4124 * rgb[0] + 0.3576 * rgb[1] + 0.1805 * rgb[2]) / 0.95047,
+			0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2],
+			(0.0193 * rgb[0] + 0.1192 * rgb[1] + 0.9505 * rgb[2]) / 1.08883
+		};
+		double f[3];
+		for (int j = 0; j < 3; j++)
+			f[j] = xyz[j] > 216.0 / 24389 ? cbrt(xyz[j]) : (24389.0 / 27 * xyz[j] + 16) / 116;
+		lab[0] = 116 * f[1] - 16;
+		lab[1] = 500 * (f[0] - f[1]);
+		lab[2] = 200 * (f[1] - f[2]);
+	}
+
+	inline double hyab(const double a[3], const double b[3]) {
+		return fabs(a[0] - b[0]) + sqrt(pow(a[1] - b[1], 2) + pow(a[2] - b[2], 2));
+	}
+
+	// FLIP-style perceptual error in [0, 1]: both images as the display shows
+	// them, blurred with a 3x3 binomial kernel as a crude stand-in for the
+	// contrast sensitivity filter, compared by HyAB distance in L*a*b* and
+	// normalized by the green-blue distance. Unlike full FLIP there is no
+	// viewing-distance dependent filter and no edge and point feature term.
+	inline double flip(const std::vector<cl_double3>& img, const std::vector<cl_double3>& ref, int width, int height,
+		const Mask& mask = {}) {
+		auto blurredLab = [width, height](const std::vector<cl_double3>& src) {
+			std::vector<double> linear(src.size() * 3), lab(src.size() * 3);
+			for (size_t i = 0; i < src.size(); i++) displayLinear(src[i], &linear[i * 3]);
+			const double w[3] = { 0.25, 0.5, 0.25 };
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					double rgb[3] = { 0, 0, 0 };
+					for (int dy = -1; dy <= 1; dy++) {
+						for (int dx = -1; dx <= 1; dx++) {
+							int sx = std::min(std::max(x + dx, 0), width - 1), sy = std::min(std::max(y + dy, 0), height - 1);
+							for (int c = 0; c < 3; c++) rgb[c] += w[dx + 1] * w[dy + 1] * linear[((size_t)sy * width + sx) * 3 + c];
+						}
+					}
+					linearToLab(rgb, &lab[((size_t)y * width + x) * 3]);
+				}
+			}
+			return lab;
+		};
+		double green[3] = { 0, 1, 0 }, blue[3] = { 0, 0, 1 }, greenLab[3], blueLab[3];
+		linearToLab(green, greenLab);
+		linearToLab(blue, blueLab);
+		double maxDistance = hyab(greenLab, blueLab);
+
+		std::vector<double> a = blurredLab(img), b = blurredLab(ref);
+		double sum = 0;
+		size_t n = 0;
+		for (size_t i = 0; i < img.size(); i++) {
+			if (!counts(mask, i)) continue;
+			sum += std::min(hyab(&a[i * 3], &b[i * 3]) / maxDistance, 1.0);
+			n++;
+		}
+		return n ? sum / n : 0;
+	}
+
+	// Little-endian PFM, rows stored bottom up.
+	inline bool writePfm(const std::string& path, int width, int height, const std::vector<cl_double3>& img) {
+		std::ofstream out(path, std::ios::binary);
+		out << "PF\n" << width << " " << height << "\n-1.0\n";
+		std::vector<float> row((size_t)width * 3);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++)
+				for (int c = 0; c < 3; c++) row[(size_t)x * 3 + c] = (float)img[(size_t)y * width + x].s[c];
+			out.write((const char*)row.data(), row.size() * sizeof(float));
+		}
+		return (bool)out;
+	}
+
+	inline bool readPfm(const std::string& path, int width, int height, std::vector<cl_double3>& img) {
+		std::ifstream in(path, std::ios::binary);
+		std::string magic;
+		int w, h;
+		double scale;
+		if (!(in >> magic >> w >> h >> scale) || magic != "PF" || w != width || h != height || scale >= 0) return false;
+		in.get();
+		img.resize((size_t)width * height);
+		std::vector<float> row((size_t)width * 3);
+		for (int y = height - 1; y >= 0; y--) {
+			if (!in.read((char*)row.data(), row.size() * sizeof(float))) return false;
+			for (int x = 0; x < width; x++) {
+				cl_double3& p = img[(size_t)y * width + x];
+				for (int c = 0; c < 3; c++) p.s[c] = row[(size_t)x * 3 + c];
+				p.s[3] = 0;
+			}
+		}
+		return true;
+	}
+}
+
+struct ConvergencePoint {
+	std::string scene, config;
+	double seconds;
+	cl_ulong spp;
+	double rmse, relMse, flip;
+	// the same over the caustic mask
+	double causticRmse, causticRelMse, causticFlip;
+	// PathStats::json() of the samples so far, empty unless built with PATH_STATS
+	std::string pathStats;
+};
+
+// Collects error-over-time curves and writes them as <prefix>.csv and
+// <prefix>.json, plus <prefix>.gp, a gnuplot script with the data inline
+// that plots each metric against time per scene into <prefix>_<scene>.png,
+// over the whole image in the top row and over the caustic mask below.
+class ConvergenceReport {
+private:
+	std::vector<ConvergencePoint> points;
+
+public:
+	void add(const ConvergencePoint& p) {
+		points.push_back(p);
+	}
+
+	bool write(const std::string& prefix) const {
+		std::ofstream csv(prefix + ".csv");
+		csv << "scene,config,seconds,spp,rmse,relmse,flip,caustic_rmse,caustic_relmse,caustic_flip\n";
+		for (const ConvergencePoint& p : points)
+			csv << p.scene << "," << p.config << "," << p.seconds << "," << p.spp << "," << p.rmse << ","
+				<< p.relMse << "," << p.flip << "," << p.causticRmse << "," << p.causticRelMse << "," << p.causticFlip
+				<< "\n";
+
+		std::ofstream json(prefix + ".json");
+		json << "[\n";
+		for (size_t i = 0; i < points.size(); i++) {
+			const ConvergencePoint& p = points[i];
+			json << "  {\"scene\": \"" << p.scene << "\", \"config\": \"" << p.config << "\", \"seconds\": " << p.seconds
+				<< ", \"spp\": " << p.spp << ", \"rmse\": " << p.rmse << ", \"relmse\": " << p.relMse
+				<< ", \"flip\": " << p.flip << ", \"causticRmse\": " << p.causticRmse << ", \"causticRelmse\": "
+				<< p.causticRelMse << ", \"causticFlip\": " << p.causticFlip;
+			if (!p.pathStats.empty()) json << ", \"pathStats\": " << p.pathStats;
+			json << "}" << (i + 1 < points.size() ? "," : "") << "\n";
+		}
+		json << "]\n";
+
+		// one inline data block per scene and config, in order of appearance
+		std::vector<std::string> scenes;
+		std::map<std::string, std::vector<std::string>> configs;
+		for (const ConvergencePoint& p : points) {
+			if (std::find(scenes.begin(), scenes.end(), p.scene) == scenes.end()) scenes.push_back(p.scene);
+			std::vector<std::string>& c = configs[p.scene];
+			if (std::find(c.begin(), c.end(), p.config) == c.end()) c.push_back(p.config);
+		}
+		std::ofstream gp(prefix + ".gp");
+		for (size_t s = 0; s < scenes.size(); s++) {
+			for (size_t c = 0; c < configs[scenes[s]].size(); c++) {
+				gp << "$s" << s << "c" << c << " << EOD\n";
+				for (const ConvergencePoint& p : points)
+					if (p.scene == scenes[s] && p.config == configs[scenes[s]][c])
+						gp << p.seconds << " " << p.rmse << " " << p.relMse << " " << p.flip << " " << p.causticRmse
+							<< " " << p.causticRelMse << " " << p.causticFlip << "\n";
+				gp << "EOD\n";
+			}
+		}
+		gp << "set terminal pngcairo size 1500,900\nset logscale xy\nset xlabel 'seconds'\nset key bottom left\n";
+		const char* metrics[] = { "RMSE", "relMSE", "FLIP-style", "caustic RMSE", "caustic relMSE",
+			"caustic FLIP-style" };
+		for (size_t s = 0; s < scenes.size(); s++) {
+			gp << "set output '" << prefix << "_" << scenes[s] << ".png'\nset multiplot layout 2,3 title '"
+				<< scenes[s] << "'\n";
+			for (int m = 0; m < 6; m++) {
+				gp << "set title '" << metrics[m] << "'\nplot ";
+				for (size_t c = 0; c < configs[scenes[s]].size(); c++)
+					gp << (c ? ", " : "") << "$s" << s << "c" << c << " using 1:" << m + 2 << " with linespoints title '"
+						<< configs[scenes[s]][c] << "'";
+				gp << "\n";
+			}
+			gp << "unset multiplot\n";
+		}
+		return csv && json && gp;
+	}
+};
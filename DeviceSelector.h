@@ -0,0 +1,212 @@
+#pragma once
+#include <CL/opencl.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+struct DeviceCandidate {
+	cl_platform_id platform;
+	cl_device_id device;
+	// "platform / device", for the log and for matching a named device
+	std::string name;
+	// device, driver and compute units, keys the calibration cache
+	std::string key;
+	cl_device_type type;
+	cl_uint units;
+	double ms = -1;
+};
+
+// Picks the device to render on among the devices of every platform. CPU
+// devices are split with clCreateSubDevices so hostCores cores stay free
+// for the window, display and I/O threads. Unless a device is named, every
+// candidate times a short calibration render and the fastest one wins;
+// timings are cached in deviceFile per device, driver and kernel source.
+class DeviceSelector {
+private:
+	const std::string deviceFile = "device.cache";
+	cl_uint hostCores;
+	std::vector<DeviceCandidate> candidates;
+
+	static std::string platformString(cl_platform_id platform, cl_platform_info param) {
+		size_t len = 0;
+		clGetPlatformInfo(platform, param, 0, nullptr, &len);
+		std::string ret(len, 0);
+		clGetPlatformInfo(platform, param, len, &ret[0], nullptr);
+		if (!ret.empty() && ret.back() == 0) ret.pop_back();
+		return ret;
+	}
+
+	static std::string deviceString(cl_device_id device, cl_device_info param) {
+		size_t len = 0;
+		clGetDeviceInfo(device, param, 0, nullptr, &len);
+		std::string ret(len, 0);
+		clGetDeviceInfo(device, param, len, &ret[0], nullptr);
+		if (!ret.empty() && ret.back() == 0) ret.pop_back();
+		return ret;
+	}
+
+	// Sub-device with all but hostCores compute units, 0 if the device
+	// can't be partitioned by counts.
+	cl_device_id reserveHostCores(cl_device_id device, cl_uint units) {
+		if (hostCores == 0 || units <= hostCores) return 0;
+		size_t len = 0;
+		clGetDeviceInfo(device, CL_DEVICE_PARTITION_PROPERTIES, 0, nullptr, &len);
+		std::vector<cl_device_partition_property> supported(len / sizeof(cl_device_partition_property));
+		clGetDeviceInfo(device, CL_DEVICE_PARTITION_PROPERTIES, len, supported.data(), nullptr);
+		if (std::find(supported.begin(), supported.end(), CL_DEVICE_PARTITION_BY_COUNTS) == supported.end())
+			return 0;
+
+		cl_device_partition_property properties[] = {
+			CL_DEVICE_PARTITION_BY_COUNTS, (cl_device_partition_property)(units - hostCores),
+			CL_DEVICE_PARTITION_BY_COUNTS_LIST_END, 0
+		};
+		cl_device_id sub = 0;
+		cl_uint num = 0;
+		cl_int err = clCreateSubDevices(device, properties, 1, &sub, &num);
+		if (err != CL_SUCCESS || num == 0) {
+			std::cerr << "Couldn't reserve host cores: " << TranslateOpenCLError(err) << std::endl;
+			return 0;
+		}
+		return sub;
+	}
+
+	void enumerate() {
+		cl_uint platformNum = 0;
+		clGetPlatformIDs(0, nullptr, &platformNum);
+		std::vector<cl_platform_id> platforms(platformNum);
+		if (platformNum) clGetPlatformIDs(platformNum, platforms.data(), nullptr);
+
+		for (cl_platform_id platform : platforms) {
+			cl_uint deviceNum = 0;
+			if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceNum) != CL_SUCCESS) continue;
+			std::vector<cl_device_id> devices(deviceNum);
+			clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, deviceNum, devices.data(), nullptr);
+
+			for (cl_device_id device : devices) {
+				DeviceCandidate c;
+				c.platform = platform;
+				c.device = device;
+				c.name = platformString(platform, CL_PLATFORM_NAME) + " / " + deviceString(device, CL_DEVICE_NAME);
+				clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &c.type, nullptr);
+				clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &c.units, nullptr);
+
+				// the sub-device replaces its CPU, host threads would compete with the rest anyway
+				cl_device_id sub = c.type & CL_DEVICE_TYPE_CPU ? reserveHostCores(device, c.units) : 0;
+				if (sub) {
+					c.device = sub;
+					c.name += " (" + std::to_string(hostCores) + " of " + std::to_string(c.units)
+						+ " cores left to the host)";
+					c.units -= hostCores;
+				}
+				c.key = deviceString(device, CL_DEVICE_NAME) + "|" + deviceString(device, CL_DRIVER_VERSION)
+					+ "|" + std::to_string(c.units);
+				for (char& ch : c.key) if (ch == '\t' || ch == '\n') ch = ' ';
+				candidates.push_back(c);
+			}
+		}
+	}
+
+	bool lookup(const std::string& k, double& ms) {
+		std::ifstream in(deviceFile);
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string fieldKey, value;
+			if (!std::getline(fields, fieldKey, '\t') || fieldKey != k) continue;
+			std::getline(fields, value, '\t');
+			ms = std::stod(value);
+			return true;
+		}
+		return false;
+	}
+
+	void store(const std::string& k, double ms) {
+		std::vector<std::string> lines;
+		std::string line;
+		std::ifstream in(deviceFile);
+		while (std::getline(in, line))
+			if (line.compare(0, k.size() + 1, k + "\t") != 0) lines.push_back(line);
+		in.close();
+
+		std::ofstream out(deviceFile);
+		for (const std::string& l : lines) out << l << "\n";
+		out << k << "\t" << ms << "\n";
+	}
+
+public:
+	DeviceSelector(cl_uint hostCores) : hostCores(hostCores) {
+		enumerate();
+	}
+
+	size_t count() const { return candidates.size(); }
+
+	const DeviceCandidate& get(int i) const { return candidates[i]; }
+
+	// Index of the device to use, -1 if there is none. A non-empty
+	// preference picks the first device whose name contains it; otherwise
+	// measure() times each candidate (ms, negative on failure). sourceKey
+	// identifies the calibration workload in the cache.
+	int select(const std::string& preference, const std::string& sourceKey,
+		const std::function<double(const DeviceCandidate&)>& measure) {
+		if (candidates.empty()) return -1;
+		std::cout << "OpenCL devices:" << std::endl;
+		for (const DeviceCandidate& c : candidates)
+			std::cout << "  " << c.name << ", " << c.units << " compute units" << std::endl;
+
+		if (!preference.empty()) {
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (candidates[i].name.find(preference) == std::string::npos) continue;
+				std::cout << "Using " << candidates[i].name << ": matches \"" << preference << "\"" << std::endl;
+				return i;
+			}
+			std::cout << "No device matches \"" << preference << "\"" << std::endl;
+		}
+		if (candidates.size() == 1) {
+			std::cout << "Using " << candidates[0].name << ": the only device" << std::endl;
+			return 0;
+		}
+
+		int best = -1, second = -1;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			DeviceCandidate& c = candidates[i];
+			std::string k = c.key + "|" + sourceKey;
+			bool cached = lookup(k, c.ms);
+			if (!cached) {
+				c.ms = measure(c);
+				if (c.ms > 0) store(k, c.ms);
+			}
+			std::cout << "  calibration on " << c.name << ": ";
+			if (c.ms > 0) std::cout << c.ms << " ms" << (cached ? " (cached)" : "") << std::endl;
+			else std::cout << "failed" << std::endl;
+
+			if (c.ms <= 0) continue;
+			if (best < 0 || c.ms < candidates[best].ms) {
+				second = best;
+				best = i;
+			} else if (second < 0 || c.ms < candidates[second].ms) {
+				second = i;
+			}
+		}
+
+		if (best < 0) {
+			std::cout << "Using " << candidates[0].name << ": no device finished the calibration" << std::endl;
+			return 0;
+		}
+		std::cout << "Using " << candidates[best].name << ": fastest calibration render";
+		if (second >= 0)
+			std::cout << ", " << candidates[second].ms / candidates[best].ms << "x faster than " << candidates[second].name;
+		std::cout << std::endl;
+		return best;
+	}
+
+	// Root devices ignore the release, sub-devices that weren't chosen go away.
+	~DeviceSelector() {
+		for (DeviceCandidate& c : candidates) clReleaseDevice(c.device);
+	}
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+
+// Lock-free latest-frame mailbox between one producer and one consumer, i.e.
+// a triple buffer. The producer fills back() and publish()es it, which swaps
+// it with the shared middle slot; the consumer's acquire() swaps the middle
+// slot in as its front() if something newer was published. Neither side ever
+// waits, and the consumer always gets the newest complete frame.
+template <typename T>
+class FrameMailbox {
+private:
+	static const int dirtyBit = 4;
+	static const int indexMask = 3;
+
+	T slots[3];
+	std::atomic<int> middle{ 1 };
+	int back = 0, front = 2;
+
+public:
+	T& slot(int i) { return slots[i]; }
+	T& getBack() { return slots[back]; }
+	T& getFront() { return slots[front]; }
+
+	void publish() {
+		back = middle.exchange(back | dirtyBit, std::memory_order_acq_rel) & indexMask;
+	}
+
+	// True if front() changed.
+	bool acquire() {
+		if (!(middle.load(std::memory_order_acquire) & dirtyBit)) return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+};
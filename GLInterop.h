@@ -0,0 +1,53 @@
+#pragma once
+#include <glad/glad.h>
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(USE_EGL)
+#include <EGL/egl.h>
+#else
+#include <GL/glx.h>
+#endif
+
+// Window-system side of CL/GL sharing. The context properties name the
+// current GL context the way the platform's cl_khr_gl_sharing expects it:
+// WGL on Windows, GLX on Linux, or EGL when built with USE_EGL (Wayland,
+// headless). Without the extension the display falls back to copying
+// through mapped buffers, see GraphicManager.
+namespace GLInterop {
+	inline bool supportsSharing(cl_device_id device) {
+		size_t len = 0;
+		if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &len) != CL_SUCCESS) return false;
+		std::string extensions(len, 0);
+		clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, len, &extensions[0], nullptr);
+		return extensions.find("cl_khr_gl_sharing") != std::string::npos;
+	}
+
+	// Zero-terminated properties for a context that shares with the GL
+	// context current on this thread. Empty when there is none.
+	inline std::vector<cl_context_properties> sharingProperties(cl_platform_id platform) {
+#ifdef _WIN32
+		cl_context_properties glContext = (cl_context_properties)wglGetCurrentContext();
+		cl_context_properties display = (cl_context_properties)wglGetCurrentDC();
+		cl_context_properties displayKey = CL_WGL_HDC_KHR;
+#elif defined(USE_EGL)
+		cl_context_properties glContext = (cl_context_properties)eglGetCurrentContext();
+		cl_context_properties display = (cl_context_properties)eglGetCurrentDisplay();
+		cl_context_properties displayKey = CL_EGL_DISPLAY_KHR;
+#else
+		cl_context_properties glContext = (cl_context_properties)glXGetCurrentContext();
+		cl_context_properties display = (cl_context_properties)glXGetCurrentDisplay();
+		cl_context_properties displayKey = CL_GLX_DISPLAY_KHR;
+#endif
+		if (!glContext || !display) return {};
+		return {
+			CL_GL_CONTEXT_KHR, glContext,
+			displayKey, display,
+			CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+			0
+		};
+	}
+}
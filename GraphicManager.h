@@ -1,13 +1,88 @@
 #pragma once
 #include <glad/glad.h> 
 #include <GLFW/glfw3.h>
+#include <functional>
+#include <mutex>
 
+#include "Animation.h"
+#include "Autotuner.h"
 #include "CLManager.h"
+#include "Checkpoint.h"
+#include "Convergence.h"
+#include "FrameMailbox.h"
+#include "LightList.h"
+#include "PathGuide.h"
+#include "PathStats.h"
+#include "ResolutionController.h"
+#include "SampleScheduler.h"
 #include "Scene.h"
+#include "TileWriter.h"
+#include "Trace.h"
 
+// What the display side needs of one render iteration: a row-major copy of
+// the accumulation and the settings it was made with, for the title bar.
+struct RenderFrame {
+	cl_mem accum = 0;
+	cl_ulong sampleCount = 0;
+	cl_int width = 0, height = 0;
+	int samplesPerLaunch = 1, launchesPerFrame = 1;
+	cl_ulong tracedSamples = 0;
+	double utilization = 0;
+	PathStats pathStats;
+	int mode = 0, pixelOrder = 0;
+	bool persistent = false, specialize = false;
+};
+
+// runKernel() and render() may run on different threads: the render side
+// owns the scene, the trace kernels and the command queue, the display side
+// owns GL and a queue of its own. They meet in a lock-free frame mailbox, and
+// controls called from the display thread are queued for the render side.
 class GraphicManager : public CLManager {
 private:
 	const std::string kernalName = "kernelMain";
+	const std::string resampleName = "resampleAccum";
+	const std::string toneMapName = "toneMap";
+	const std::string toneMapImageName = "toneMapImage";
+	const std::string snapshotName = "snapshotAccum";
+	const std::string persistentName = "kernelPersistent";
+	const std::string guideName = "buildGuide";
+	const std::string restirName = "restirShade";
+	// resident work-groups per compute unit in persistent mode
+	const int persistentGroupsPerUnit = 8;
+	// frames without camera movement before returning to full resolution
+	const int stillFrameThreshold = 8;
+	const int tuneSamples = 2;
+	// square image each device renders for device selection
+	const cl_int calibrationSize = 256;
+	// bundled scenes, initScene1 to initScene3
+	static const int sceneCount = 3;
+	// offline renders: tile edge (a multiple of 16 for TIFF), tiles the
+	// writer may hold, samples per launch
+	const int posterTile = 512;
+	const int minPosterTile = 64;
+	const int posterTilesInFlight = 4;
+	const int posterSamplesPerLaunch = 8;
+	// frames the animation writer may hold
+	const int animationFramesInFlight = 3;
+	// render settings, baked into specialized kernels (PathTrace.cl has the same defaults)
+	const int maxDepth = 10;
+	const double rrProbability = 0.8;
+	const double epsilon = 1e-3;
+	// radius of the spheres standing in for planes in benchmarkShapes()
+	const double wallSphereRadius = 1e6;
+	// convergence benchmark: samples per pixel of the cached references, and
+	// how many time budgets, each twice the previous, lead up to the total
+	const int referenceSpp = 4096;
+	const int convergenceSteps = 6;
+	// caustic mask: samples per pixel of the caustic-paths render, and the
+	// share of a reference pixel it must carry for the pixel to count
+	const int causticMaskSpp = 1024;
+	const double causticShare = 0.25;
+	// render modes, each built from Common.cl followed by its own file
+	const std::vector<std::string> modeNames = { "PathTrace", "Shadow", "BlinnPhong", "Lambertian", "ColorOnly",
+		"BDPT", "ReSTIR" };
+	const std::vector<std::string> modeFiles = { "PathTrace.cl", "Shadow.cl", "BlinnPhong.cl",
+		"LambertianReflection.cl", "ColorOnly.cl", "BDPT.cl", "ReSTIR.cl" };
 	const GLfloat vertexCoords[12] = { -1.0f, -1.0f, 0.0f,
 						   -1.0f,  1.0f, 0.0f,
 							1.0f,  1.0f, 0.0f,
@@ -17,17 +92,156 @@ private:
 							1.0f, 0.0f,
 							1.0f, 1.0f };
 	GLuint vao, vbo[2], pbo, texture;
+	// window-sized texture shared with OpenCL for the zero-copy display path
+	GLuint displayTexture = 0;
+	GLuint shaderProgram;
+	GLint renderSizeLocation;
+	// mapped display path: persistently mapped GL buffers wrapped by CL buffers
+	GLuint mappedPbo[2] = { 0, 0 };
+	void* mappedPtr[2];
+	cl_mem mappedBuffer[2] = { 0, 0 };
+	GLsync mappedFence[2] = { 0, 0 };
+	int mappedIndex = 0;
 
 	int winWidth, winHeight;
-	clock_t lstTime;
-	char titleBuffer[100];
-	cl_double3 sum[800 * 800];
+	double lstTime;
+	// pixel samples traced since start, for the samples/s readout
+	cl_ulong tracedSamples, lstTracedSamples;
+	long long presentedFrames = 0, lstPresentedFrames = 0;
+	char titleBuffer[512];
+
+	// display side: own queue and tone mapping kernels, built without PIXEL_ORDER
+	cl_command_queue displayQueue;
+	cl_kernel displayToneMap, displayToneMapImage;
+	FrameMailbox<RenderFrame> frames;
+
+	Tracer tracer;
+	std::string tracePath = "trace.json";
 
-	cl_mem sphereBuffer, outBuffer, camBuffer, sumBuffer;
+	std::mutex pendingMutex;
+	std::vector<std::function<void()>> pending;
+	// from pool (CLManager), so they go back to it before it is trimmed
+	PooledBuffer sphereBuffer, shapeBuffer, camBuffer, sumBuffer, resampleBuffer;
+	PooledBuffer utilizationBuffer, pathStatsBuffer, workCounterBuffer, lightBuffer, lightNodeBuffer;
+	PooledBuffer guideGridBuffer, guideTrainBuffer, guideCdfBuffer;
+	// ReSTIR reservoirs, acquired the first time that mode is built
+	PooledBuffer reservoirBuffer, historyBuffer;
+	// resizes carry the accumulation over through resampleBuffer, unless
+	// planAccumulation() left it out
+	bool resampleAccumulation = true;
+	cl_mem outBuffer, outImage;
 	Camera cam;
-	cl_int sphereSize;
-	cl_ulong frameCount;
-	Sphere sphere[20];
+	cl_int sphereSize, shapeSize;
+	cl_ulong sampleCount;
+	// the bundled scene shown, see buildScene()
+	int scene = 0;
+	std::vector<Sphere> sphere;
+	std::vector<Shape> shape;
+	LightList lights;
+
+	ResolutionController resolution;
+	SampleScheduler scheduler;
+	cl_int renderWidth, renderHeight;
+	int stillFrames;
+	double kernelMs;
+
+	bool persistent = false;
+	bool measureUtilization = false;
+	size_t persistentGlobalSize, persistentLocalSize;
+	double utilization;
+	bool measurePathStats = false;
+	PathStats pathStats;
+	// online path guiding of the path tracer, see PathGuide.h
+	bool guiding = false;
+	PathGuide guide;
+
+	bool autotune = false;
+	TuneResult mainTune, persistentTune;
+
+	// see PIXEL_ORDER in PathTrace.cl
+	int pixelOrder = 0;
+	int tileSize = 8;
+
+	bool specialize = false;
+	bool benchSpecialize = false;
+	bool benchShapes = false;
+
+	int mode = 0;
+
+	// launch seeds are a hash of seedBase and the launch index, so a
+	// checkpoint can carry on the same stream
+	cl_uint seedBase = 0;
+	cl_ulong launchIndex = 0;
+	// periodic checkpoints of a still camera's accumulation, written by a
+	// background thread; checkpointMs is what they cost the render thread
+	std::string checkpointPath;
+	double checkpointInterval = 0;
+	bool resumeCheckpoint = false;
+	CheckpointWriter checkpointWriter;
+	double renderStart, lstCheckpoint, checkpointMs = 0;
+
+	// how the tone mapped frame reaches GL, see setDisplayPath()
+	enum DisplayPath { DisplayPBO, DisplayZeroCopy, DisplayMapped };
+	const std::vector<std::string> displayNames = { "PBO", "zero-copy", "mapped" };
+	int displayPath = DisplayPBO;
+	bool halfFloatDisplay = false;
+	// tone mapping plus texture upload, smoothed
+	double displayMs = 0;
+
+	std::vector<std::string> programFiles(int m) {
+		return { "Common.cl", modeFiles[m] };
+	}
+
+	// Only the path tracer has a persistent kernel, the other modes fall back to kernelMain.
+	bool hasPersistent() {
+		return kernels.count(persistentName) && kernels[persistentName];
+	}
+
+	// Camera, geometry and light buffers of the loaded scene.
+	bool createSceneBuffers() {
+		camBuffer = pool.acquire(sizeof(Camera), CL_MEM_READ_ONLY, MemScene, &cam, &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create camBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+
+		cl_ulong constantBytes = 0;
+		clGetDeviceInfo(device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(constantBytes), &constantBytes, nullptr);
+		if (constantBytes && sphereSize * sizeof(Sphere) > constantBytes) {
+			std::cerr << "Couldn't fit " << sphereSize << " spheres in constant memory" << std::endl;
+			return false;
+		}
+		sphereBuffer = pool.acquire(sphereSize * sizeof(Sphere), CL_MEM_READ_ONLY, MemScene, sphere.data(), &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create sphereBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+
+		// a buffer can't be empty, shapeSize tells the kernels what's in it
+		shapeBuffer = pool.acquire(std::max<cl_int>(shapeSize, 1) * sizeof(Shape), CL_MEM_READ_ONLY, MemScene,
+			shape.data(), &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create shapeBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+
+		std::vector<LightEntry> entries = lights.paddedEntries();
+		std::vector<LightNode> nodes = lights.paddedNodes();
+		lightBuffer = pool.acquire(entries.size() * sizeof(LightEntry), CL_MEM_READ_ONLY, MemScene, entries.data(),
+			&err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create lightBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+
+		lightNodeBuffer = pool.acquire(nodes.size() * sizeof(LightNode), CL_MEM_READ_ONLY, MemAcceleration,
+			nodes.data(), &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create lightNodeBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+		return true;
+	}
 
 	void configSharedData() {
 		glGenBuffers(1, &pbo);
@@ -36,42 +250,730 @@ private:
 			NULL, GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		outBuffer = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, pbo, &err);
+		outBuffer = outImage = 0;
+		if (glSharing) {
+			outBuffer = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, pbo, &err);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create buffer from the PBO: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+
+			outImage = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, displayTexture, &err);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create image from the texture: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+		}
+		// the PBO and the display texture live on the device as well
+		pool.track(MemOutput, (long long)winWidth * winHeight * (sizeof(cl_uint) + (halfFloatDisplay ? 8 : 4)));
+
+		if (!createSceneBuffers()) return;
+
+		planAccumulation();
+		sumBuffer = pool.acquire(accumBytes(), CL_MEM_READ_WRITE, MemAccumulation, nullptr, &err);
 		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't create buffer from the PBO: " << TranslateOpenCLError(err) << std::endl;
+			std::cerr << "Couldn't create sumBuffer: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
 
-		sumBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(sum), sum, &err);
+		if (resampleAccumulation) {
+			resampleBuffer = pool.acquire(accumBytes(), CL_MEM_READ_WRITE, MemAccumulation, nullptr, &err);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create resampleBuffer: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+		}
+
+		utilizationBuffer = pool.acquire(2 * sizeof(cl_ulong), CL_MEM_READ_WRITE, MemScratch, nullptr, &err);
 		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't create sumBuffer: " << TranslateOpenCLError(err) << std::endl;
+			std::cerr << "Couldn't create utilizationBuffer: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
 
-		camBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Camera), &cam, &err);
+		pathStatsBuffer = pool.acquire(PathStats::size * sizeof(cl_ulong), CL_MEM_READ_WRITE, MemScratch, nullptr,
+			&err);
 		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't create camBuffer: " << TranslateOpenCLError(err) << std::endl;
+			std::cerr << "Couldn't create pathStatsBuffer: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
 
-		sphereBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sphereSize * sizeof(Sphere), sphere, &err);
+		workCounterBuffer = pool.acquire(sizeof(cl_int), CL_MEM_READ_WRITE, MemScratch, nullptr, &err);
 		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't create sphereBuffer: " << TranslateOpenCLError(err) << std::endl;
+			std::cerr << "Couldn't create workCounterBuffer: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
 
-		cl_kernel kernel = kernels[kernalName];
-		err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &outBuffer);
-		err &= clSetKernelArg(kernel, 1, sizeof(cl_mem), &sphereBuffer);
-		err &= clSetKernelArg(kernel, 2, sizeof(cl_int), &sphereSize);
-		err &= clSetKernelArg(kernel, 3, sizeof(cl_mem), &camBuffer);
-		err &= clSetKernelArg(kernel, 6, sizeof(cl_mem), &sumBuffer);
+		// bound whether or not the kernels are built with PATH_GUIDING
+		guideGridBuffer = pool.acquire(sizeof(GuideGrid), CL_MEM_READ_ONLY, MemAcceleration, nullptr, &err);
+		if (err == CL_SUCCESS)
+			guideTrainBuffer = pool.acquire(PathGuide::trainBytes(), CL_MEM_READ_WRITE, MemAcceleration, nullptr, &err);
+		if (err == CL_SUCCESS)
+			guideCdfBuffer = pool.acquire(PathGuide::cdfBytes(), CL_MEM_READ_WRITE, MemAcceleration, nullptr, &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create the path guide buffers: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		resetGuide();
+
+		size_t frameBytes = (size_t)resolution.getMaxWidth() * resolution.getMaxHeight() * sizeof(cl_double3);
+		for (int i = 0; i < 3; i++) {
+			frames.slot(i).accum = clCreateBuffer(context, CL_MEM_READ_WRITE, frameBytes, nullptr, &err);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create frame buffer: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+			pool.track(MemAccumulation, frameBytes);
+		}
+
+		bindKernelArgs();
+	}
+
+	cl_uint nextSeed() {
+		cl_ulong key[2] = { seedBase, launchIndex++ };
+		return (cl_uint)HashBytes(key, sizeof(key));
+	}
+
+	// Scene and camera, field by field: struct padding holds garbage.
+	cl_ulong sceneContentHash() {
+		std::vector<double> values = { cam.theta, cam.winWidth, cam.winHeight, cam.pos.x, cam.pos.y, cam.pos.z,
+			cam.up.x, cam.up.y, cam.up.z, cam.lookAt.x, cam.lookAt.y, cam.lookAt.z };
+		for (int i = 0; i < sphereSize; i++) {
+			const Sphere& o = sphere[i];
+			values.insert(values.end(), { o.radius, o.pos.x, o.pos.y, o.pos.z, o.mat.refraction, o.mat.reflection,
+				(double)o.mat.type, o.mat.color.x, o.mat.color.y, o.mat.color.z });
+		}
+		for (int i = 0; i < shapeSize; i++) {
+			const Shape& o = shape[i];
+			values.insert(values.end(), { (double)o.type, o.a.x, o.a.y, o.a.z, o.b.x, o.b.y, o.b.z, o.c.x, o.c.y, o.c.z,
+				o.mat.refraction, o.mat.reflection, (double)o.mat.type, o.mat.color.x, o.mat.color.y, o.mat.color.z });
+		}
+		return HashBytes(values.data(), values.size() * sizeof(double));
+	}
+
+	// What the accumulation depends on: scene, camera, mode, kernel build and
+	// layout. A checkpoint only resumes onto the same hash.
+	cl_ulong sceneHash() {
+		std::string settings = modeNames[mode] + "|" + buildOptions() + "|" + std::to_string(renderWidth) + "x"
+			+ std::to_string(renderHeight);
+		return HashBytes(settings.data(), settings.size(), sceneContentHash());
+	}
+
+	// Snapshot of the accumulation for the checkpoint writer. Only the read
+	// back runs on the render thread; packing and writing happen on the
+	// writer's thread, and are skipped while the previous one is busy.
+	void checkpoint() {
+		if (checkpointWriter.busy()) return;
+		double start = glfwGetTime();
+		Checkpoint cp;
+		cp.sceneHash = sceneHash();
+		cp.width = renderWidth;
+		cp.height = renderHeight;
+		cp.sampleCount = sampleCount;
+		cp.tracedSamples = tracedSamples;
+		cp.seedBase = seedBase;
+		cp.launchIndex = launchIndex;
+		cp.accum.resize(accumBytes() / sizeof(cl_double3));
+		err = clEnqueueReadBuffer(queue, sumBuffer, CL_TRUE, 0, accumBytes(), cp.accum.data(), 0, nullptr, nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't read sumBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		if (guiding && !readGuide(cp.guide)) return;
+		checkpointWriter.write(checkpointPath, std::move(cp));
+
+		double now = glfwGetTime();
+		checkpointMs += (now - start) * 1e3;
+		lstCheckpoint = now;
+		std::cout << "Checkpoint at " << sampleCount << " spp, " << checkpointMs / ((now - renderStart) * 10)
+			<< "% of render time so far" << std::endl;
+	}
+
+	// The guide's schedule, training histograms and distributions, for checkpoints.
+	bool readGuide(std::vector<unsigned char>& state) {
+		PathGuide::Progress progress = guide.progress();
+		size_t train = PathGuide::trainBytes(), cdf = PathGuide::cdfBytes();
+		state.resize(sizeof(progress) + train + cdf);
+		memcpy(state.data(), &progress, sizeof(progress));
+		unsigned char* histograms = state.data() + sizeof(progress);
+		cl_int ret = clEnqueueReadBuffer(queue, guideTrainBuffer, CL_FALSE, 0, train, histograms, 0, nullptr, nullptr);
+		ret |= clEnqueueReadBuffer(queue, guideCdfBuffer, CL_TRUE, 0, cdf, histograms + train, 0, nullptr, nullptr);
+		if (ret != CL_SUCCESS) std::cerr << "Couldn't read the path guide: " << TranslateOpenCLError(ret) << std::endl;
+		return ret == CL_SUCCESS;
+	}
+
+	bool writeGuide(const std::vector<unsigned char>& state) {
+		PathGuide::Progress progress;
+		size_t train = PathGuide::trainBytes(), cdf = PathGuide::cdfBytes();
+		if (state.size() != sizeof(progress) + train + cdf) return false;
+		memcpy(&progress, state.data(), sizeof(progress));
+		guide.restore(progress);
+		const unsigned char* histograms = state.data() + sizeof(progress);
+		cl_int ret = clEnqueueWriteBuffer(queue, guideGridBuffer, CL_TRUE, 0, sizeof(GuideGrid), &guide.getGrid(), 0,
+			nullptr, nullptr);
+		ret |= clEnqueueWriteBuffer(queue, guideTrainBuffer, CL_TRUE, 0, train, histograms, 0, nullptr, nullptr);
+		ret |= clEnqueueWriteBuffer(queue, guideCdfBuffer, CL_TRUE, 0, cdf, histograms + train, 0, nullptr, nullptr);
+		if (ret != CL_SUCCESS)
+			std::cerr << "Couldn't restore the path guide: " << TranslateOpenCLError(ret) << std::endl;
+		return ret == CL_SUCCESS;
+	}
+
+	// Restores the accumulation and seed stream from checkpointPath if it was
+	// saved for the same scene, camera and settings; refuses it otherwise.
+	void resume() {
+		Checkpoint cp;
+		if (!CheckpointFile::load(checkpointPath, accumBytes() / sizeof(cl_double3), cp)) {
+			std::cout << "No usable checkpoint in " << checkpointPath << ", starting over" << std::endl;
+			return;
+		}
+		if (cp.sceneHash != sceneHash() || cp.width != renderWidth || cp.height != renderHeight) {
+			std::cout << "Refusing checkpoint " << checkpointPath << ": it was saved for another scene, camera or "
+				"settings" << std::endl;
+			return;
+		}
+		if (guiding && !writeGuide(cp.guide)) {
+			std::cout << "Refusing checkpoint " << checkpointPath << ": no usable path guide in it" << std::endl;
+			return;
+		}
+		err = clEnqueueWriteBuffer(queue, sumBuffer, CL_TRUE, 0, accumBytes(), cp.accum.data(), 0, nullptr, nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't restore sumBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		sampleCount = cp.sampleCount;
+		tracedSamples = lstTracedSamples = cp.tracedSamples;
+		seedBase = cp.seedBase;
+		launchIndex = cp.launchIndex;
+		// a resumed render starts still, a drop in resolution would resample it
+		stillFrames = stillFrameThreshold;
+		std::cout << "Resumed " << checkpointPath << " at " << sampleCount << " spp" << std::endl;
+	}
+
+	// What kernelMain and kernelPersistent are bound to, except seed and
+	// sample count: TRACE_KERNEL_ARGS in Common.cl, then the path tracer's
+	// PATH_KERNEL_ARGS and work counter.
+	struct TraceArgs {
+		cl_mem sphere, cam, sum, utilization, lights, lightNodes, shape;
+		cl_int sphereSize, shapeSize, lightCount, lightNodeCount, width, height;
+		cl_mem pathStats, guideGrid, guideTrain, guideCdf, workCounter;
+	};
+
+	TraceArgs traceArgs(cl_int width, cl_int height) {
+		return { sphereBuffer, camBuffer, sumBuffer, utilizationBuffer, lightBuffer, lightNodeBuffer, shapeBuffer,
+			sphereSize, shapeSize, lights.count(), lights.nodeCount(), width, height,
+			pathStatsBuffer, guideGridBuffer, guideTrainBuffer, guideCdfBuffer, workCounterBuffer };
+	}
+
+	// Binds a kernel of the current mode's program.
+	cl_int bindTraceArgs(cl_kernel kernel, bool isPersistent, const TraceArgs& a) {
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), &a.sphere);
+		ret |= clSetKernelArg(kernel, 1, sizeof(cl_int), &a.sphereSize);
+		ret |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &a.cam);
+		ret |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &a.sum);
+		ret |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &a.utilization);
+		ret |= clSetKernelArg(kernel, 7, sizeof(cl_int), &a.width);
+		ret |= clSetKernelArg(kernel, 8, sizeof(cl_int), &a.height);
+		ret |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &a.lights);
+		ret |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &a.lightNodes);
+		ret |= clSetKernelArg(kernel, 11, sizeof(cl_int), &a.lightCount);
+		ret |= clSetKernelArg(kernel, 12, sizeof(cl_int), &a.lightNodeCount);
+		ret |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &a.shape);
+		ret |= clSetKernelArg(kernel, 14, sizeof(cl_int), &a.shapeSize);
+		if (mode != 0) return ret;
+		ret |= clSetKernelArg(kernel, 15, sizeof(cl_mem), &a.pathStats);
+		ret |= clSetKernelArg(kernel, 16, sizeof(cl_mem), &a.guideGrid);
+		ret |= clSetKernelArg(kernel, 17, sizeof(cl_mem), &a.guideTrain);
+		ret |= clSetKernelArg(kernel, 18, sizeof(cl_mem), &a.guideCdf);
+		if (isPersistent) ret |= clSetKernelArg(kernel, 19, sizeof(cl_mem), &a.workCounter);
+		return ret;
+	}
+
+	cl_int bindTraceArgs(cl_kernel kernel, bool isPersistent, cl_int width, cl_int height) {
+		return bindTraceArgs(kernel, isPersistent, traceArgs(width, height));
+	}
+
+	// The ReSTIR mode's kernels and its two reservoir buffers, one reservoir
+	// per accumulation slot: kernelMain turns the history into this sample's
+	// reservoirs and restirShade hands them back as the next history.
+	cl_int bindRestirArgs(cl_int width, cl_int height) {
+		size_t bytes = accumBytes() / sizeof(cl_double3) * sizeof(Reservoir);
+		cl_int ret = CL_SUCCESS;
+		if (historyBuffer.size() < bytes) {
+			reservoirBuffer.reset();
+			historyBuffer.reset();
+			reservoirBuffer = pool.acquire(bytes, CL_MEM_READ_WRITE, MemAccumulation, nullptr, &ret);
+			if (ret == CL_SUCCESS)
+				historyBuffer = pool.acquire(bytes, CL_MEM_READ_WRITE, MemAccumulation, nullptr, &ret);
+			if (ret == CL_SUCCESS) ret = clearRestirHistory();
+			if (ret != CL_SUCCESS) {
+				std::cerr << "Couldn't create the reservoir buffers: " << TranslateOpenCLError(ret) << std::endl;
+				return ret;
+			}
+		}
+		cl_kernel sample = kernels[kernalName], shade = kernels[restirName];
+		ret = bindTraceArgs(shade, false, width, height);
+		ret |= clSetKernelArg(sample, 15, sizeof(cl_mem), historyBuffer.ptr());
+		ret |= clSetKernelArg(sample, 16, sizeof(cl_mem), reservoirBuffer.ptr());
+		ret |= clSetKernelArg(shade, 15, sizeof(cl_mem), reservoirBuffer.ptr());
+		ret |= clSetKernelArg(shade, 16, sizeof(cl_mem), historyBuffer.ptr());
+		return ret;
+	}
+
+	// Forgets every pixel's reservoir (M = 0), which stops meaning anything
+	// once the pixel layout changes.
+	cl_int clearRestirHistory() {
+		if (!historyBuffer) return CL_SUCCESS;
+		cl_uchar zero = 0;
+		return clEnqueueFillBuffer(queue, historyBuffer, &zero, sizeof(zero), 0, historyBuffer.size(), 0, nullptr,
+			nullptr);
+	}
+
+	// restirShade behind a kernelMain launch of the ReSTIR mode, with its seed and size.
+	cl_int enqueueRestirShade(cl_uint seed, const size_t* globalSize, const size_t* localSize, cl_event* event) {
+		cl_kernel kernel = kernels[restirName];
+		cl_int sampleNum = 1;
+		cl_int ret = clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+		ret |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+		ret |= clSetKernelArg(kernel, 7, sizeof(cl_int), &renderWidth);
+		ret |= clSetKernelArg(kernel, 8, sizeof(cl_int), &renderHeight);
+		if (ret != CL_SUCCESS) return ret;
+		return clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalSize, localSize, 0, nullptr, event);
+	}
+
+	// Starts the guide over on the loaded scene: empty histograms, no distributions.
+	void resetGuide() {
+		guide.reset(sphere.data(), sphereSize, shape.data(), shapeSize, cam);
+		cl_float zero = 0;
+		err = clEnqueueWriteBuffer(queue, guideGridBuffer, CL_TRUE, 0, sizeof(GuideGrid), &guide.getGrid(), 0, nullptr,
+			nullptr);
+		err |= clEnqueueFillBuffer(queue, guideTrainBuffer, &zero, sizeof(zero), 0, PathGuide::trainBytes(), 0, nullptr,
+			nullptr);
+		err |= clEnqueueFillBuffer(queue, guideCdfBuffer, &zero, sizeof(zero), 0, PathGuide::cdfBytes(), 0, nullptr,
+			nullptr);
+		if (err != CL_SUCCESS) std::cerr << "Couldn't reset the path guide: " << TranslateOpenCLError(err) << std::endl;
+	}
+
+	// Counts spp samples per pixel, just enqueued, towards the guide's
+	// training pass and, when it ends, enqueues buildGuide behind them.
+	cl_int advanceGuide(cl_int spp) {
+		if (!guiding || !kernels.count(guideName) || !guide.advance(spp)) return CL_SUCCESS;
+		cl_kernel kernel = kernels[guideName];
+		size_t cells = PathGuide::cells;
+		cl_int ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), guideTrainBuffer.ptr());
+		ret |= clSetKernelArg(kernel, 1, sizeof(cl_mem), guideCdfBuffer.ptr());
+		if (ret == CL_SUCCESS)
+			ret = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &cells, nullptr, 0, nullptr, nullptr);
+		if (ret == CL_SUCCESS)
+			ret = clEnqueueWriteBuffer(queue, guideGridBuffer, CL_TRUE, 0, sizeof(GuideGrid), &guide.getGrid(), 0,
+				nullptr, nullptr);
+		if (ret != CL_SUCCESS) std::cerr << "Couldn't build the path guide: " << TranslateOpenCLError(ret) << std::endl;
+		else
+			std::cout << "Path guide pass " << guide.getPass() << (guide.training() ? "" : ", done training") << std::endl;
+		return ret;
+	}
+
+	void bindKernelArgs() {
+		err = bindTraceArgs(kernels[kernalName], false, renderWidth, renderHeight);
+		if (hasPersistent()) err |= bindTraceArgs(kernels[persistentName], true, renderWidth, renderHeight);
+		if (kernels.count(restirName)) err |= bindRestirArgs(renderWidth, renderHeight);
 		if (err != CL_SUCCESS) {
 			std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
 			return;
 		}
 	}
 
+	std::string baseBuildOptions() {
+		char buffer[64];
+		sprintf(buffer, "-D PIXEL_ORDER=%d -D TILE_SIZE=%d", pixelOrder, tileSize);
+		return std::string(buffer) + (measureUtilization ? " -D MEASURE_UTILIZATION" : "")
+			+ (measurePathStats ? " -D PATH_STATS" : "")
+			+ (guiding ? " -D PATH_GUIDING" : "")
+			+ (specialize ? sceneBuildOptions() : "");
+	}
+
+	// Facts about the loaded scene that the specialized kernels take as
+	// constants, see SPHERE_COUNT in PathTrace.cl. Programs are cached by
+	// their options, so each scene signature is compiled once.
+	std::string sceneBuildOptions() {
+		int materialMask = 0;
+		for (int i = 0; i < sphereSize; i++) materialMask |= 1 << sphere[i].mat.type;
+		for (int i = 0; i < shapeSize; i++) materialMask |= 1 << shape[i].mat.type;
+		char buffer[192];
+		sprintf(buffer, " -D SPHERE_COUNT=%d -D SHAPE_COUNT=%d -D MATERIAL_MASK=0x%x -D MAX_DEPTH=%d -D RR_P=%.17g"
+			" -D EPS=%.17g", sphereSize, shapeSize, materialMask, maxDepth, rrProbability, epsilon);
+		return buffer;
+	}
+
+	std::string buildOptions() {
+		return baseBuildOptions() + " " + mainTune.options;
+	}
+
+	// Builds every mode with the current options, so switching modes never
+	// waits for the compiler, then makes the current mode's kernels live.
+	void rebuildProgram() {
+		std::string options = buildOptions();
+		for (int m = 0; m < (int)modeFiles.size(); m++) getProgram(programFiles(m), options);
+		createProgramFromFiles(programFiles(mode), options);
+		bindKernelArgs();
+	}
+
+	void applyMode() {
+		createProgramFromFiles(programFiles(mode), buildOptions());
+		bindKernelArgs();
+		resetAccumulation();
+		scheduler.reset();
+	}
+
+	// Times the current mode's kernelMain built generic and specialized for the current scene.
+	void benchmarkSpecialization() {
+		Autotuner tuner(*this);
+		TuneTarget target = makeTuneTarget(kernalName, false);
+		bool was = specialize;
+		specialize = false;
+		double generic = tuner.time(programFiles(mode), buildOptions(), target);
+		specialize = true;
+		double specialized = tuner.time(programFiles(mode), buildOptions(), target);
+		specialize = was;
+		std::cout << kernalName << " generic " << generic << " ms, specialized" << sceneBuildOptions() << ": "
+			<< specialized << " ms";
+		if (generic > 0 && specialized > 0) std::cout << " (" << generic / specialized << "x)";
+		std::cout << std::endl;
+		resetAccumulation();
+	}
+
+	// Times the current mode's kernelMain on the loaded scene against the same
+	// scene with its planes swapped for huge spheres, the way walls used to be
+	// built. Both run generic kernels, as the sphere count differs.
+	void benchmarkShapes() {
+		std::vector<Sphere> walled = sphere;
+		std::vector<Shape> rest = shape;
+		planesToSpheres(walled, rest, wallSphereRadius);
+		int planes = shapeSize - (int)rest.size();
+
+		bool was = specialize;
+		specialize = false;
+		std::string options = buildOptions();
+		specialize = was;
+		double flat = timeScene(*this, sphere.data(), sphereSize, shape.data(), shapeSize, options);
+		double walls = timeScene(*this, walled.data(), (cl_int)walled.size(), rest.data(), (cl_int)rest.size(),
+			options);
+		std::cout << kernalName << " with " << planes << " planes " << flat << " ms, with wall spheres " << walls << " ms";
+		if (flat > 0 && walls > 0) std::cout << " (" << walls / flat << "x)";
+		std::cout << std::endl;
+	}
+
+	// A kernel and build that benchmarkConvergence() runs on every scene.
+	struct ConvergenceConfig {
+		std::string name;
+		int mode;
+		bool persistent, specialize;
+		// trains the path guide from scratch within the time budget
+		bool guided;
+	};
+	const std::vector<ConvergenceConfig> convergenceConfigs = {
+		{ "PathTrace", 0, false, false, false },
+		{ "PathTrace persistent", 0, true, false, false },
+		{ "PathTrace specialized", 0, false, true, false },
+		{ "PathTrace guided", 0, false, false, true },
+		{ "BDPT", 5, false, false, false },
+	};
+
+	// Sets up bundled scene index (below sceneCount) and its light list on the host.
+	void buildScene(int index) {
+		if (index == 0) initScene1(cam, sphere, shape, winWidth, winHeight);
+		else if (index == 1) initScene2(cam, sphere, shape, winWidth, winHeight);
+		else initScene3(cam, sphere, shape, winWidth, winHeight);
+		sphereSize = sphere.size();
+		shapeSize = shape.size();
+		lights.build(sphere.data(), sphereSize);
+	}
+
+	// Loads a bundled scene and replaces the scene buffers.
+	bool loadScene(int index) {
+		buildScene(index);
+		// handed back first, so the new scene can reuse them
+		for (PooledBuffer* b : { &camBuffer, &sphereBuffer, &shapeBuffer, &lightBuffer, &lightNodeBuffer }) b->reset();
+		if (!createSceneBuffers()) return false;
+		resetGuide();
+		return true;
+	}
+
+	// Enqueues one launch adding sampleNum samples per pixel into the buffer
+	// bound as the kernel's sumColor, at window size.
+	cl_int traceWindow(cl_kernel kernel, bool isPersistent, cl_int sampleNum) {
+		cl_uint seed = nextSeed();
+		cl_int ret = clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+		ret |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+		if (ret != CL_SUCCESS) return ret;
+		if (isPersistent) {
+			cl_int start = 0;
+			clEnqueueFillBuffer(queue, workCounterBuffer, &start, sizeof(start), 0, sizeof(start), 0, nullptr, nullptr);
+			return clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &persistentGlobalSize, &persistentLocalSize,
+				0, nullptr, nullptr);
+		}
+		size_t* localSize = mainTune.localSize[0] ? mainTune.localSize : nullptr;
+		size_t traceSize[2] = { dispatchSize(winWidth), dispatchSize(winHeight) };
+		for (int j = 0; localSize && j < 2; j++)
+			traceSize[j] = (traceSize[j] + localSize[j] - 1) / localSize[j] * localSize[j];
+		return clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, traceSize, localSize, 0, nullptr, nullptr);
+	}
+
+	// Row-major radiance of a window-sized accumulation over spp samples.
+	std::vector<cl_double3> readRadiance(cl_mem accum, cl_mem rowMajor, cl_ulong spp) {
+		std::vector<cl_double3> img((size_t)winWidth * winHeight);
+		cl_kernel kernel = kernels[snapshotName];
+		size_t size[2] = { (size_t)winWidth, (size_t)winHeight };
+		err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &accum);
+		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &rowMajor);
+		if (err == CL_SUCCESS) err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, size, nullptr, 0, nullptr, nullptr);
+		if (err == CL_SUCCESS)
+			err = clEnqueueReadBuffer(queue, rowMajor, CL_TRUE, 0, img.size() * sizeof(cl_double3), img.data(),
+				0, nullptr, nullptr);
+		if (err != CL_SUCCESS) std::cerr << "Couldn't read the accumulation: " << TranslateOpenCLError(err) << std::endl;
+		for (cl_double3& c : img) c = c / (double)spp;
+		return img;
+	}
+
+	// Reference of the loaded scene at window size: referenceSpp samples of
+	// the generic path tracer, cached in a PFM named after the scene content.
+	bool sceneReference(const std::string& name, cl_mem accum, cl_mem rowMajor, std::vector<cl_double3>& ref) {
+		return cachedRender("reference", name, "", referenceSpp, accum, rowMajor, ref);
+	}
+
+	// The loaded scene's caustic regions: pixels where the path tracer's
+	// caustic paths alone (see CAUSTIC_PATHS in PathTrace.cl) carry at least
+	// causticShare of the reference.
+	bool causticMask(const std::string& name, cl_mem accum, cl_mem rowMajor, const std::vector<cl_double3>& ref,
+		Convergence::Mask& mask) {
+		std::vector<cl_double3> caustic;
+		if (!cachedRender("caustic", name, " -D CAUSTIC_PATHS", causticMaskSpp, accum, rowMajor, caustic)) return false;
+		mask = Convergence::shareMask(caustic, ref, causticShare);
+		std::cout << "Caustic mask of " << name << ": " << std::count(mask.begin(), mask.end(), true) << " of "
+			<< mask.size() << " pixels" << std::endl;
+		return true;
+	}
+
+	// spp samples of the generic path tracer built with extra options, at
+	// window size, cached in <kind>_<scene>_<size>_<spp>spp_<hash>.pfm.
+	bool cachedRender(const char* kind, const std::string& name, const std::string& options, int spp, cl_mem accum,
+		cl_mem rowMajor, std::vector<cl_double3>& ref) {
+		char path[160];
+		snprintf(path, sizeof(path), "%s_%s_%dx%d_%dspp_%016llx.pfm", kind, name.c_str(), winWidth, winHeight, spp,
+			(unsigned long long)sceneContentHash());
+		if (Convergence::readPfm(path, winWidth, winHeight, ref)) {
+			std::cout << "Using " << kind << " " << path << std::endl;
+			return true;
+		}
+
+		mode = 0;
+		specialize = false;
+		guiding = false;
+		if (!createProgramFromFiles(programFiles(mode), buildOptions() + options)) return false;
+		cl_kernel kernel = kernels[kernalName];
+		cl_double3 zero = { 0, 0, 0 };
+		err = bindTraceArgs(kernel, false, winWidth, winHeight);
+		err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &accum);
+		err |= clEnqueueFillBuffer(queue, accum, &zero, sizeof(zero), 0,
+			dispatchSize(winWidth) * dispatchSize(winHeight) * sizeof(cl_double3), 0, nullptr, nullptr);
+		double start = glfwGetTime();
+		for (int done = 0; err == CL_SUCCESS && done < spp; done += posterSamplesPerLaunch) {
+			err = traceWindow(kernel, false, std::min(posterSamplesPerLaunch, spp - done));
+			if (done % 512 == 0) clFinish(queue);
+		}
+		if (err != CL_SUCCESS) {
+			std::cerr << "Rendering the " << kind << " failed: " << TranslateOpenCLError(err) << std::endl;
+			return false;
+		}
+		ref = readRadiance(accum, rowMajor, spp);
+		std::cout << "Rendered " << kind << " " << path << " in " << glfwGetTime() - start << " s" << std::endl;
+		if (!Convergence::writePfm(path, winWidth, winHeight, ref)) std::cerr << "Couldn't write " << path << std::endl;
+		return err == CL_SUCCESS;
+	}
+
+	// Accumulation buffer size: the largest render resolution rounded up to
+	// whole tiles, whatever the pixel order, so switching orders needs no new
+	// buffers.
+	size_t accumBytes() const {
+		size_t w = (resolution.getMaxWidth() + tileSize - 1) / tileSize * tileSize;
+		size_t h = (resolution.getMaxHeight() + tileSize - 1) / tileSize * tileSize;
+		return w * h * sizeof(cl_double3);
+	}
+
+	// Fits the accumulation, its resample target and the three mailbox
+	// frames into the device memory budget: first without the resample
+	// buffer, so a resize restarts the accumulation instead of carrying it
+	// over, then at half and quarter render resolution, which the display
+	// scales up.
+	void planAccumulation() {
+		resampleAccumulation = true;
+		for (double scale : { 1.0, 0.5, 0.25 }) {
+			resolution.setMaxScale(scale);
+			size_t accum = accumBytes();
+			size_t frame = (size_t)resolution.getMaxWidth() * resolution.getMaxHeight() * sizeof(cl_double3);
+			if (pool.fits({ accum, accum, frame, frame, frame })) break;
+			if (pool.fits({ accum, frame, frame, frame })) {
+				resampleAccumulation = false;
+				break;
+			}
+		}
+		renderWidth = resolution.getWidth();
+		renderHeight = resolution.getHeight();
+		if (!resampleAccumulation || renderWidth != winWidth || renderHeight != winHeight)
+			std::cout << "Device memory budget: accumulating at " << renderWidth << "x" << renderHeight
+				<< (resampleAccumulation ? "" : " without resampling on resize") << std::endl;
+	}
+
+	// Image size rounded up to whole tiles, which is what the tiled orders launch.
+	size_t dispatchSize(cl_int size) {
+		if (pixelOrder == 0) return size;
+		return (size + tileSize - 1) / tileSize * tileSize;
+	}
+
+	TuneTarget makeTuneTarget(const std::string& name, bool isPersistent) {
+		TuneTarget target;
+		target.name = name;
+		target.dims = isPersistent ? 1 : 2;
+		target.globalSize[0] = dispatchSize(winWidth);
+		target.globalSize[1] = dispatchSize(winHeight);
+		target.groups = isPersistent ? persistentGlobalSize / persistentLocalSize : 0;
+		target.bindArgs = [this, isPersistent](cl_kernel kernel, cl_uint seed) {
+			cl_int sampleNum = tuneSamples;
+			cl_int ret = bindTraceArgs(kernel, isPersistent, winWidth, winHeight);
+			ret |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+			ret |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+			return ret == CL_SUCCESS;
+		};
+		target.reset = [this]() {
+			cl_int start = 0;
+			resetAccumulation();
+			clEnqueueFillBuffer(queue, workCounterBuffer, &start, sizeof(start), 0, sizeof(start), 0, nullptr, nullptr);
+		};
+		target.output = sumBuffer;
+		target.outputCount = target.globalSize[0] * target.globalSize[1];
+		return target;
+	}
+
+	// Device selection workload: kernelMain of the current mode on the loaded
+	// scene, on a probe context of the candidate device. Milliseconds per
+	// launch, -1 on failure.
+	double calibrateDevice(CLManager& probe) {
+		return timeScene(probe, sphere.data(), sphereSize, shape.data(), shapeSize, baseBuildOptions());
+	}
+
+	// Milliseconds per launch of the current mode's kernelMain over a
+	// calibrationSize square with the given spheres and shapes, built with
+	// options on probe's context. -1 on failure.
+	double timeScene(CLManager& probe, const Sphere* spheres, cl_int sphereNum, const Shape* shapes, cl_int shapeNum,
+		const std::string& options) {
+		std::vector<LightEntry> entries = lights.paddedEntries();
+		std::vector<LightNode> nodes = lights.paddedNodes();
+		size_t pixels = (size_t)calibrationSize * calibrationSize;
+		cl_int e = CL_SUCCESS, ret;
+		PooledBuffer sphereMem = probe.pool.acquire(sphereNum * sizeof(Sphere), CL_MEM_READ_ONLY, MemScene, spheres,
+			&ret);
+		e |= ret;
+		PooledBuffer shapeMem = probe.pool.acquire(std::max<cl_int>(shapeNum, 1) * sizeof(Shape), CL_MEM_READ_ONLY,
+			MemScene, shapes, &ret);
+		e |= ret;
+		PooledBuffer camera = probe.pool.acquire(sizeof(Camera), CL_MEM_READ_ONLY, MemScene, &cam, &ret);
+		e |= ret;
+		PooledBuffer accum = probe.pool.acquire(pixels * sizeof(cl_double3), CL_MEM_READ_WRITE, MemAccumulation,
+			nullptr, &ret);
+		e |= ret;
+		// utilization and path statistics, whichever the options build
+		PooledBuffer counters = probe.pool.acquire(PathStats::size * sizeof(cl_ulong), CL_MEM_READ_WRITE, MemScratch,
+			nullptr, &ret);
+		e |= ret;
+		PooledBuffer lightMem = probe.pool.acquire(entries.size() * sizeof(LightEntry), CL_MEM_READ_ONLY, MemScene,
+			entries.data(), &ret);
+		e |= ret;
+		PooledBuffer nodeMem = probe.pool.acquire(nodes.size() * sizeof(LightNode), CL_MEM_READ_ONLY, MemAcceleration,
+			nodes.data(), &ret);
+		e |= ret;
+		// a guide that neither trains nor has distributions, for PATH_GUIDING builds
+		PathGuide probeGuide;
+		probeGuide.reset(spheres, sphereNum, shapes, shapeNum, cam);
+		GuideGrid noGuide = probeGuide.getGrid();
+		noGuide.train = 0;
+		PooledBuffer guideMem = probe.pool.acquire(sizeof(GuideGrid), CL_MEM_READ_ONLY, MemAcceleration, &noGuide,
+			&ret);
+		e |= ret;
+		std::vector<cl_float> noCdf((size_t)PathGuide::cells * PathGuide::bins);
+		PooledBuffer cdfMem = probe.pool.acquire(PathGuide::cdfBytes(), CL_MEM_READ_ONLY, MemAcceleration, noCdf.data(),
+			&ret);
+		e |= ret;
+
+		double ms = -1;
+		if (e == CL_SUCCESS) {
+			TuneTarget target;
+			target.name = kernalName;
+			target.dims = 2;
+			target.globalSize[0] = target.globalSize[1] = calibrationSize;
+			TraceArgs args = { sphereMem, camera, accum, counters, lightMem, nodeMem, shapeMem,
+				sphereNum, shapeNum, lights.count(), lights.nodeCount(), calibrationSize, calibrationSize,
+				counters, guideMem, counters, cdfMem, nullptr };
+			target.bindArgs = [&](cl_kernel kernel, cl_uint seed) {
+				cl_int sampleNum = tuneSamples;
+				cl_int r = bindTraceArgs(kernel, false, args);
+				r |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+				r |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+				return r == CL_SUCCESS;
+			};
+			target.reset = [&]() {
+				cl_double3 zero = { 0, 0, 0 };
+				clEnqueueFillBuffer(probe.queue, accum, &zero, sizeof(zero), 0, pixels * sizeof(cl_double3),
+					0, nullptr, nullptr);
+			};
+			target.output = accum;
+			target.outputCount = pixels;
+			ms = Autotuner(probe).time(programFiles(mode), options, target);
+		}
+
+		return ms;
+	}
+
+	std::string sourceHash(const std::vector<std::string>& files) {
+		std::string sources = readSources(files);
+		char buffer[17];
+		sprintf(buffer, "%016llx", HashBytes(sources.data(), sources.size()));
+		return buffer;
+	}
+
+	// Picks up cached tuning results, or measures them when autotune is set.
+	// Build options are tuned on the path tracer's kernelMain and shared by
+	// every mode, the persistent kernel then only tunes its work-group size.
+	void initAutotune() {
+		Autotuner tuner(*this);
+		std::vector<std::string> files = programFiles(0);
+		std::string hash = sourceHash(files);
+		std::string baseOptions = baseBuildOptions();
+
+		if (autotune) {
+			TuneTarget target = makeTuneTarget(kernalName, false);
+			if (tuner.prepareReference(files, baseOptions, target)) {
+				mainTune = tuner.tune(files, baseOptions, tuner.buildOptionSets, target);
+				tuner.store(hash, kernalName, mainTune);
+			}
+
+			std::string options = baseOptions + " " + mainTune.options;
+			target = makeTuneTarget(persistentName, true);
+			if (tuner.prepareReference(files, options, target)) {
+				persistentTune = tuner.tune(files, options, { "" }, target);
+				persistentTune.options = mainTune.options;
+				tuner.store(hash, persistentName, persistentTune);
+			}
+			resetAccumulation();
+		} else {
+			tuner.lookup(hash, kernalName, mainTune);
+			tuner.lookup(hash, persistentName, persistentTune);
+		}
+
+		if (persistentTune.localSize[0]) {
+			size_t groups = persistentGlobalSize / persistentLocalSize;
+			persistentLocalSize = persistentTune.localSize[0];
+			persistentGlobalSize = persistentLocalSize * groups;
+		}
+	}
+
 	void initGLBuffers() {
 		glGenVertexArrays(1, &vao);
 		glBindVertexArray(vao);
@@ -96,14 +998,27 @@ private:
 		glBindTexture(GL_TEXTURE_2D, texture);
 
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+		// allocated once at window size, lower render resolutions use its corner
+		glGenTextures(1, &displayTexture);
+		glBindTexture(GL_TEXTURE_2D, displayTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		if (halfFloatDisplay)
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, winWidth, winHeight, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, winWidth, winHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 
 	void initShaders() {
-		GLuint vs, fs, prog;
+		GLuint vs, fs;
 		char* vsSource, * fsSource;
 		size_t vs_length, fs_length;
 
@@ -122,16 +1037,282 @@ private:
 		delete[] vsSource;
 		delete[] fsSource;
 
-		prog = glCreateProgram();
+		shaderProgram = glCreateProgram();
 
-		glBindAttribLocation(prog, 0, "in_coords");
-		glBindAttribLocation(prog, 1, "in_color");
+		glBindAttribLocation(shaderProgram, 0, "in_coords");
+		glBindAttribLocation(shaderProgram, 1, "in_color");
 
-		glAttachShader(prog, vs);
-		glAttachShader(prog, fs);
+		glAttachShader(shaderProgram, vs);
+		glAttachShader(shaderProgram, fs);
 
-		glLinkProgram(prog);
-		glUseProgram(prog);
+		glLinkProgram(shaderProgram);
+		glUseProgram(shaderProgram);
+		renderSizeLocation = glGetUniformLocation(shaderProgram, "renderSize");
+	}
+
+	void resetAccumulation() {
+		cl_double3 zero = { 0, 0, 0 };
+		sampleCount = 0;
+		err = clEnqueueFillBuffer(queue, sumBuffer, &zero, sizeof(zero), 0, accumBytes(), 0, nullptr, nullptr);
+		if (err != CL_SUCCESS)
+			std::cerr << "Couldn't clear sumBuffer: " << TranslateOpenCLError(err) << std::endl;
+	}
+
+	void resizeRender(cl_int w, cl_int h) {
+		// no room to resample into, see planAccumulation()
+		if (sampleCount > 0 && !resampleAccumulation) resetAccumulation();
+		else if (sampleCount > 0) {
+			cl_kernel kernel = kernels[resampleName];
+			err = clSetKernelArg(kernel, 0, sizeof(cl_mem), sumBuffer.ptr());
+			err |= clSetKernelArg(kernel, 1, sizeof(cl_int), &renderWidth);
+			err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &renderHeight);
+			err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), resampleBuffer.ptr());
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+
+			size_t globalSize[]{ (size_t)w, (size_t)h };
+			err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalSize,
+				nullptr, 0, nullptr, nullptr);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Resample accumulation failed: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+
+			std::swap(sumBuffer, resampleBuffer);
+			err = clSetKernelArg(kernels[kernalName], 5, sizeof(cl_mem), sumBuffer.ptr());
+			if (hasPersistent()) err |= clSetKernelArg(kernels[persistentName], 5, sizeof(cl_mem), sumBuffer.ptr());
+			if (kernels.count(restirName))
+				err |= clSetKernelArg(kernels[restirName], 5, sizeof(cl_mem), sumBuffer.ptr());
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
+		}
+		err = clearRestirHistory();
+		if (err != CL_SUCCESS)
+			std::cerr << "Couldn't clear the reservoir history: " << TranslateOpenCLError(err) << std::endl;
+		renderWidth = w;
+		renderHeight = h;
+	}
+
+	// The display side's tone mapping reads the row-major frames, whatever
+	// order the trace kernels use.
+	void initDisplay() {
+		// profiled for the trace timeline
+		displayQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Create display queue failed: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+
+		cl_program displayProgram = getProgram({ "Common.cl" }, "-D PIXEL_ORDER=0");
+		displayToneMap = clCreateKernel(displayProgram, toneMapName.c_str(), &err);
+		displayToneMapImage = clCreateKernel(displayProgram, toneMapImageName.c_str(), &err);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't create display kernels: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		clSetKernelArg(displayToneMapImage, 0, sizeof(cl_mem), &outImage);
+		if (!glSharing) displayPath = DisplayMapped;
+	}
+
+	// Display path that works without CL/GL sharing: the tone mapping writes
+	// a CL buffer wrapping a persistently mapped GL buffer, which is then
+	// uploaded into the texture. There are two of each, so CL fills one while
+	// GL may still be reading the other.
+	void initMappedDisplay() {
+		GLsizeiptr size = (GLsizeiptr)winWidth * winHeight * sizeof(cl_uint);
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(2, mappedPbo);
+		for (int i = 0; i < 2; i++) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mappedPbo[i]);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+			mappedPtr[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+			mappedBuffer[i] = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, size, mappedPtr[i], &err);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create mapped display buffer: " << TranslateOpenCLError(err) << std::endl;
+				break;
+			}
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	// Tone maps into a shared GL object, the PBO or the display texture.
+	void displayShared(const RenderFrame& frame) {
+		bool image = displayPath == DisplayZeroCopy;
+		cl_kernel kernel = image ? displayToneMapImage : displayToneMap;
+		cl_mem& out = image ? outImage : outBuffer;
+		// the mapped path rebinds the buffer kernel's output
+		if (!image) clSetKernelArg(kernel, 0, sizeof(cl_mem), &outBuffer);
+		bool tracing = tracer.recording();
+		cl_event events[3];
+		{
+			Tracer::Span span(tracer, "acquire GL");
+			err = clEnqueueAcquireGLObjects(displayQueue, 1, &out, 0, NULL, tracing ? &events[0] : NULL);
+		}
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't acquire the GL object" << std::endl;
+			return;
+		}
+
+		size_t globalSize[]{ (size_t)frame.width, (size_t)frame.height };
+		err = clEnqueueNDRangeKernel(displayQueue, kernel, 2, nullptr, globalSize,
+			nullptr, 0, nullptr, tracing ? &events[1] : nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Tone mapping failed: " << TranslateOpenCLError(err) << std::endl;
+			events[1] = 0;
+		}
+
+		{
+			Tracer::Span span(tracer, "release GL");
+			clEnqueueReleaseGLObjects(displayQueue, 1, &out, 0, NULL, tracing ? &events[2] : NULL);
+			clFinish(displayQueue);
+		}
+		if (tracing) {
+			tracer.syncDevice(events[2]);
+			const char* names[] = { "acquire GL", "tone map", "release GL" };
+			for (int i = 0; i < 3; i++) {
+				if (!events[i]) continue;
+				tracer.deviceSpan(names[i], Tracer::DisplayQueue, events[i]);
+				clReleaseEvent(events[i]);
+			}
+		}
+
+		if (!image) uploadTexture(pbo, frame);
+	}
+
+	// Tone maps into the mapped buffer GL is done with, makes the result
+	// visible in host memory and uploads it.
+	void displayMapped(const RenderFrame& frame) {
+		int i = mappedIndex;
+		mappedIndex ^= 1;
+		if (mappedFence[i]) {
+			glClientWaitSync(mappedFence[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(mappedFence[i]);
+			mappedFence[i] = 0;
+		}
+
+		bool tracing = tracer.recording();
+		cl_event toneMapEvent = 0, mapEvent = 0;
+		err = clSetKernelArg(displayToneMap, 0, sizeof(cl_mem), &mappedBuffer[i]);
+		size_t globalSize[]{ (size_t)frame.width, (size_t)frame.height };
+		if (err == CL_SUCCESS)
+			err = clEnqueueNDRangeKernel(displayQueue, displayToneMap, 2, nullptr, globalSize,
+				nullptr, 0, nullptr, tracing ? &toneMapEvent : nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Tone mapping failed: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+
+		size_t size = (size_t)frame.width * frame.height * sizeof(cl_uint);
+		void* host;
+		{
+			Tracer::Span span(tracer, "map display buffer");
+			host = clEnqueueMapBuffer(displayQueue, mappedBuffer[i], CL_TRUE, CL_MAP_READ, 0, size,
+				0, nullptr, tracing ? &mapEvent : nullptr, &err);
+		}
+		if (tracing) {
+			if (err == CL_SUCCESS) tracer.syncDevice(mapEvent);
+			tracer.deviceSpan("tone map", Tracer::DisplayQueue, toneMapEvent);
+			clReleaseEvent(toneMapEvent);
+			if (err == CL_SUCCESS) {
+				tracer.deviceSpan("map", Tracer::DisplayQueue, mapEvent);
+				clReleaseEvent(mapEvent);
+			}
+		}
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't map display buffer: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		clEnqueueUnmapMemObject(displayQueue, mappedBuffer[i], host, 0, nullptr, nullptr);
+		clFinish(displayQueue);
+
+		uploadTexture(mappedPbo[i], frame);
+		mappedFence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void uploadTexture(GLuint buffer, const RenderFrame& frame) {
+		Tracer::Span span(tracer, "texture upload");
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame.width, frame.height,
+			0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glFinish();
+	}
+
+	void post(std::function<void()> action) {
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		pending.push_back(action);
+	}
+
+	void runPending() {
+		std::vector<std::function<void()>> actions;
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex);
+			actions.swap(pending);
+		}
+		for (auto& action : actions) action();
+	}
+
+	// Copies the accumulation into the mailbox and hands it to the display
+	// side. The queue is drained before publishing, so the display queue
+	// never sees a half-written frame.
+	void publishFrame(int samplesPerLaunch, int launchesPerFrame) {
+		RenderFrame& frame = frames.getBack();
+		cl_kernel kernel = kernels[snapshotName];
+		err = clSetKernelArg(kernel, 0, sizeof(cl_mem), sumBuffer.ptr());
+		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &frame.accum);
+		size_t globalSize[]{ (size_t)renderWidth, (size_t)renderHeight };
+		bool tracing = tracer.recording();
+		cl_event snapshotEvent;
+		if (err == CL_SUCCESS)
+			err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalSize, nullptr, 0, nullptr,
+				tracing ? &snapshotEvent : nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Snapshot failed: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		{
+			Tracer::Span span(tracer, "clFinish");
+			clFinish(queue);
+		}
+		if (tracing) {
+			tracer.syncDevice(snapshotEvent);
+			tracer.deviceSpan("snapshot", Tracer::TraceQueue, snapshotEvent);
+			clReleaseEvent(snapshotEvent);
+		}
+
+		frame.sampleCount = sampleCount;
+		frame.width = renderWidth;
+		frame.height = renderHeight;
+		frame.samplesPerLaunch = samplesPerLaunch;
+		frame.launchesPerFrame = launchesPerFrame;
+		frame.tracedSamples = tracedSamples;
+		frame.utilization = utilization;
+		frame.pathStats = pathStats;
+		frame.mode = mode;
+		frame.pixelOrder = pixelOrder;
+		frame.persistent = persistent && hasPersistent();
+		frame.specialize = specialize;
+		frames.publish();
+	}
+
+	// Enough work-groups to keep every compute unit busy, no more.
+	void initPersistent() {
+		cl_uint computeUnits = 1;
+		size_t maxGroupSize = 1, multiple = 1;
+		clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, nullptr);
+		clGetKernelWorkGroupInfo(kernels[persistentName], device, CL_KERNEL_WORK_GROUP_SIZE,
+			sizeof(size_t), &maxGroupSize, nullptr);
+		clGetKernelWorkGroupInfo(kernels[persistentName], device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+			sizeof(size_t), &multiple, nullptr);
+
+		persistentLocalSize = std::min<size_t>(64, maxGroupSize) / multiple * multiple;
+		if (persistentLocalSize == 0) persistentLocalSize = std::min(multiple, maxGroupSize);
+		persistentGlobalSize = persistentLocalSize * computeUnits * persistentGroupsPerUnit;
 	}
 
 public:
@@ -140,16 +1321,661 @@ public:
 		winHeight = h;
 	}
 
+	void setTargetFrameTime(double ms) {
+		resolution.setTargetFrameTime(ms);
+	}
+
+	void setFrameBudget(double ms) {
+		scheduler.setFrameBudget(ms);
+	}
+
+	// Benchmarks work-group sizes and build options at init() instead of
+	// reading them from the cache.
+	void setAutotune(bool on) {
+		autotune = on;
+	}
+
+	// Builds the kernels with SIMD utilization counters, must be set before init().
+	void setMeasureUtilization(bool on) {
+		measureUtilization = on;
+	}
+
+	// Builds the path tracer with path statistics (PathStats.h), must be set before init().
+	void setPathStats(bool on) {
+		measurePathStats = on;
+	}
+
+	// Builds the path tracer with online path guiding (PathGuide.h), must be set before init().
+	void setGuiding(bool on) {
+		guiding = on;
+	}
+
+	// Bundled scene to start with, below sceneCount. Call before init().
+	void setScene(int index) {
+		if (index >= 0 && index < sceneCount) scene = index;
+	}
+
+	// Rebuilds with or without path guiding; the guide trains from scratch.
+	void toggleGuiding() {
+		post([this]() {
+			guiding = !guiding;
+			std::cout << (guiding ? "Path guiding" : "No path guiding") << std::endl;
+			rebuildProgram();
+			resetGuide();
+		});
+	}
+
+	// Where toggleTrace() writes the timeline.
+	void setTracePath(const std::string& path) {
+		tracePath = path;
+	}
+
+	// Starts recording the trace timeline, or stops and writes it.
+	void toggleTrace() {
+		if (!tracer.recording()) {
+			tracer.start();
+			std::cout << "Recording trace" << std::endl;
+			return;
+		}
+		tracer.stop();
+		if (tracer.write(tracePath)) std::cout << "Wrote trace " << tracePath << std::endl;
+		else std::cerr << "Couldn't write " << tracePath << std::endl;
+	}
+
+	Tracer& getTracer() {
+		return tracer;
+	}
+
+	// Pixel order and tile size (a power of two) for init().
+	void setPixelOrder(int order, int size) {
+		pixelOrder = order;
+		tileSize = size;
+	}
+
+	// Rebuilds the kernels for the next pixel order. The sumColor layout
+	// changes with it, so accumulation restarts and the reservoirs are dropped.
+	void cyclePixelOrder() {
+		post([this]() {
+			const char* names[] = { "Row-major", "Morton", "Tiled" };
+			pixelOrder = (pixelOrder + 1) % 3;
+			std::cout << names[pixelOrder] << " pixel order" << std::endl;
+			rebuildProgram();
+			resetAccumulation();
+			err = clearRestirHistory();
+			if (err != CL_SUCCESS)
+				std::cerr << "Couldn't clear the reservoir history: " << TranslateOpenCLError(err) << std::endl;
+		});
+	}
+
+	// Builds the kernels for the loaded scene, must be set before init() to
+	// also apply to autotuning. Benchmarking compares both builds at init().
+	void setSpecialize(bool on, bool benchmark) {
+		specialize = on;
+		benchSpecialize = benchmark;
+	}
+
+	// Takes effect at the start of the next render iteration. Every mode is
+	// prebuilt, so cheap modes can stand in while navigating.
+	void setMode(int m) {
+		if (m < 0 || m >= (int)modeFiles.size()) return;
+		post([this, m]() {
+			if (m == mode) return;
+			mode = m;
+			std::cout << modeNames[m] << " mode" << std::endl;
+			applyMode();
+		});
+	}
+
+	// Times the scene's planes against huge wall spheres at init().
+	void setBenchShapes(bool on) {
+		benchShapes = on;
+	}
+
+	// Renders on the first device whose "platform / device" name contains
+	// name; empty calibrates every device and takes the fastest. CPU devices
+	// leave reservedCores cores to the host. Must be set before init().
+	void setDevice(const std::string& name, cl_uint reservedCores) {
+		devicePreference = name;
+		hostCores = reservedCores;
+	}
+
+	// Device memory to stay within in MB, 0 for the device's global memory.
+	void setMemoryBudget(size_t mb) {
+		memoryBudget = mb << 20;
+	}
+
+	// Checkpoints the accumulation to path every interval seconds while the
+	// camera is still; with resume, init() picks up path if it matches.
+	void setCheckpoint(const std::string& path, double interval, bool resume) {
+		checkpointPath = path;
+		checkpointInterval = interval;
+		resumeCheckpoint = resume;
+	}
+
+	// Texel format of the zero-copy texture, must be set before init().
+	void setDisplayFormat(bool halfFloat) {
+		halfFloatDisplay = halfFloat;
+	}
+
+	// 0 tone maps into a shared PBO that is copied into the texture, 1 tone
+	// maps straight into a shared texture, 2 goes through mapped buffers and
+	// needs no sharing. Must be set before init(); without cl_khr_gl_sharing
+	// only the mapped path is available.
+	void setDisplayPath(int path) {
+		displayPath = path;
+	}
+
+	// Cycles through the display paths the context supports.
+	void cycleDisplayPath() {
+		if (!glSharing) return;
+		displayPath = (displayPath + 1) % displayNames.size();
+		displayMs = 0;
+		std::cout << displayNames[displayPath] << " display" << std::endl;
+	}
+
+	void toggleSpecialize() {
+		post([this]() {
+			specialize = !specialize;
+			std::cout << (specialize ? "Scene-specialized kernels" : "Generic kernels") << std::endl;
+			rebuildProgram();
+		});
+	}
+
+	void togglePersistent() {
+		post([this]() {
+			persistent = !persistent;
+			std::cout << (persistent ? "Persistent threads dispatch" : "Per-pixel dispatch") << std::endl;
+		});
+	}
+
+	// Offline render of a width x height image with spp samples per pixel,
+	// saved as a tiled TIFF. Tiles of posterTile pixels, fewer when they
+	// don't fit the device memory budget, are accumulated one at a time with
+	// the current mode and camera, and a background writer streams them to
+	// disk, so device and host memory depend on the tile size only. Call
+	// after init() and before the render thread starts.
+	bool renderPoster(int width, int height, int spp, const std::string& path) {
+		int tile = posterTile;
+		auto tileFits = [&](int t) {
+			size_t padded = dispatchSize(t);
+			return pool.fits({ padded * padded * sizeof(cl_double3), (size_t)t * t * sizeof(cl_uint), sizeof(Camera) });
+		};
+		while (tile > minPosterTile && !tileFits(tile)) tile /= 2;
+		if (tile != posterTile) std::cout << "Device memory budget: poster tiles of " << tile << " pixels" << std::endl;
+
+		TileWriter writer;
+		if (!writer.open(path, width, height, tile, posterTilesInFlight)) {
+			std::cerr << "Couldn't open " << path << std::endl;
+			return false;
+		}
+
+		size_t padded = dispatchSize(tile);
+		PooledBuffer tileSum = pool.acquire(padded * padded * sizeof(cl_double3), CL_MEM_READ_WRITE, MemAccumulation,
+			nullptr, &err);
+		cl_int ret = err;
+		PooledBuffer tileOut = pool.acquire((size_t)tile * tile * sizeof(cl_uint), CL_MEM_WRITE_ONLY, MemOutput,
+			nullptr, &err);
+		ret |= err;
+		PooledBuffer tileCam = pool.acquire(sizeof(Camera), CL_MEM_READ_ONLY, MemScene, nullptr, &err);
+		ret |= err;
+		if (ret != CL_SUCCESS) {
+			std::cerr << "Couldn't create tile buffers: " << TranslateOpenCLError(ret) << std::endl;
+			return false;
+		}
+
+		// same vertical field of view, the aspect ratio of the poster
+		Camera posterCam = cam;
+		posterCam.winWidth = cam.winHeight * width / height;
+
+		cl_kernel kernel = kernels[kernalName];
+		cl_kernel toneMapKernel = kernels[toneMapName];
+		size_t* localSize = mainTune.localSize[0] ? mainTune.localSize : nullptr;
+		cl_ulong sampleTotal = spp;
+		err = bindTraceArgs(kernel, false, tile, tile);
+		err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), tileCam.ptr());
+		err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), tileSum.ptr());
+		err |= clSetKernelArg(toneMapKernel, 0, sizeof(cl_mem), tileOut.ptr());
+		err |= clSetKernelArg(toneMapKernel, 1, sizeof(cl_mem), tileSum.ptr());
+		err |= clSetKernelArg(toneMapKernel, 2, sizeof(cl_ulong), &sampleTotal);
+
+		int tilesAcross = (width + tile - 1) / tile;
+		int tilesDown = (height + tile - 1) / tile;
+		double start = glfwGetTime();
+		for (int ty = 0; err == CL_SUCCESS && ty < tilesDown; ty++) {
+			for (int tx = 0; err == CL_SUCCESS && tx < tilesAcross; tx++) {
+				cl_int w = std::min(tile, width - tx * tile);
+				cl_int h = std::min(tile, height - ty * tile);
+				posterCam.window = cl_double4{ (double)tx * tile / width, (double)ty * tile / height,
+					(double)w / width, (double)h / height };
+				cl_double3 zero = { 0, 0, 0 };
+				err = clEnqueueWriteBuffer(queue, tileCam, CL_TRUE, 0, sizeof(Camera), &posterCam, 0, nullptr, nullptr);
+				err |= clEnqueueFillBuffer(queue, tileSum, &zero, sizeof(zero), 0, padded * padded * sizeof(cl_double3),
+					0, nullptr, nullptr);
+				err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &w);
+				err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &h);
+
+				size_t traceSize[2] = { dispatchSize(w), dispatchSize(h) };
+				for (int j = 0; localSize && j < 2; j++)
+					traceSize[j] = (traceSize[j] + localSize[j] - 1) / localSize[j] * localSize[j];
+				for (int done = 0; err == CL_SUCCESS && done < spp; done += posterSamplesPerLaunch) {
+					cl_int sampleNum = std::min(posterSamplesPerLaunch, spp - done);
+					cl_uint seed = nextSeed();
+					err = clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+					err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+					if (err == CL_SUCCESS)
+						err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, traceSize, localSize, 0, nullptr, nullptr);
+				}
+
+				size_t toneMapSize[2] = { (size_t)w, (size_t)h };
+				if (err == CL_SUCCESS)
+					err = clEnqueueNDRangeKernel(queue, toneMapKernel, 2, nullptr, toneMapSize, nullptr, 0, nullptr, nullptr);
+				std::vector<unsigned char>& pixels = writer.acquire();
+				if (err == CL_SUCCESS)
+					err = clEnqueueReadBuffer(queue, tileOut, CL_TRUE, 0, (size_t)w * h * sizeof(cl_uint), pixels.data(),
+						0, nullptr, nullptr);
+				if (err != CL_SUCCESS) {
+					std::cerr << "Rendering tile " << tx << ", " << ty << " failed: " << TranslateOpenCLError(err) << std::endl;
+					break;
+				}
+				writer.submit(tx, ty, w, h, pixels);
+			}
+			std::cout << "Poster row " << ty + 1 << "/" << tilesDown << ", " << glfwGetTime() - start << " s" << std::endl;
+		}
+
+		bool ok = writer.close() && err == CL_SUCCESS;
+		double seconds = glfwGetTime() - start;
+		std::cout << path << (ok ? " written: " : " failed: ") << width << "x" << height << ", " << spp << " spp, "
+			<< seconds << " s, " << (double)width * height * spp / seconds * 1e-6 << " MS/s, "
+			<< writer.getWaitSeconds() << " s waiting for the writer" << std::endl;
+		pool.report(std::cout);
+
+		bindKernelArgs();
+		return ok;
+	}
+
+	// Batch render of an animation at window size with spp samples per frame,
+	// written to pathPattern (printf style, e.g. "frame%04d.ppm"). Scene
+	// buffers are double-buffered: frame N+1 is posed and uploaded on a queue
+	// of its own while frame N traces, and finished frames are read back
+	// without blocking and written by a background thread. Call after init()
+	// and before the render thread starts.
+	bool renderAnimation(const Animation& animation, int spp, const std::string& pathPattern) {
+		struct SceneSlot {
+			Camera cam;
+			std::vector<Sphere> sphere;
+			std::vector<LightEntry> entries;
+			std::vector<LightNode> nodes;
+			PooledBuffer camMem, sphereMem, lightMem, nodeMem;
+			cl_event uploaded = 0;
+		};
+		SceneSlot slots[2];
+		std::vector<LightEntry> entries = lights.paddedEntries();
+		std::vector<LightNode> nodes = lights.paddedNodes();
+		size_t paddedPixels = dispatchSize(winWidth) * dispatchSize(winHeight);
+
+		cl_command_queue uploadQueue = clCreateCommandQueue(context, device, 0, &err);
+		cl_int ret = err;
+		for (SceneSlot& slot : slots) {
+			slot.camMem = pool.acquire(sizeof(Camera), CL_MEM_READ_ONLY, MemScene, nullptr, &err);
+			ret |= err;
+			slot.sphereMem = pool.acquire(sphereSize * sizeof(Sphere), CL_MEM_READ_ONLY, MemScene, nullptr, &err);
+			ret |= err;
+			slot.lightMem = pool.acquire(entries.size() * sizeof(LightEntry), CL_MEM_READ_ONLY, MemScene, nullptr,
+				&err);
+			ret |= err;
+			slot.nodeMem = pool.acquire(nodes.size() * sizeof(LightNode), CL_MEM_READ_ONLY, MemAcceleration, nullptr,
+				&err);
+			ret |= err;
+		}
+		PooledBuffer frameSum = pool.acquire(paddedPixels * sizeof(cl_double3), CL_MEM_READ_WRITE, MemAccumulation,
+			nullptr, &err);
+		ret |= err;
+		PooledBuffer frameOut = pool.acquire((size_t)winWidth * winHeight * sizeof(cl_uint), CL_MEM_WRITE_ONLY,
+			MemOutput, nullptr, &err);
+		ret |= err;
+
+		// the buffers go back to the pool on return
+		auto release = [&]() {
+			for (SceneSlot& slot : slots)
+				if (slot.uploaded) clReleaseEvent(slot.uploaded);
+			if (uploadQueue) clReleaseCommandQueue(uploadQueue);
+			bindKernelArgs();
+		};
+		if (ret != CL_SUCCESS) {
+			std::cerr << "Couldn't create animation buffers: " << TranslateOpenCLError(ret) << std::endl;
+			release();
+			return false;
+		}
+
+		// Poses the frame on the host and uploads it into its slot once the
+		// frame that used the slot before, two back, is done with it.
+		auto upload = [&](int frame, cl_event slotFree) {
+			SceneSlot& slot = slots[frame % 2];
+			if (slot.uploaded) {
+				clWaitForEvents(1, &slot.uploaded);
+				clReleaseEvent(slot.uploaded);
+				slot.uploaded = 0;
+			}
+			slot.cam = cam;
+			slot.sphere = sphere;
+			animation.apply(frame, slot.cam, slot.sphere.data(), sphereSize);
+			LightList frameLights;
+			frameLights.build(slot.sphere.data(), sphereSize);
+			slot.entries = frameLights.paddedEntries();
+			slot.nodes = frameLights.paddedNodes();
+
+			cl_uint waitNum = slotFree ? 1 : 0;
+			const cl_event* waitList = slotFree ? &slotFree : nullptr;
+			cl_event writes[4];
+			cl_int r = clEnqueueWriteBuffer(uploadQueue, slot.camMem, CL_FALSE, 0, sizeof(Camera), &slot.cam,
+				waitNum, waitList, &writes[0]);
+			r |= clEnqueueWriteBuffer(uploadQueue, slot.sphereMem, CL_FALSE, 0, sphereSize * sizeof(Sphere),
+				slot.sphere.data(), waitNum, waitList, &writes[1]);
+			r |= clEnqueueWriteBuffer(uploadQueue, slot.lightMem, CL_FALSE, 0, slot.entries.size() * sizeof(LightEntry),
+				slot.entries.data(), waitNum, waitList, &writes[2]);
+			r |= clEnqueueWriteBuffer(uploadQueue, slot.nodeMem, CL_FALSE, 0, slot.nodes.size() * sizeof(LightNode),
+				slot.nodes.data(), waitNum, waitList, &writes[3]);
+			if (r != CL_SUCCESS) return r;
+			r = clEnqueueMarkerWithWaitList(uploadQueue, 4, writes, &slot.uploaded);
+			for (cl_event& e : writes) clReleaseEvent(e);
+			clFlush(uploadQueue);
+			return r;
+		};
+
+		cl_kernel kernel = kernels[kernalName];
+		cl_kernel toneMapKernel = kernels[toneMapName];
+		size_t* localSize = mainTune.localSize[0] ? mainTune.localSize : nullptr;
+		size_t traceSize[2] = { dispatchSize(winWidth), dispatchSize(winHeight) };
+		for (int j = 0; localSize && j < 2; j++)
+			traceSize[j] = (traceSize[j] + localSize[j] - 1) / localSize[j] * localSize[j];
+		size_t frameSize[2] = { (size_t)winWidth, (size_t)winHeight };
+		cl_ulong sampleTotal = spp;
+		err = bindTraceArgs(kernel, false, winWidth, winHeight);
+		err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), frameSum.ptr());
+		err |= clSetKernelArg(toneMapKernel, 0, sizeof(cl_mem), frameOut.ptr());
+		err |= clSetKernelArg(toneMapKernel, 1, sizeof(cl_mem), frameSum.ptr());
+		err |= clSetKernelArg(toneMapKernel, 2, sizeof(cl_ulong), &sampleTotal);
+
+		FrameWriter writer;
+		writer.open(winWidth, winHeight, animationFramesInFlight);
+		// device commands of the frame whose read back is in flight
+		std::vector<cl_event> inFlight, current;
+		std::vector<unsigned char>* inFlightPixels = nullptr;
+		int inFlightFrame = -1;
+		cl_event prevDone = 0;
+		double busyMs = 0;
+		cl_ulong firstStart = 0, lastEnd = 0;
+		bool writerOk = true;
+
+		// Waits for a frame's read back, hands it to the writer and adds its
+		// commands to the device busy time.
+		auto finish = [&]() {
+			if (inFlightFrame < 0) return;
+			clWaitForEvents(1, &inFlight.back());
+			for (cl_event& e : inFlight) {
+				cl_ulong startTime, endTime;
+				clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, nullptr);
+				clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, nullptr);
+				busyMs += (endTime - startTime) * 1e-6;
+				if (!firstStart || startTime < firstStart) firstStart = startTime;
+				lastEnd = std::max(lastEnd, endTime);
+				clReleaseEvent(e);
+			}
+			inFlight.clear();
+			char path[512];
+			snprintf(path, sizeof(path), pathPattern.c_str(), inFlightFrame);
+			writer.submit(path, *inFlightPixels);
+			inFlightFrame = -1;
+		};
+
+		double start = glfwGetTime();
+		if (err == CL_SUCCESS) err = upload(0, 0);
+		for (int f = 0; err == CL_SUCCESS && f < animation.frameCount; f++) {
+			SceneSlot& slot = slots[f % 2];
+			err = clSetKernelArg(kernel, 0, sizeof(cl_mem), slot.sphereMem.ptr());
+			err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), slot.camMem.ptr());
+			err |= clSetKernelArg(kernel, 9, sizeof(cl_mem), slot.lightMem.ptr());
+			err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), slot.nodeMem.ptr());
+
+			cl_double3 zero = { 0, 0, 0 };
+			cl_event e;
+			if (err == CL_SUCCESS)
+				err = clEnqueueFillBuffer(queue, frameSum, &zero, sizeof(zero), 0, paddedPixels * sizeof(cl_double3),
+					0, nullptr, &e);
+			if (err == CL_SUCCESS) current.push_back(e);
+			for (int done = 0; err == CL_SUCCESS && done < spp; done += posterSamplesPerLaunch) {
+				cl_int sampleNum = std::min(posterSamplesPerLaunch, spp - done);
+				cl_uint seed = nextSeed();
+				err = clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+				err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+				// the first launch waits for the frame's upload on the other queue
+				if (err == CL_SUCCESS)
+					err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, traceSize, localSize,
+						done == 0 ? 1 : 0, done == 0 ? &slot.uploaded : nullptr, &e);
+				if (err == CL_SUCCESS) current.push_back(e);
+			}
+			if (err == CL_SUCCESS)
+				err = clEnqueueNDRangeKernel(queue, toneMapKernel, 2, nullptr, frameSize, nullptr, 0, nullptr, &e);
+			if (err != CL_SUCCESS) break;
+			current.push_back(e);
+			cl_event done = e;
+			clRetainEvent(done);
+			clFlush(queue);
+
+			// the next frame's scene goes up while this one traces
+			if (f + 1 < animation.frameCount) err = upload(f + 1, prevDone);
+			if (prevDone) clReleaseEvent(prevDone);
+			prevDone = done;
+
+			finish();
+			std::vector<unsigned char>& pixels = writer.acquire();
+			if (err == CL_SUCCESS)
+				err = clEnqueueReadBuffer(queue, frameOut, CL_FALSE, 0, pixels.size(), pixels.data(), 0, nullptr, &e);
+			if (err != CL_SUCCESS) break;
+			current.push_back(e);
+			clFlush(queue);
+			inFlight.swap(current);
+			inFlightPixels = &pixels;
+			inFlightFrame = f;
+		}
+		if (err != CL_SUCCESS)
+			std::cerr << "Animation failed: " << TranslateOpenCLError(err) << std::endl;
+		clFinish(queue);
+		finish();
+		for (cl_event& e : current) clReleaseEvent(e);
+		if (prevDone) clReleaseEvent(prevDone);
+		writerOk = writer.close();
+
+		double seconds = glfwGetTime() - start;
+		double spanMs = lastEnd > firstStart ? (lastEnd - firstStart) * 1e-6 : 0;
+		double idleMs = std::max(0.0, spanMs - busyMs);
+		std::cout << animation.frameCount << " frames in " << seconds << " s, " << animation.frameCount / seconds * 3600
+			<< " frames/h, device idle " << idleMs << " ms (" << (spanMs > 0 ? idleMs / spanMs * 100 : 0) << "%), "
+			<< writer.getWaitSeconds() << " s waiting for the writer" << std::endl;
+		pool.report(std::cout);
+
+		release();
+		return err == CL_SUCCESS && writerOk;
+	}
+
+	// Error against wall-clock time: every convergenceConfigs entry renders
+	// each bundled scene at window size, one sample per pixel per launch, and
+	// is compared with the scene's reference at budgets doubling up to
+	// seconds, over the whole image and over the caustic mask. Time spent
+	// measuring doesn't count. Writes <prefix>.csv,
+	// <prefix>.json and a gnuplot script, see ConvergenceReport. Call after
+	// init() and before the render thread starts.
+	bool benchmarkConvergence(double seconds, const std::string& prefix) {
+		size_t slots = dispatchSize(winWidth) * dispatchSize(winHeight);
+		PooledBuffer accum = pool.acquire(slots * sizeof(cl_double3), CL_MEM_READ_WRITE, MemAccumulation, nullptr,
+			&err);
+		cl_int ret = err;
+		PooledBuffer rowMajor = pool.acquire((size_t)winWidth * winHeight * sizeof(cl_double3), CL_MEM_READ_WRITE,
+			MemScratch, nullptr, &err);
+		ret |= err;
+		if (ret != CL_SUCCESS) {
+			std::cerr << "Couldn't create convergence buffers: " << TranslateOpenCLError(ret) << std::endl;
+			return false;
+		}
+
+		std::vector<double> budgets;
+		for (int i = convergenceSteps - 1; i >= 0; i--) budgets.push_back(seconds / (1 << i));
+		int wasMode = mode;
+		bool wasPersistent = persistent, wasSpecialize = specialize, wasGuiding = guiding;
+		ConvergenceReport report;
+		bool ok = true;
+
+		const char* sceneNames[] = { "scene1", "scene2", "scene3" };
+		for (int s = 0; ok && s < sceneCount; s++) {
+			std::vector<cl_double3> ref;
+			Convergence::Mask caustics;
+			ok = loadScene(s) && sceneReference(sceneNames[s], accum, rowMajor, ref)
+				&& causticMask(sceneNames[s], accum, rowMajor, ref, caustics);
+			// each config at the full budget
+			std::vector<ConvergencePoint> finals;
+			for (const ConvergenceConfig& c : convergenceConfigs) {
+				if (!ok) break;
+				mode = c.mode;
+				specialize = c.specialize;
+				guiding = c.guided;
+				if (!createProgramFromFiles(programFiles(mode), buildOptions())) {
+					ok = false;
+					break;
+				}
+				bool usePersistent = c.persistent && hasPersistent();
+				cl_kernel kernel = kernels[usePersistent ? persistentName : kernalName];
+				cl_double3 zero = { 0, 0, 0 };
+				err = bindTraceArgs(kernel, usePersistent, winWidth, winHeight);
+				err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), accum.ptr());
+				// one untimed launch, so first-launch costs don't count
+				if (err == CL_SUCCESS) err = traceWindow(kernel, usePersistent, 1);
+				err |= clEnqueueFillBuffer(queue, accum, &zero, sizeof(zero), 0, slots * sizeof(cl_double3),
+					0, nullptr, nullptr);
+				cl_ulong none = 0;
+				if (measurePathStats)
+					clEnqueueFillBuffer(queue, pathStatsBuffer, &none, sizeof(none), 0, PathStats::size * sizeof(cl_ulong),
+						0, nullptr, nullptr);
+				resetGuide();
+				clFinish(queue);
+
+				cl_ulong spp = 0;
+				double elapsed = 0, start = glfwGetTime();
+				for (size_t next = 0; err == CL_SUCCESS && next < budgets.size();) {
+					err = traceWindow(kernel, usePersistent, 1);
+					if (err == CL_SUCCESS) err = advanceGuide(1);
+					clFinish(queue);
+					spp++;
+					double now = glfwGetTime();
+					if (elapsed + now - start < budgets[next]) continue;
+					elapsed += now - start;
+
+					std::vector<cl_double3> img = readRadiance(accum, rowMajor, spp);
+					ConvergencePoint p = { sceneNames[s], c.name, elapsed, spp, Convergence::rmse(img, ref),
+						Convergence::relMse(img, ref), Convergence::flip(img, ref, winWidth, winHeight),
+						Convergence::rmse(img, ref, caustics), Convergence::relMse(img, ref, caustics),
+						Convergence::flip(img, ref, winWidth, winHeight, caustics), "" };
+					if (measurePathStats && c.mode == 0) {
+						PathStats stats;
+						clEnqueueReadBuffer(queue, pathStatsBuffer, CL_TRUE, 0, sizeof(stats.values), stats.values,
+							0, nullptr, nullptr);
+						p.pathStats = stats.json();
+					}
+					report.add(p);
+					std::cout << p.scene << ", " << p.config << ": " << p.seconds << " s, " << p.spp << " spp, RMSE "
+						<< p.rmse << ", relMSE " << p.relMse << ", FLIP-style " << p.flip << ", caustic RMSE "
+						<< p.causticRmse << std::endl;
+					if (++next == budgets.size()) finals.push_back(p);
+					start = glfwGetTime();
+				}
+				if (err != CL_SUCCESS) {
+					std::cerr << c.name << " failed: " << TranslateOpenCLError(err) << std::endl;
+					ok = false;
+				}
+			}
+
+			// efficiency is inverse relMSE times seconds, so variance reduction
+			// per unit time against the first config
+			for (size_t i = 1; i < finals.size(); i++) {
+				double cost = finals[i].relMse * finals[i].seconds;
+				if (cost > 0)
+					std::cout << sceneNames[s] << ", " << finals[i].config << ": "
+						<< finals[0].relMse * finals[0].seconds / cost << "x the efficiency of " << finals[0].config << std::endl;
+			}
+		}
+
+		if (!report.write(prefix)) {
+			std::cerr << "Couldn't write " << prefix << ".csv/.json/.gp" << std::endl;
+			ok = false;
+		} else {
+			std::cout << "Wrote " << prefix << ".csv, " << prefix << ".json and " << prefix << ".gp (plot with gnuplot "
+				<< prefix << ".gp)" << std::endl;
+		}
+
+		accum.reset();
+		rowMajor.reset();
+		pool.report(std::cout);
+		mode = wasMode;
+		persistent = wasPersistent;
+		specialize = wasSpecialize;
+		guiding = wasGuiding;
+		loadScene(0);
+		createProgramFromFiles(programFiles(mode), buildOptions());
+		bindKernelArgs();
+		resetAccumulation();
+		return ok;
+	}
+
+	// Moves the camera along its own axes and restarts accumulation.
+	void moveCamera(double forward, double right, double up) {
+		post([this, forward, right, up]() {
+			cl_double3 side = cross(cam.lookAt, cam.up);
+			cam.pos += cam.lookAt * forward;
+			cam.pos += side * right;
+			cam.pos += cam.up * up;
+			updateCamera();
+		});
+	}
+
+	// Turns the camera around its up axis (which is orthogonal to lookAt).
+	void rotateCamera(double yaw) {
+		post([this, yaw]() {
+			cam.lookAt = cam.lookAt * cos(yaw) + cross(cam.up, cam.lookAt) * sin(yaw);
+			updateCamera();
+		});
+	}
+
+	void updateCamera() {
+		err = clEnqueueWriteBuffer(queue, camBuffer, CL_TRUE, 0, sizeof(Camera), &cam, 0, nullptr, nullptr);
+		if (err != CL_SUCCESS) {
+			std::cerr << "Couldn't update camBuffer: " << TranslateOpenCLError(err) << std::endl;
+			return;
+		}
+		resetAccumulation();
+		stillFrames = 0;
+	}
+
 	void init() {
 		srand(time(0));
-		frameCount = 0;
-		lstTime = clock();
+		seedBase = rand();
+		launchIndex = 0;
+		sampleCount = 0;
+		tracedSamples = lstTracedSamples = 0;
+		lstTime = glfwGetTime();
+		stillFrames = 0;
+		kernelMs = 0;
+		utilization = 0;
+		resolution.init(winWidth, winHeight);
+		renderWidth = winWidth;
+		renderHeight = winHeight;
+
+		// the scene comes first, device selection renders it
+		buildScene(scene);
 
+		calibrate = [this](CLManager& probe) { return calibrateDevice(probe); };
+		calibrationKey = sourceHash(programFiles(mode)) + "|" + baseBuildOptions();
 		CLManager::init();
 
-		std::vector<std::string> programFiles;
-		programFiles.push_back("PathTrace.cl");
-		createProgramFromFiles(programFiles);
+		createProgramFromFiles(programFiles(mode), baseBuildOptions());
 
 		initGLBuffers();
 
@@ -157,76 +1983,233 @@ public:
 
 		initShaders();
 
-		initScene1(cam, sphere, sphereSize, winWidth, winHeight);
-
 		configSharedData();
+
+		initMappedDisplay();
+
+		initPersistent();
+
+		initDisplay();
+
+		initAutotune();
+
+		rebuildProgram();
+
+		if (benchSpecialize) benchmarkSpecialization();
+
+		if (benchShapes) benchmarkShapes();
+
+		if (resumeCheckpoint && !checkpointPath.empty()) resume();
+		pool.report(std::cout);
+		renderStart = lstCheckpoint = glfwGetTime();
 	}
 
+	// One render iteration: applies queued controls, traces a frame budget
+	// worth of samples and publishes the result. Never touches GL.
 	void runKernel() {
-		cl_kernel kernel = kernels[kernalName];
+		runPending();
+		if (stillFrames < stillFrameThreshold) stillFrames++;
+		bool moving = stillFrames < stillFrameThreshold;
+		if (kernelMs > 0 && resolution.update(kernelMs, moving))
+			resizeRender(resolution.getWidth(), resolution.getHeight());
 
-		// par
-		cl_uint seed = rand();
-		frameCount++;
-		err = clSetKernelArg(kernel, 4, sizeof(cl_uint), &seed);
-		err &= clSetKernelArg(kernel, 5, sizeof(cl_ulong), &frameCount);
-		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
-			return;
+		long long pixels = (long long)renderWidth * renderHeight;
+		if (moving) scheduler.single();
+		else scheduler.plan(pixels);
+		cl_int sampleNum = scheduler.getSamplesPerLaunch();
+		int launchNum = scheduler.getLaunchesPerFrame();
+
+		bool usePersistent = persistent && hasPersistent();
+		cl_kernel kernel = kernels[usePersistent ? persistentName : kernalName];
+		size_t traceSize[]{ dispatchSize(renderWidth), dispatchSize(renderHeight) };
+		size_t* localSize = mainTune.localSize[0] ? mainTune.localSize : nullptr;
+		// ReSTIR reuses reservoirs from one sample to the next, so it takes one
+		// sample per launch, each followed by its shading pass
+		bool restir = kernels.count(restirName) > 0;
+		if (restir) {
+			launchNum *= sampleNum;
+			sampleNum = 1;
 		}
+		std::vector<cl_event> kernelEvents(restir ? 2 * launchNum : launchNum);
 
-		size_t globalSize[]{ winWidth, winHeight };
-		cl_event kernelEvent;
+		cl_ulong zero = 0;
+		if (measureUtilization)
+			clEnqueueFillBuffer(queue, utilizationBuffer, &zero, sizeof(zero), 0, 2 * sizeof(cl_ulong), 0, nullptr, nullptr);
+		if (measurePathStats)
+			clEnqueueFillBuffer(queue, pathStatsBuffer, &zero, sizeof(zero), 0, PathStats::size * sizeof(cl_ulong),
+				0, nullptr, nullptr);
 
-		glFinish();
-		err = clEnqueueAcquireGLObjects(queue, 1, &outBuffer, 0, NULL, NULL);
-		if (err != CL_SUCCESS) {
-			std::cerr << "Couldn't acquire the GL object" << std::endl;
-			return;
+		err = clSetKernelArg(kernel, 4, sizeof(cl_int), &sampleNum);
+		err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &renderWidth);
+		err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &renderHeight);
+		{
+			Tracer::Span span(tracer, "enqueue trace");
+			for (int i = 0; i < launchNum; i++) {
+				// par
+				cl_uint seed = nextSeed();
+				err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &seed);
+				if (err != CL_SUCCESS) {
+					std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
+					return;
+				}
+
+				if (usePersistent) {
+					cl_int start = 0;
+					clEnqueueFillBuffer(queue, workCounterBuffer, &start, sizeof(start), 0, sizeof(start), 0, nullptr, nullptr);
+					err = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &persistentGlobalSize,
+						&persistentLocalSize, 0, nullptr, &kernelEvents[i]);
+				} else {
+					size_t paddedSize[2] = { traceSize[0], traceSize[1] };
+					for (int j = 0; localSize && j < 2; j++)
+						paddedSize[j] = (traceSize[j] + localSize[j] - 1) / localSize[j] * localSize[j];
+					err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, paddedSize,
+						localSize, 0, nullptr, &kernelEvents[i]);
+					if (err == CL_SUCCESS && restir)
+						err = enqueueRestirShade(seed, paddedSize, localSize, &kernelEvents[launchNum + i]);
+				}
+				if (err != CL_SUCCESS) {
+					std::cerr << "Run kernel failed: " << TranslateOpenCLError(err) << std::endl;
+					return;
+				}
+				sampleCount += sampleNum;
+				tracedSamples += sampleNum * pixels;
+				advanceGuide(sampleNum);
+			}
 		}
 
-		err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalSize,
-			nullptr, 0, nullptr, &kernelEvent);
-		if (err != CL_SUCCESS) {
-			std::cerr << "Run kernel failed: " << TranslateOpenCLError(err) << std::endl;
-			return;
+		if (measureUtilization) {
+			Tracer::Span span(tracer, "read utilization");
+			cl_ulong counts[2];
+			clEnqueueReadBuffer(queue, utilizationBuffer, CL_TRUE, 0, sizeof(counts), counts, 0, nullptr, nullptr);
+			utilization = counts[1] ? (double)counts[0] / counts[1] : 0;
+		}
+		if (measurePathStats) {
+			Tracer::Span span(tracer, "read path stats");
+			clEnqueueReadBuffer(queue, pathStatsBuffer, CL_TRUE, 0, sizeof(pathStats.values), pathStats.values,
+				0, nullptr, nullptr);
 		}
 
-		err = clWaitForEvents(1, &kernelEvent);
-		if (err < 0) {
-			std::cerr << "Couldn't wait for events" << std::endl;
-			return;
+		{
+			Tracer::Span span(tracer, "publish frame");
+			publishFrame(sampleNum, launchNum);
 		}
 
-		clEnqueueReleaseGLObjects(queue, 1, &outBuffer, 0, NULL, NULL);
-		clFinish(queue);
-		clReleaseEvent(kernelEvent);
+		if (!checkpointPath.empty() && !moving && renderWidth == winWidth && renderHeight == winHeight
+			&& glfwGetTime() - lstCheckpoint >= checkpointInterval) {
+			Tracer::Span span(tracer, "checkpoint");
+			checkpoint();
+		}
 
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, winWidth, winHeight,
-			0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-		glActiveTexture(GL_TEXTURE0);
+		kernelMs = 0;
+		for (cl_event& kernelEvent : kernelEvents) {
+			cl_ulong startTime, endTime;
+			clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, nullptr);
+			clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, nullptr);
+			kernelMs += (endTime - startTime) * 1e-6;
+			tracer.deviceSpan("trace kernel", Tracer::TraceQueue, kernelEvent);
+			clReleaseEvent(kernelEvent);
+		}
+		scheduler.record(kernelMs, sampleNum * launchNum, pixels);
 	}
 
+	// Display side: tone maps the newest published frame, if there is one,
+	// and presents. Only waits on its own queue and GL, never on tracing.
 	void render(GLFWwindow* window) {
-		glClear(GL_COLOR_BUFFER_BIT);
-		glBindVertexArray(vao);
-		glBindTexture(GL_TEXTURE_2D, texture);
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-		glBindVertexArray(0);
-		glfwSwapBuffers(window);
+		if (frames.acquire()) {
+			RenderFrame& newest = frames.getFront();
+			err = clSetKernelArg(displayToneMap, 1, sizeof(cl_mem), &newest.accum);
+			err |= clSetKernelArg(displayToneMap, 2, sizeof(cl_ulong), &newest.sampleCount);
+			err |= clSetKernelArg(displayToneMapImage, 1, sizeof(cl_mem), &newest.accum);
+			err |= clSetKernelArg(displayToneMapImage, 2, sizeof(cl_ulong), &newest.sampleCount);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't bind kernel arg: " << TranslateOpenCLError(err) << std::endl;
+				return;
+			}
 
-		clock_t nowTime = clock();
-		sprintf(titleBuffer, "Ray Tracing Demo (%.3f FPS)", (double)CLOCKS_PER_SEC / (nowTime - lstTime));
-		glfwSetWindowTitle(window, titleBuffer);
+			{
+				Tracer::Span span(tracer, "glFinish");
+				glFinish();
+			}
+			double displayStart = glfwGetTime();
+			{
+				Tracer::Span span(tracer, "display frame");
+				if (displayPath == DisplayMapped) displayMapped(newest);
+				else displayShared(newest);
+			}
+			double ms = (glfwGetTime() - displayStart) * 1e3;
+			displayMs = displayMs == 0 ? ms : displayMs * 0.9 + ms * 0.1;
+			glActiveTexture(GL_TEXTURE0);
+			glUniform2f(renderSizeLocation, newest.width, newest.height);
+		}
+		RenderFrame& shown = frames.getFront();
+
+		{
+			Tracer::Span span(tracer, "draw");
+			glClear(GL_COLOR_BUFFER_BIT);
+			glBindVertexArray(vao);
+			glBindTexture(GL_TEXTURE_2D, displayPath == DisplayZeroCopy ? displayTexture : texture);
+			glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+			glBindVertexArray(0);
+		}
+		{
+			Tracer::Span span(tracer, "swap");
+			glfwSwapBuffers(window);
+		}
+		presentedFrames++;
+
+		double nowTime = glfwGetTime();
+		if (nowTime - lstTime < 0.25) return;
+		double seconds = nowTime - lstTime;
+		double mSamples = (shown.tracedSamples - lstTracedSamples) / seconds * 1e-6;
+		// display throughput of the current path
+		double displayMPix = displayMs > 0 ? shown.width * shown.height / displayMs * 1e-3 : 0;
+		const char* orders[] = { "", ", Morton", ", tiled" };
+		snprintf(titleBuffer, sizeof(titleBuffer),
+			"Ray Tracing Demo (%s, %.1f FPS, %dx%d, %d spp x %d, %.1f MS/s%s%s, %s %.2f ms %.0f MPix/s",
+			modeNames[shown.mode].c_str(), (presentedFrames - lstPresentedFrames) / seconds, shown.width, shown.height,
+			shown.samplesPerLaunch, shown.launchesPerFrame, mSamples, shown.persistent ? ", persistent" : "",
+			orders[shown.pixelOrder], displayNames[displayPath].c_str(), displayMs, displayMPix);
+		std::string title = titleBuffer;
+		if (shown.specialize) title += ", specialized";
+		if (measureUtilization) {
+			snprintf(titleBuffer, sizeof(titleBuffer), ", SIMD %.1f%%", shown.utilization * 100);
+			title += titleBuffer;
+		}
+		if (measurePathStats && shown.mode == 0) title += ", " + shown.pathStats.summary();
+		title += ")";
+		glfwSetWindowTitle(window, title.c_str());
 		lstTime = nowTime;
+		lstTracedSamples = shown.tracedSamples;
+		lstPresentedFrames = presentedFrames;
 	}
 
-	~GraphicManager() {
-		clReleaseMemObject(outBuffer);
-		clReleaseMemObject(sphereBuffer);
-		clReleaseMemObject(camBuffer);
-		clReleaseMemObject(sumBuffer);
+	// Releases the display's GL objects and the CL objects shared with or
+	// mapping them. Needs the GL context, so call it before glfwTerminate().
+	void shutdown() {
+		if (displayQueue) clFinish(displayQueue);
+		if (outBuffer) clReleaseMemObject(outBuffer);
+		if (outImage) clReleaseMemObject(outImage);
+		outBuffer = outImage = 0;
+		for (int i = 0; i < 2; i++) {
+			if (mappedBuffer[i]) clReleaseMemObject(mappedBuffer[i]);
+			mappedBuffer[i] = 0;
+			if (mappedFence[i]) glDeleteSync(mappedFence[i]);
+			mappedFence[i] = 0;
+			if (!mappedPbo[i]) continue;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mappedPbo[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(2, mappedPbo);
 		glDeleteBuffers(2, vbo);
+		glDeleteTextures(1, &displayTexture);
+		mappedPbo[0] = mappedPbo[1] = vbo[0] = vbo[1] = displayTexture = 0;
+	}
+
+	~GraphicManager() {
+		for (int i = 0; i < 3; i++) clReleaseMemObject(frames.slot(i).accum);
+		clReleaseKernel(displayToneMap);
+		clReleaseKernel(displayToneMapImage);
+		clReleaseCommandQueue(displayQueue);
 	}
 };
\ No newline at end of file
@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Scene.h"
+
+// Emitters of the loaded scene, built once on the host so the kernels never
+// scan the sphere array for lights. Small sets are drawn from an alias table
+// weighted by power alone, the same for every shading point; only past
+// treeThreshold lights does a light tree weigh in the solid angle, picking
+// them by power over squared distance in O(log n) per shading point.
+class LightList {
+private:
+	// lights beyond this count are picked with the tree instead of the alias table
+	const size_t treeThreshold = 64;
+
+	static double power(const Sphere& s) {
+		double luminance = 0.2126 * s.mat.color.x + 0.7152 * s.mat.color.y + 0.0722 * s.mat.color.z;
+		return luminance * s.radius * s.radius;
+	}
+
+	void buildAlias(const std::vector<double>& weights) {
+		size_t n = weights.size();
+		double total = 0;
+		for (double w : weights) total += w;
+
+		std::vector<double> scaled(n);
+		std::vector<size_t> small, large;
+		for (size_t i = 0; i < n; i++) {
+			entries[i].pdf = total > 0 ? weights[i] / total : 1.0 / n;
+			entries[i].alias = i;
+			scaled[i] = entries[i].pdf * n;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			size_t s = small.back(), l = large.back();
+			small.pop_back();
+			entries[s].prob = scaled[s];
+			entries[s].alias = l;
+			scaled[l] -= 1 - scaled[s];
+			if (scaled[l] < 1) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		for (size_t i : small) entries[i].prob = 1;
+		for (size_t i : large) entries[i].prob = 1;
+	}
+
+	// Median split along the widest axis of the light centers.
+	int buildTree(const Sphere sphere[], std::vector<int>& ids, size_t begin, size_t end) {
+		int index = nodes.size();
+		nodes.push_back(LightNode());
+
+		cl_double3 lo = sphere[entries[ids[begin]].sphere].pos, hi = lo;
+		double maxRadius = 0, total = 0;
+		for (size_t i = begin; i < end; i++) {
+			const Sphere& s = sphere[entries[ids[i]].sphere];
+			lo = { std::min(lo.x, s.pos.x), std::min(lo.y, s.pos.y), std::min(lo.z, s.pos.z) };
+			hi = { std::max(hi.x, s.pos.x), std::max(hi.y, s.pos.y), std::max(hi.z, s.pos.z) };
+			maxRadius = std::max(maxRadius, (double)s.radius);
+			total += power(s);
+		}
+		cl_double3 extent = { hi.x - lo.x, hi.y - lo.y, hi.z - lo.z };
+		nodes[index].center = { (lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2 };
+		nodes[index].radius = sqrt(extent.x * extent.x + extent.y * extent.y + extent.z * extent.z) / 2 + maxRadius;
+		nodes[index].power = total;
+
+		if (end - begin == 1) {
+			nodes[index].left = ids[begin];
+			nodes[index].right = -1;
+			return index;
+		}
+
+		int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		auto coord = [&](int id) {
+			const cl_double3& p = sphere[entries[id].sphere].pos;
+			return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+		};
+		size_t mid = (begin + end) / 2;
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end,
+			[&](int a, int b) { return coord(a) < coord(b); });
+
+		int left = buildTree(sphere, ids, begin, mid);
+		int right = buildTree(sphere, ids, mid, end);
+		nodes[index].left = left;
+		nodes[index].right = right;
+		return index;
+	}
+
+public:
+	// in sphere order, which BDPT.cl's lightPdf searches by
+	std::vector<LightEntry> entries;
+	std::vector<LightNode> nodes;
+
+	void build(const Sphere sphere[], int sphereSize) {
+		entries.clear();
+		nodes.clear();
+
+		std::vector<double> weights;
+		for (int i = 0; i < sphereSize; i++) {
+			if (sphere[i].mat.type != 0) continue;
+			LightEntry entry;
+			entry.sphere = i;
+			entries.push_back(entry);
+			weights.push_back(power(sphere[i]));
+		}
+		if (entries.empty()) return;
+
+		buildAlias(weights);
+		if (entries.size() > treeThreshold) {
+			std::vector<int> ids(entries.size());
+			for (size_t i = 0; i < ids.size(); i++) ids[i] = i;
+			buildTree(sphere, ids, 0, ids.size());
+		}
+	}
+
+	cl_int count() const { return entries.size(); }
+
+	// Copies for device buffers, which can't be empty: a scene without
+	// lights still gets one slot.
+	std::vector<LightEntry> paddedEntries() const {
+		std::vector<LightEntry> ret = entries;
+		ret.resize(std::max<size_t>(1, ret.size()));
+		return ret;
+	}
+
+	std::vector<LightNode> paddedNodes() const {
+		std::vector<LightNode> ret = nodes;
+		ret.resize(std::max<size_t>(1, ret.size()));
+		return ret;
+	}
+
+	// 0 tells the kernels to use the alias table.
+	cl_int nodeCount() const { return nodes.size(); }
+};
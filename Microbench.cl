@@ -0,0 +1,83 @@
+// Isolation kernels for the device-function microbenchmarks (Microbench.h),
+// built after Common.cl and PathTrace.cl. Each work item calls the function
+// BENCH_ITERATIONS times and chains or sums the results, so no call can be
+// hoisted or dropped, and writes what the host checks to out.
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS 64
+#endif
+
+// What a and b hold depends on the kernel; spheres are shared targets.
+#define BENCH_ARGS __global const double4* a, __global const double4* b, __global const Sphere* spheres, \
+	const int sphereCount, __global double4* out
+
+Seed64 benchSeed(ulong i) {
+	Seed64 seed;
+	seed.k1 = i * 0x9E3779B97F4A7C15UL + 1;
+	seed.k2 = (i + 1) * 0xD1B54A32D192ED03UL;
+	return seed;
+}
+
+// a: ray origin, b: ray direction; the spheres are taken in turn
+__kernel void benchSphereHit(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	Ray ray;
+	ray.pos = a[i].xyz;
+	ray.dir = b[i].xyz;
+	double sum = 0;
+	for (int k = 0; k < BENCH_ITERATIONS; k++) {
+		Sphere o = spheres[(i + k) % sphereCount];
+		sum += getFirstCollideWithSphere(&ray, &o);
+	}
+	out[i] = (double4)(sum, 0, 0, 0);
+}
+
+// as benchSphereHit, against the boxes bounding the spheres
+__kernel void benchBoxHit(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	Ray ray;
+	ray.pos = a[i].xyz;
+	ray.dir = b[i].xyz;
+	double sum = 0;
+	for (int k = 0; k < BENCH_ITERATIONS; k++) {
+		Sphere o = spheres[(i + k) % sphereCount];
+		sum += getFirstCollideWithBox(&ray, o.pos - o.radius, o.pos + o.radius);
+	}
+	out[i] = (double4)(sum, 0, 0, 0);
+}
+
+// out.x: the draws XORed together, shifted to be exact as a double
+__kernel void benchRand64(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	Seed64 seed = benchSeed(i);
+	ulong acc = 0;
+	for (int k = 0; k < BENCH_ITERATIONS; k++) acc ^= rand64(&seed);
+	out[i] = (double4)((double)(acc >> 11), 0, 0, 0);
+}
+
+__kernel void benchRand3(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	Seed64 seed = benchSeed(i);
+	double3 sum = (double3)(0, 0, 0);
+	for (int k = 0; k < BENCH_ITERATIONS; k++) sum += rand3(&seed);
+	out[i] = (double4)(sum, 0);
+}
+
+// a: unit direction into the surface, b: its unit normal. Each iteration
+// refracts in and back out, two calls.
+__kernel void benchRefract(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	double3 d = a[i].xyz, nd = b[i].xyz;
+	for (int k = 0; k < BENCH_ITERATIONS; k++) {
+		d = refract(d, nd, 1 / 1.5);
+		d = refract(d, nd, 1.5);
+	}
+	out[i] = (double4)(d, 0);
+}
+
+// a: start vector, b: offset added before each call
+__kernel void benchNormalize(BENCH_ARGS) {
+	size_t i = get_global_id(0);
+	double3 v = a[i].xyz, offset = b[i].xyz;
+	for (int k = 0; k < BENCH_ITERATIONS; k++) v = normalize(v + offset);
+	out[i] = (double4)(v, 0);
+}
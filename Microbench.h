@@ -0,0 +1,299 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CLManager.h"
+#include "Scene.h"
+
+// Times device functions on their own: isolation kernels (Microbench.cl)
+// call them over large synthetic inputs, and a sample of the results is
+// checked against host reference implementations. ns/op is device time over
+// every call made, so it is amortized over all the work items in flight.
+class Microbench {
+private:
+	struct Vec {
+		double x, y, z;
+		Vec operator + (const Vec& o) const { return { x + o.x, y + o.y, z + o.z }; }
+		Vec operator - (const Vec& o) const { return { x - o.x, y - o.y, z - o.z }; }
+		Vec operator * (double s) const { return { x * s, y * s, z * s }; }
+		double dot(const Vec& o) const { return x * o.x + y * o.y + z * o.z; }
+		Vec normalized() const { return *this * (1 / sqrt(dot(*this))); }
+	};
+
+	struct Case {
+		std::string function, kernel;
+		int opsPerIteration;
+		// inputs a and b of work item i, see Microbench.cl
+		std::function<void(size_t i, Vec& a, Vec& b)> input;
+		std::function<cl_double4(size_t i, const Vec& a, const Vec& b)> reference;
+	};
+
+	const std::vector<std::string> files = { "Common.cl", "PathTrace.cl", "Microbench.cl" };
+	const size_t itemCount = 1 << 20;
+	const int iterations = 64;
+	const int timedRuns = 3;
+	// work items checked against the host reference
+	const size_t checkCount = 1024;
+	const double tolerance = 1e-6;
+	// Common.cl's default, passed explicitly so host and device agree
+	const double eps = 1e-3;
+
+	CLManager& cl;
+	std::vector<Sphere> spheres;
+	std::mt19937_64 rng{ 20240601 };
+
+	double uniform(double lo, double hi) {
+		return std::uniform_real_distribution<double>(lo, hi)(rng);
+	}
+
+	Vec randomDir() {
+		Vec v;
+		do v = { uniform(-1, 1), uniform(-1, 1), uniform(-1, 1) }; while (v.dot(v) > 1 || v.dot(v) < 1e-6);
+		return v.normalized();
+	}
+
+	// cl_double3 is cl_double4 on the host
+	static Vec vec(const cl_double4& v) { return { v.s[0], v.s[1], v.s[2] }; }
+
+	static cl_double4 result(double x, double y = 0, double z = 0) {
+		cl_double4 ret;
+		ret.s[0] = x;
+		ret.s[1] = y;
+		ret.s[2] = z;
+		ret.s[3] = 0;
+		return ret;
+	}
+
+	// Host copies of the device functions, written the way Common.cl and
+	// PathTrace.cl compute them.
+	static cl_ulong rand64(cl_ulong seed[2]) {
+		cl_ulong k3 = seed[0], k4 = seed[1];
+		seed[0] = k4;
+		k3 ^= k3 << 11;
+		seed[1] = k3 ^ k4 ^ (k3 >> 8) ^ (k4 >> 13);
+		return seed[1] + k4;
+	}
+
+	static double rand(cl_ulong seed[2]) {
+		return (double)rand64(seed) / (double)(cl_ulong)-1;
+	}
+
+	static void benchSeed(size_t i, cl_ulong seed[2]) {
+		seed[0] = (cl_ulong)i * 0x9E3779B97F4A7C15ull + 1;
+		seed[1] = ((cl_ulong)i + 1) * 0xD1B54A32D192ED03ull;
+	}
+
+	static Vec rand3(cl_ulong seed[2]) {
+		Vec v;
+		do {
+			v = Vec{ rand(seed), rand(seed), rand(seed) } * 2 - Vec{ 1, 1, 1 };
+		} while (v.dot(v) >= 1);
+		return v.normalized();
+	}
+
+	double sphereHit(const Vec& pos, const Vec& dir, const Sphere& s) const {
+		Vec d = pos - vec(s.pos);
+		double a = dir.dot(dir), b = 2 * dir.dot(d), c = d.dot(d) - s.radius * s.radius;
+		double delta = b * b - 4 * a * c;
+		if (delta <= 0) return -1;
+		delta = sqrt(delta);
+		double t = (-b - delta) / (2 * a);
+		if (t > eps) return t;
+		t = (-b + delta) / (2 * a);
+		if (t > eps) return t;
+		return -1;
+	}
+
+	double boxHit(const Vec& pos, const Vec& dir, const Sphere& s) const {
+		double lo[3] = { s.pos.x - s.radius, s.pos.y - s.radius, s.pos.z - s.radius };
+		double hi[3] = { s.pos.x + s.radius, s.pos.y + s.radius, s.pos.z + s.radius };
+		double p[3] = { pos.x, pos.y, pos.z }, d[3] = { dir.x, dir.y, dir.z };
+		double enter = -INFINITY, leave = INFINITY;
+		for (int j = 0; j < 3; j++) {
+			double t0 = (lo[j] - p[j]) / d[j], t1 = (hi[j] - p[j]) / d[j];
+			enter = std::max(enter, std::min(t0, t1));
+			leave = std::min(leave, std::max(t0, t1));
+		}
+		if (enter > leave) return -1;
+		if (enter > eps) return enter;
+		if (leave > eps) return leave;
+		return -1;
+	}
+
+	static Vec refract(const Vec& id, const Vec& nd, double co) {
+		double cosTheta = std::min((id * -1).dot(nd), 1.0);
+		Vec ra = (id + nd * cosTheta) * co;
+		Vec rb = nd * -sqrt(fabs(1.0 - ra.dot(ra)));
+		return ra + rb;
+	}
+
+	std::vector<Case> cases() {
+		auto ray = [this](size_t, Vec& a, Vec& b) {
+			a = { uniform(-1500, 1500), uniform(-1500, 1500), uniform(-1500, 1500) };
+			b = randomDir();
+		};
+		auto none = [](size_t, Vec& a, Vec& b) { a = b = { 0, 0, 0 }; };
+		return {
+			{ "getFirstCollideWithSphere", "benchSphereHit", 1, ray, [this](size_t i, const Vec& a, const Vec& b) {
+				double sum = 0;
+				for (int k = 0; k < iterations; k++) sum += sphereHit(a, b, spheres[(i + k) % spheres.size()]);
+				return result(sum);
+			} },
+			{ "getFirstCollideWithBox", "benchBoxHit", 1, ray, [this](size_t i, const Vec& a, const Vec& b) {
+				double sum = 0;
+				for (int k = 0; k < iterations; k++) sum += boxHit(a, b, spheres[(i + k) % spheres.size()]);
+				return result(sum);
+			} },
+			{ "rand64", "benchRand64", 1, none, [this](size_t i, const Vec&, const Vec&) {
+				cl_ulong seed[2], acc = 0;
+				benchSeed(i, seed);
+				for (int k = 0; k < iterations; k++) acc ^= rand64(seed);
+				return result((double)(acc >> 11));
+			} },
+			{ "rand3", "benchRand3", 1, none, [this](size_t i, const Vec&, const Vec&) {
+				cl_ulong seed[2];
+				benchSeed(i, seed);
+				Vec sum = { 0, 0, 0 };
+				for (int k = 0; k < iterations; k++) sum = sum + rand3(seed);
+				return result(sum.x, sum.y, sum.z);
+			} },
+			{ "refract", "benchRefract", 2, [this](size_t, Vec& a, Vec& b) {
+				b = randomDir();
+				a = randomDir();
+				if (a.dot(b) > 0) a = a * -1;
+			}, [this](size_t, const Vec& a, const Vec& b) {
+				Vec d = a;
+				for (int k = 0; k < iterations; k++) d = refract(refract(d, b, 1 / 1.5), b, 1.5);
+				return result(d.x, d.y, d.z);
+			} },
+			{ "normalize", "benchNormalize", 1, [this](size_t, Vec& a, Vec& b) {
+				a = { uniform(-10, 10), uniform(-10, 10), uniform(-10, 10) };
+				b = { uniform(-0.1, 0.1), uniform(-0.1, 0.1), uniform(-0.1, 0.1) };
+			}, [this](size_t, const Vec& a, const Vec& b) {
+				Vec v = a;
+				for (int k = 0; k < iterations; k++) v = (v + b).normalized();
+				return result(v.x, v.y, v.z);
+			} },
+		};
+	}
+
+	static bool close(double device, double host, double tolerance) {
+		return fabs(device - host) <= tolerance * std::max(1.0, fabs(host));
+	}
+
+	// Fastest of timedRuns launches after a warm-up, in ms; -1 on failure.
+	double time(cl_kernel kernel) {
+		size_t globalSize = itemCount;
+		double best = -1;
+		for (int run = 0; run <= timedRuns; run++) {
+			cl_event e;
+			cl_int err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, &e);
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't launch microbenchmark: " << TranslateOpenCLError(err) << std::endl;
+				return -1;
+			}
+			clWaitForEvents(1, &e);
+			cl_ulong startTime, endTime;
+			clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, nullptr);
+			clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, nullptr);
+			clReleaseEvent(e);
+			double ms = (endTime - startTime) * 1e-6;
+			if (run > 0 && (best < 0 || ms < best)) best = ms;
+		}
+		return best;
+	}
+
+public:
+	Microbench(CLManager& cl) : cl(cl) {
+		for (int i = 0; i < 16; i++) {
+			Sphere s = {};
+			s.radius = uniform(50, 300);
+			s.pos = cl_double3{ uniform(-1000, 1000), uniform(-1000, 1000), uniform(-1000, 1000) };
+			spheres.push_back(s);
+		}
+	}
+
+	// Runs every case on cl's device; false if one failed or disagreed with
+	// the host.
+	bool run() {
+		char options[96];
+		sprintf(options, "-D BENCH_ITERATIONS=%d -D EPS=%.17g", iterations, eps);
+		CLProgram program = cl.buildProgram(files, options);
+		if (!program) return false;
+
+		cl_int err = CL_SUCCESS, ret;
+		size_t bytes = itemCount * sizeof(cl_double4);
+		PooledBuffer aMem = cl.pool.acquire(bytes, CL_MEM_READ_ONLY, MemScratch, nullptr, &ret);
+		err |= ret;
+		PooledBuffer bMem = cl.pool.acquire(bytes, CL_MEM_READ_ONLY, MemScratch, nullptr, &ret);
+		err |= ret;
+		PooledBuffer outMem = cl.pool.acquire(bytes, CL_MEM_WRITE_ONLY, MemScratch, nullptr, &ret);
+		err |= ret;
+		PooledBuffer sphereMem = cl.pool.acquire(spheres.size() * sizeof(Sphere), CL_MEM_READ_ONLY, MemScene,
+			spheres.data(), &ret);
+		err |= ret;
+		if (err != CL_SUCCESS) std::cerr << "Couldn't create microbenchmark buffers: " << TranslateOpenCLError(err) << std::endl;
+
+		std::cout << itemCount << " work items x " << iterations << " iterations" << std::endl;
+		bool ok = err == CL_SUCCESS;
+		std::vector<cl_double4> a(itemCount), b(itemCount), out(itemCount);
+		for (const Case& c : cases()) {
+			if (!ok) break;
+			for (size_t i = 0; i < itemCount; i++) {
+				Vec va, vb;
+				c.input(i, va, vb);
+				a[i] = result(va.x, va.y, va.z);
+				b[i] = result(vb.x, vb.y, vb.z);
+			}
+			CLKernel kernel(clCreateKernel(program, c.kernel.c_str(), &err));
+			if (err != CL_SUCCESS) {
+				std::cerr << "Couldn't create " << c.kernel << ": " << TranslateOpenCLError(err) << std::endl;
+				ok = false;
+				break;
+			}
+			cl_int sphereCount = spheres.size();
+			err = clEnqueueWriteBuffer(cl.queue, aMem, CL_TRUE, 0, bytes, a.data(), 0, nullptr, nullptr);
+			err |= clEnqueueWriteBuffer(cl.queue, bMem, CL_TRUE, 0, bytes, b.data(), 0, nullptr, nullptr);
+			err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), aMem.ptr());
+			err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), bMem.ptr());
+			err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), sphereMem.ptr());
+			err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &sphereCount);
+			err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), outMem.ptr());
+			double ms = err == CL_SUCCESS ? time(kernel) : -1;
+			if (ms > 0) err = clEnqueueReadBuffer(cl.queue, outMem, CL_TRUE, 0, bytes, out.data(), 0, nullptr, nullptr);
+			if (ms <= 0 || err != CL_SUCCESS) {
+				std::cout << "  " << c.function << ": failed" << std::endl;
+				ok = false;
+				continue;
+			}
+
+			size_t mismatches = 0, stride = itemCount / checkCount;
+			for (size_t i = 0; i < itemCount; i += stride) {
+				cl_double4 expected = c.reference(i, vec(a[i]), vec(b[i]));
+				for (int j = 0; j < 3; j++) {
+					if (close(out[i].s[j], expected.s[j], tolerance)) continue;
+					mismatches++;
+					break;
+				}
+			}
+			double ops = (double)itemCount * iterations * c.opsPerIteration;
+			double ns = ms * 1e6 / ops;
+			char line[160];
+			sprintf(line, "  %-26s %9.4f ns/op %10.1f Mops/s  ", c.function.c_str(), ns, ops / (ms * 1e3));
+			std::cout << line;
+			if (mismatches) std::cout << mismatches << " of " << itemCount / stride << " checked results differ";
+			else std::cout << "matches host";
+			std::cout << std::endl;
+			ok &= mismatches == 0;
+		}
+
+		return ok;
+	}
+};
@@ -0,0 +1,151 @@
+#pragma once
+#include <CL/opencl.h>
+#include <algorithm>
+#include <cmath>
+
+#include "Scene.h"
+
+// GuideGrid in Common.cl.
+struct GuideGrid {
+	cl_double3 CL_ALIGN(32) lo;
+	cl_double3 cellSize;
+	cl_double mix;
+	cl_int train;
+};
+
+// Schedule of the path tracer's online path guiding (PATH_GUIDING in
+// PathTrace.cl): a grid of res^3 cells over the scene, each with a
+// histogram of incident radiance over thetaBins x phiBins directions. The
+// first pass only trains, the next ones train on twice the samples of the
+// one before while guiding with what the previous pass learned, like the
+// iterations of practical path guiding; after passes passes the last
+// distributions are kept and training stops. Estimates stay unbiased
+// throughout, so nothing accumulated is thrown away when the guide changes.
+class PathGuide {
+public:
+	// same as GUIDE_RES, GUIDE_THETA_BINS and GUIDE_PHI_BINS in PathTrace.cl
+	static const int res = 16;
+	static const int thetaBins = 8;
+	static const int phiBins = 16;
+	static const int bins = thetaBins * phiBins;
+	static const int cells = res * res * res;
+
+private:
+	const int passes = 9;
+	// share of diffuse bounces drawn from the guide once it exists
+	const double guideMix = 0.5;
+
+	GuideGrid grid;
+	int pass = 0;
+	// samples per pixel traced in this pass and how many it takes
+	long long passSpp = 0, passLength = 1;
+
+	static void extend(cl_double3& lo, cl_double3& hi, double x, double y, double z) {
+		lo = { std::min(lo.x, x), std::min(lo.y, y), std::min(lo.z, z) };
+		hi = { std::max(hi.x, x), std::max(hi.y, y), std::max(hi.z, z) };
+	}
+
+public:
+	// Starts over on a scene: the grid spans the camera and everything but
+	// the lights, infinite planes only along their normal's axis.
+	void reset(const Sphere sphere[], int sphereSize, const Shape shape[], int shapeSize, const Camera& cam) {
+		cl_double3 lo = cam.pos, hi = cam.pos;
+		for (int i = 0; i < sphereSize; i++) {
+			const Sphere& s = sphere[i];
+			if (s.mat.type == 0) continue;
+			extend(lo, hi, s.pos.x - s.radius, s.pos.y - s.radius, s.pos.z - s.radius);
+			extend(lo, hi, s.pos.x + s.radius, s.pos.y + s.radius, s.pos.z + s.radius);
+		}
+		for (int i = 0; i < shapeSize; i++) {
+			const Shape& s = shape[i];
+			if (s.mat.type == 0) continue;
+			if (s.type == SHAPE_QUAD) {
+				extend(lo, hi, s.a.x, s.a.y, s.a.z);
+				cl_double3 far = s.a + s.b + s.c;
+				extend(lo, hi, far.x, far.y, far.z);
+				cl_double3 u = s.a + s.b, v = s.a + s.c;
+				extend(lo, hi, u.x, u.y, u.z);
+				extend(lo, hi, v.x, v.y, v.z);
+			} else if (s.type == SHAPE_BOX) {
+				extend(lo, hi, s.a.x, s.a.y, s.a.z);
+				extend(lo, hi, s.b.x, s.b.y, s.b.z);
+			}
+		}
+		// axis-aligned planes bound the one axis they face
+		for (int i = 0; i < shapeSize; i++) {
+			const Shape& s = shape[i];
+			if (s.type != SHAPE_PLANE) continue;
+			for (int k = 0; k < 3; k++) {
+				if (fabs(s.b.s[k]) < 1 - 1e-9) continue;
+				lo.s[k] = std::min(lo.s[k], s.a.s[k]);
+				hi.s[k] = std::max(hi.s[k], s.a.s[k]);
+			}
+		}
+		double extent = std::max({ hi.x - lo.x, hi.y - lo.y, hi.z - lo.z, 1.0 });
+		for (int k = 0; k < 3; k++) {
+			double pad = std::max(hi.s[k] - lo.s[k], extent / res) * 1e-3;
+			double size = std::max(hi.s[k] - lo.s[k], extent / res) + 2 * pad;
+			grid.lo.s[k] = lo.s[k] - pad;
+			grid.cellSize.s[k] = size / res;
+		}
+		grid.mix = 0;
+		grid.train = 1;
+		pass = 0;
+		passSpp = 0;
+		passLength = 1;
+	}
+
+	// Counts spp samples per pixel just traced. True when a pass ends and
+	// the distributions need rebuilding (buildGuide) with the new getGrid().
+	bool advance(long long spp) {
+		if (!training()) return false;
+		passSpp += spp;
+		if (passSpp < passLength) return false;
+		pass++;
+		passSpp = 0;
+		passLength *= 2;
+		grid.mix = guideMix;
+		grid.train = pass < passes;
+		return true;
+	}
+
+	bool training() const {
+		return grid.train != 0;
+	}
+
+	const GuideGrid& getGrid() const {
+		return grid;
+	}
+
+	// Training histograms, with a record count per cell, and the distributions.
+	static size_t trainBytes() {
+		return (size_t)cells * (bins + 1) * sizeof(cl_float);
+	}
+
+	static size_t cdfBytes() {
+		return (size_t)cells * bins * sizeof(cl_float);
+	}
+
+	// passes finished so far
+	int getPass() const {
+		return pass;
+	}
+
+	// Where the schedule stands, for checkpoints.
+	struct Progress {
+		GuideGrid grid;
+		int pass;
+		long long passSpp, passLength;
+	};
+
+	Progress progress() const {
+		return { grid, pass, passSpp, passLength };
+	}
+
+	void restore(const Progress& p) {
+		grid = p.grid;
+		pass = p.pass;
+		passSpp = p.passSpp;
+		passLength = p.passLength;
+	}
+};
@@ -0,0 +1,54 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdio.h>
+#include <string>
+
+// Counters of a PATH_STATS build of the path tracer, laid out as the
+// pathStats buffer in PathTrace.cl: how many bounces were traced, how the
+// paths ended and a histogram of their lengths.
+struct PathStats {
+	enum Counter { Bounces, Roulette, Escaped, Light, Absorbed, DepthLimit, TotalInternalReflection, Length };
+	static const int lengthBins = 16;
+	static const int size = Length + lengthBins;
+
+	cl_ulong values[size] = {};
+
+	// every path lands in one length bin
+	cl_ulong paths() const {
+		cl_ulong ret = 0;
+		for (int i = 0; i < lengthBins; i++) ret += values[Length + i];
+		return ret;
+	}
+
+	double meanLength() const {
+		cl_ulong n = paths();
+		return n ? (double)values[Bounces] / n : 0;
+	}
+
+	// share of paths ended by counter c
+	double fraction(Counter c) const {
+		cl_ulong n = paths();
+		return n ? (double)values[c] / n : 0;
+	}
+
+	// For the title bar.
+	std::string summary() const {
+		char buffer[128];
+		snprintf(buffer, sizeof(buffer), "len %.2f, RR %.0f%%, miss %.0f%%, light %.0f%%, TIR %.2f%%/bounce",
+			meanLength(), fraction(Roulette) * 100, fraction(Escaped) * 100, fraction(Light) * 100,
+			values[Bounces] ? 100.0 * values[TotalInternalReflection] / values[Bounces] : 0);
+		return buffer;
+	}
+
+	std::string json() const {
+		char buffer[512];
+		int len = snprintf(buffer, sizeof(buffer), "{\"paths\": %llu, \"bounces\": %llu, \"roulette\": %llu, "
+			"\"escaped\": %llu, \"light\": %llu, \"absorbed\": %llu, \"depthLimit\": %llu, \"tir\": %llu, \"lengths\": [",
+			(unsigned long long)paths(), (unsigned long long)values[Bounces], (unsigned long long)values[Roulette],
+			(unsigned long long)values[Escaped], (unsigned long long)values[Light], (unsigned long long)values[Absorbed],
+			(unsigned long long)values[DepthLimit], (unsigned long long)values[TotalInternalReflection]);
+		std::string ret(buffer, len);
+		for (int i = 0; i < lengthBins; i++) ret += (i ? ", " : "") + std::to_string(values[Length + i]);
+		return ret + "]}";
+	}
+};
@@ -1,205 +1,399 @@
-__constant double EPS = 1e-3;
-
-typedef ulong llu;
-
-typedef struct Seed64 {
-	llu k1, k2;
-} Seed64;
-
-typedef struct Ray {
-	double3 pos;
-	double3 dir;
-} Ray;
-
-typedef struct Cam {
-	double theta;
-	double width;
-	double height;
-	double3 pos;
-	double3 up;
-	double3 lookAt;
-} Cam;
-
-typedef struct Material {
-	double refractionCoefficient;
-	double reflectionWeight;
-	int type;
-	double3 color;
-} Material;
-
-typedef struct Sphere {
-	double radius;
-	double3 pos;
-	Material mat;
-} Sphere;
-
-static llu rand64(Seed64* seed)
-{
-	llu k3 = seed->k1, k4 = seed->k2;
-	seed->k1 = k4;
-	k3 ^= k3 << 11;
-	seed->k2 = k3 ^ k4 ^ (k3 >> 8) ^ (k4 >> 13);
-	return seed->k2 + k4;
+// Path tracing mode, built after Common.cl. Render settings and scene facts
+// may be passed as -D defines to build a variant specialized for the loaded
+// scene, see RR_P, MAX_DEPTH and MATERIAL_MASK in Common.cl.
+
+// Path statistics (PathStats.h): with PATH_STATS defined every work item
+// counts how its paths end in stats[] and the group adds them to the
+// pathStats buffer. Without it the hooks compile to nothing.
+#define PATH_STAT_BOUNCES 0
+#define PATH_STAT_ROULETTE 1
+#define PATH_STAT_ESCAPED 2
+#define PATH_STAT_LIGHT 3
+#define PATH_STAT_ABSORBED 4
+#define PATH_STAT_DEPTH_LIMIT 5
+#define PATH_STAT_TIR 6
+// path length histogram, the last bin also takes longer paths
+#define PATH_STAT_LENGTH 7
+#define PATH_LENGTH_BINS 16
+#define PATH_STATS_SIZE (PATH_STAT_LENGTH + PATH_LENGTH_BINS)
+#ifdef PATH_STATS
+#define PATH_STATS_PARAM , int* stats
+#define PATH_STATS_PASS , stats
+#define PATH_STAT(i) (stats[i]++)
+#define PATH_END(length, atLimit) (stats[PATH_STAT_LENGTH + min((length), PATH_LENGTH_BINS - 1)]++, \
+	stats[PATH_STAT_DEPTH_LIMIT] += (atLimit))
+#else
+#define PATH_STATS_PARAM
+#define PATH_STATS_PASS
+#define PATH_STAT(i)
+#define PATH_END(length, atLimit)
+#endif
+
+// Caustic paths: with CAUSTIC_PATHS defined only light that reaches the eye
+// over a diffuse bounce followed by specular ones (mirror, glass or fuzzed
+// metal) is added, which the convergence benchmark uses as its mask of the
+// caustic regions. pathFlags has bit 0 set after a diffuse bounce and bit 1
+// once a specular bounce followed it.
+#ifdef CAUSTIC_PATHS
+#define CAUSTIC_PARAM , int* pathFlags
+#define CAUSTIC_PASS , &pathFlags
+#define CAUSTIC_RESET() (pathFlags = 0)
+#define CAUSTIC_BOUNCE(type) (*pathFlags = (type) == 1 ? 1 : *pathFlags | (*pathFlags & 1) << 1)
+#define CAUSTIC_LIGHT() (*pathFlags == 3)
+#else
+#define CAUSTIC_PARAM
+#define CAUSTIC_PASS
+#define CAUSTIC_RESET()
+#define CAUSTIC_BOUNCE(type)
+#define CAUSTIC_LIGHT() true
+#endif
+
+// Path guiding: with PATH_GUIDING defined a diffuse bounce draws its
+// direction from the learned distribution of its grid cell with probability
+// guideGrid->mix, else from the cosine lobe, and is weighed by the mixture's
+// density. While guideGrid->train is set, a path remembers its diffuse
+// vertices and, on reaching a light, adds what each of them received over
+// the density its direction was drawn with to that direction's bin, so the
+// histograms estimate incident radiance. buildGuide turns them into the
+// distributions between passes (see PathGuide.h). Directions are binned in
+// GUIDE_THETA_BINS bands of equal height in y times GUIDE_PHI_BINS sectors,
+// all of the same solid angle. The sizes have to match PathGuide.h.
+#ifndef GUIDE_RES
+#define GUIDE_RES 16
+#endif
+#ifndef GUIDE_THETA_BINS
+#define GUIDE_THETA_BINS 8
+#endif
+#ifndef GUIDE_PHI_BINS
+#define GUIDE_PHI_BINS 16
+#endif
+#define GUIDE_BINS (GUIDE_THETA_BINS * GUIDE_PHI_BINS)
+// a cell's training histogram: the bins, then how many records reached a light
+#define GUIDE_TRAIN_STRIDE (GUIDE_BINS + 1)
+// records a cell needs before its distribution is used, and the share of
+// uniform density mixed in so no direction becomes unreachable
+#define GUIDE_MIN_RECORDS 64
+#define GUIDE_UNIFORM 0.1f
+#ifdef PATH_GUIDING
+typedef struct GuidePath {
+	__constant GuideGrid* grid;
+	__global float* train;
+	__global const float* cdf;
+	// diffuse vertices so far: training slot, inverse density of the
+	// direction taken and the throughput after the bounce
+	int count;
+	int slot[MAX_DEPTH];
+	double invPdf[MAX_DEPTH];
+	double3 throughput[MAX_DEPTH];
+} GuidePath;
+
+#define GUIDE_PARAM , GuidePath* guide
+#define GUIDE_PASS , guide
+#define GUIDE_START() (guide->count = 0)
+#define GUIDE_LIGHT(radiance) guideRecord(guide, radiance)
+#define SCATTER(ray, o, seed, tir, brightness) guidedScatter(ray, o, seed, tir, brightness, guide)
+#else
+#define GUIDE_PARAM
+#define GUIDE_PASS
+#define GUIDE_START()
+#define GUIDE_LIGHT(radiance)
+#define SCATTER(ray, o, seed, tir, brightness) scatter(ray, o, seed, tir)
+#endif
+
+#ifdef PATH_GUIDING
+void atomicAddFloat(volatile __global float* p, float v) {
+	volatile __global uint* bits = (volatile __global uint*)p;
+	uint old = *bits, seen;
+	do {
+		seen = old;
+		old = atomic_cmpxchg(bits, seen, as_uint(as_float(seen) + v));
+	} while (old != seen);
 }
 
-static double rand(Seed64* seed) {
-	return (double)rand64(seed) / (-1lu);
+int guideCell(__constant GuideGrid* grid, double3 pos) {
+	int3 c = clamp(convert_int3(floor((pos - grid->lo) / grid->cellSize)), 0, GUIDE_RES - 1);
+	return (c.z * GUIDE_RES + c.y) * GUIDE_RES + c.x;
 }
 
-static double norm2(double3 v) {
-	return v.x * v.x + v.y * v.y + v.z * v.z;
+int guideBin(double3 dir) {
+	int band = clamp((int)((dir.y + 1) / 2 * GUIDE_THETA_BINS), 0, GUIDE_THETA_BINS - 1);
+	double phi = atan2(dir.z, dir.x);
+	if (phi < 0) phi += 2 * M_PI;
+	int sector = clamp((int)(phi / (2 * M_PI) * GUIDE_PHI_BINS), 0, GUIDE_PHI_BINS - 1);
+	return band * GUIDE_PHI_BINS + sector;
 }
 
-Ray getPixelRay(__constant Cam* cam, int x, int y, Seed64* seed) {
-	Ray ret;
-	double3 w = -normalize(cam->lookAt);
-	double3 v = normalize(cam->up);
-	double3 u = cross(v, w);
-	double halfHeight = cam->height / 2;
-	double halfWidth = cam->width / 2;
-	double distance = halfHeight / tan(cam->theta / 2);
-	double3 eyePos = cam->pos + w * distance;
-	double3 leftBottomPos = cam->pos - v * halfHeight - u * halfWidth;
-	double tu = (x + rand(seed)) / get_global_size(0);
-	double tv = 1.0 - (y + rand(seed)) / get_global_size(1);
-
-	ret.pos = leftBottomPos + tu * cam->width * u + tv * cam->height * v;
-	ret.dir = normalize(ret.pos - eyePos);
-
-	return ret;
+// Density over solid angle of the cell distribution cdf at any direction in bin.
+double guidePdf(__global const float* cdf, int bin) {
+	double p = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.0f);
+	return p * GUIDE_BINS / (4 * M_PI);
 }
 
-double getFirstCollideWithSphere(const Ray* ray, const Sphere* sphere) {
-	double a = pow(ray->dir.x, 2) + pow(ray->dir.y, 2) + pow(ray->dir.z, 2);
-	double b = 2 * (ray->dir.x * (ray->pos.x - sphere->pos.x)
-		+ ray->dir.y * (ray->pos.y - sphere->pos.y)
-		+ ray->dir.z * (ray->pos.z - sphere->pos.z));
-	double c = pow(ray->pos.x - sphere->pos.x, 2)
-		+ pow(ray->pos.y - sphere->pos.y, 2)
-		+ pow(ray->pos.z - sphere->pos.z, 2)
-		- pow(sphere->radius, 2);
-	double delta = b * b - 4 * a * c;
-	if (delta <= 0) return -1;
-	delta = sqrt(delta);
-	double t = (-b - delta) / (2 * a);
-	if (t > EPS) return t;
-	t = (-b + delta) / (2 * a);
-	if (t > EPS) return t;
-	return -1;
+// A direction uniform within the bin cdf picks.
+double3 guideSample(__global const float* cdf, Seed64* seed) {
+	double u = rand(seed);
+	int lo = 0, hi = GUIDE_BINS - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (cdf[mid] <= u) lo = mid + 1;
+		else hi = mid;
+	}
+	double y = -1 + 2 * (lo / GUIDE_PHI_BINS + rand(seed)) / GUIDE_THETA_BINS;
+	double phi = 2 * M_PI * (lo % GUIDE_PHI_BINS + rand(seed)) / GUIDE_PHI_BINS;
+	double r = sqrt(max(0.0, 1 - y * y));
+	return (double3)(r * cos(phi), y, r * sin(phi));
 }
 
-double3 getFirstCollide(const Ray* ray, __constant Sphere* sphere, const int sphereSize, int* id) {
-	*id = -1;
-	double mm = 0;
-	for (int i = 0; i < sphereSize; i++)
-	{
-		Sphere nows = sphere[i];
-		double t = getFirstCollideWithSphere(ray, &nows);
-		if (t == -1) continue;
-		if (mm == 0 || t < mm) {
-			mm = t;
-			*id = i;
-		}
+// scatter, except that diffuse directions come from the mixture of the
+// cell's distribution and the cosine lobe, weighed by the mixture's density.
+bool guidedScatter(Ray* ray, const Hit* o, Seed64* seed, bool* tir, double3* brightness, GuidePath* guide) {
+	if (!HAS_MATERIAL(1) || o->mat.type != 1) return scatter(ray, o, seed, tir);
+	double3 ns = dot(ray->dir, o->nd) < 0 ? o->nd : -o->nd;
+	int cell = guideCell(guide->grid, o->pos);
+	__global const float* cdf = guide->cdf + cell * GUIDE_BINS;
+	// an all-zero CDF: the cell has no distribution yet
+	double mix = cdf[GUIDE_BINS - 1] > 0 ? guide->grid->mix : 0;
+	double3 dir = mix > 0 && rand(seed) < mix ? guideSample(cdf, seed) : normalize(rand3(seed) + ns);
+	double cosTheta = dot(dir, ns);
+	if (cosTheta <= 0) return false;
+
+	int bin = guideBin(dir);
+	double pdf = (1 - mix) * cosTheta / M_PI + (mix > 0 ? mix * guidePdf(cdf, bin) : 0);
+	*brightness *= cosTheta / M_PI / pdf;
+	ray->pos = o->pos;
+	ray->dir = dir;
+	if (guide->grid->train && guide->count < MAX_DEPTH) {
+		int i = guide->count++;
+		guide->slot[i] = cell * GUIDE_TRAIN_STRIDE + bin;
+		guide->invPdf[i] = 1 / pdf;
+		guide->throughput[i] = *brightness;
 	}
-	return ray->pos + mm * ray->dir;
+	return true;
 }
 
-static double3 rand3(Seed64* seed) {
-	double3 ret;
-	do {
-		ret = 2 * (double3)(rand(seed), rand(seed), rand(seed)) - (double3)(1, 1, 1);
-	} while (norm2(ret) >= 1);
-	return normalize(ret);
+// The path reached a light and adds radiance to its pixel: each diffuse
+// vertex received that over the throughput up to it.
+void guideRecord(GuidePath* guide, double3 radiance) {
+	if (!guide->grid->train) return;
+	for (int i = 0; i < guide->count; i++) {
+		double3 t = guide->throughput[i];
+		double3 l = (double3)(t.x > 0 ? radiance.x / t.x : 0, t.y > 0 ? radiance.y / t.y : 0,
+			t.z > 0 ? radiance.z / t.z : 0);
+		double value = (0.2126 * l.x + 0.7152 * l.y + 0.0722 * l.z) * guide->invPdf[i];
+		int cell = guide->slot[i] / GUIDE_TRAIN_STRIDE;
+		atomicAddFloat(&guide->train[guide->slot[i]], (float)value);
+		atomicAddFloat(&guide->train[cell * GUIDE_TRAIN_STRIDE + GUIDE_BINS], 1);
+	}
 }
 
-double3 reflect(const double3 id, const double3 nd) {
-	return id - 2.0 * dot(id, nd) * nd;
+// Turns every cell's training histogram into the CDF guidedScatter draws
+// from and clears it for the next pass. Cells with fewer than
+// GUIDE_MIN_RECORDS records get an all-zero CDF.
+__kernel void buildGuide(__global float* guideTrain, __global float* guideCdf) {
+	int cell = get_global_id(0);
+	__global float* train = guideTrain + cell * GUIDE_TRAIN_STRIDE;
+	__global float* cdf = guideCdf + cell * GUIDE_BINS;
+	float total = 0;
+	for (int i = 0; i < GUIDE_BINS; i++) total += train[i];
+	bool usable = train[GUIDE_BINS] >= GUIDE_MIN_RECORDS && total > 0;
+	float sum = 0;
+	for (int i = 0; i < GUIDE_BINS; i++) {
+		if (usable) sum += (1 - GUIDE_UNIFORM) * train[i] / total + GUIDE_UNIFORM / GUIDE_BINS;
+		cdf[i] = sum;
+		train[i] = 0;
+	}
+	if (usable) cdf[GUIDE_BINS - 1] = 1;
+	train[GUIDE_BINS] = 0;
 }
+#endif
 
-double3 refract(const double3 id, const double3 nd, const double co) {
-	double cosTheta = min(dot(-id, nd), 1.0);
-	double3 ra = co * (id + cosTheta * nd);
-	double3 rb = -sqrt(fabs(1.0 - dot(ra, ra))) * nd;
-	return ra + rb;
+// Traces one bounce of a path. Returns false once the path has ended; light
+// reached on the way is added to color.
+bool bounce(Ray* ray, double3* brightness, double3* color, __constant Sphere* sphere, const int sphereSize,
+	__constant Shape* shape, const int shapeSize, Seed64* seed PATH_STATS_PARAM CAUSTIC_PARAM GUIDE_PARAM) {
+	Hit o;
+	PATH_STAT(PATH_STAT_BOUNCES);
+	if (rand(seed) > RR_P) {
+		PATH_STAT(PATH_STAT_ROULETTE);
+		return false;
+	}
+	if (!intersectScene(ray, sphere, sphereSize, shape, shapeSize, &o)) {
+		PATH_STAT(PATH_STAT_ESCAPED);
+		return false;
+	}
+
+	if (HAS_MATERIAL(0) && o.mat.type == 0) {
+		PATH_STAT(PATH_STAT_LIGHT);
+		if (CAUSTIC_LIGHT()) *color += o.mat.color * *brightness;
+		GUIDE_LIGHT(o.mat.color * *brightness);
+		return false;
+	}
+
+	CAUSTIC_BOUNCE(o.mat.type);
+	*brightness *= o.mat.color;
+	bool tir = false;
+	if (!SCATTER(ray, &o, seed, &tir, brightness)) {
+		PATH_STAT(PATH_STAT_ABSORBED);
+		return false;
+	}
+	if (tir) PATH_STAT(PATH_STAT_TIR);
+	*brightness /= RR_P;
+	return true;
 }
 
-double3 emitRay(Ray ray, __constant Sphere* sphere, const int sphereSize, Seed64* seed) {
-	const double P = 0.8;
-	const int maxDep = 10;
-	Sphere o;
-	int id;
-	bool isFront;
+double3 emitRay(Ray ray, __constant Sphere* sphere, const int sphereSize, __constant Shape* shape, const int shapeSize,
+	Seed64* seed, int* bounces PATH_STATS_PARAM GUIDE_PARAM) {
 	double3 color = (double3)(0, 0, 0);
 	double3 brightness = (double3)(1, 1, 1);
-
-	for (int i = 0; i < maxDep; i++) {
-		if (rand(seed) > P) break;
-		double3 pos = getFirstCollide(&ray, sphere, sphereSize, &id);
-		if (id == -1) break;
-
-		o = sphere[id];
-		if (o.mat.type == 0) {
-			color = o.mat.color * brightness;
+#ifdef CAUSTIC_PATHS
+	int pathFlags = 0;
+#endif
+	GUIDE_START();
+	int i = 0;
+	for (; i < MAX_DEPTH; i++) {
+		(*bounces)++;
+		if (!bounce(&ray, &brightness, &color, sphere, sphereSize, shape, shapeSize, seed
+			PATH_STATS_PASS CAUSTIC_PASS GUIDE_PASS))
 			break;
-		}
-
-		bool isFront = (dot(ray.dir, pos - o.pos) < 0);
-		double3 nd = normalize(pos - o.pos);
-
-		ray.pos = pos;
-		brightness *= o.mat.color;
-		if (o.mat.type == 1) {
-			ray.dir = normalize(rand3(seed) + nd);
-		} else if (o.mat.type == 2 || o.mat.type == 4) {
-			double fuzz = 0.0;
-			if (o.mat.type == 4) fuzz = 0.4;
-			ray.dir = normalize(reflect(ray.dir, nd) + fuzz * rand3(seed));
-			if (dot(ray.dir, nd) < 0) break;
-		} else if (o.mat.type == 3) {
-			double co = o.mat.refractionCoefficient;
-			if (isFront) co = 1.0 / co; else nd = -nd;
-			double cosTheta = min(dot(-ray.dir, nd), 1.0);
-			double sinTheta = sqrt(1 - pow(cosTheta, 2));
-			bool isReflect = false;
-			if (co * sinTheta > 1) isReflect = true;
-			else {
-				double R = pow((1 - co) / (1 + co), 2);
-				R += (1 - R) * pow(1 - cosTheta, 5);
-				if (rand(seed) < R) isReflect = true;
-			}
-			if (isReflect) {
-				ray.dir = reflect(ray.dir, nd);
-			} else {
-				ray.dir = normalize(refract(normalize(ray.dir), nd, co));
-			}
-		}
-		brightness /= P;
 	}
+	PATH_END(min(i + 1, MAX_DEPTH), i == MAX_DEPTH);
 	return color;
 }
 
-__kernel void kernelMain(__global uchar3* pixels, __constant Sphere* sphere, const int sphereSize, __constant Cam* cam,
-	const uint Seed, const llu frame, __global double3* sumColor) {
-	int2 coord = (int2)(get_global_id(0), get_global_id(1));
-	uint idx = coord.y * get_global_size(0) + coord.x;
+#ifdef MEASURE_UTILIZATION
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
 
-	// random seed
-	Seed64 seed;
-	llu magic = coord.x * (1e9 + 7) + (coord.x * coord.y) * (1e9 + 9) + 998244353;
-	seed.k1 = (llu)(Seed ^ magic) * (Seed ^ magic);
-	seed.k2 = (llu)magic * magic * (1e5 + 7);
+// Work-group level SIMD utilization: useful bounces against the bounces the
+// group pays for, i.e. its longest lane times its size.
+// groupStats has to live at kernel scope, it holds the group's sum and max.
+void recordUtilization(int bounces, __global ulong* utilization, __local int* groupStats) {
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) groupStats[0] = groupStats[1] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	atomic_add(&groupStats[0], bounces);
+	atomic_max(&groupStats[1], bounces);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) {
+		atom_add(&utilization[0], (ulong)groupStats[0]);
+		atom_add(&utilization[1], (ulong)groupStats[1] * get_local_size(0) * get_local_size(1));
+	}
+}
+#endif
+
+#ifdef PATH_STATS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+// Adds the work item's counts to the group's in local memory, then one
+// global atomic per counter and group. groupStats has to live at kernel
+// scope and hold PATH_STATS_SIZE counters.
+void recordPathStats(const int* stats, __global ulong* pathStats, __local uint* groupStats) {
+	uint lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	uint groupSize = get_local_size(0) * get_local_size(1);
+	for (uint i = lid; i < PATH_STATS_SIZE; i += groupSize) groupStats[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = 0; i < PATH_STATS_SIZE; i++)
+		if (stats[i]) atomic_add(&groupStats[i], (uint)stats[i]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = lid; i < PATH_STATS_SIZE; i += groupSize)
+		if (groupStats[i]) atom_add(&pathStats[i], (ulong)groupStats[i]);
+}
+#endif
+
+// The path tracer's own arguments, after the shared ones.
+#define PATH_KERNEL_ARGS __global ulong* pathStats, __constant GuideGrid* guideGrid, __global float* guideTrain, \
+	__global const float* guideCdf
+
+__kernel void kernelMain(TRACE_KERNEL_ARGS, PATH_KERNEL_ARGS) {
+	uint idx;
+	int2 coord = workItemPixel(width, &idx);
+	bool inside = coord.x < width && coord.y < height;
+
+	Seed64 seed = pixelSeed(Seed, coord.x, coord.y);
+
+	int bounces = 0;
+#ifdef PATH_STATS
+	int stats[PATH_STATS_SIZE] = { 0 };
+#endif
+#ifdef PATH_GUIDING
+	GuidePath guidePath = { guideGrid, guideTrain, guideCdf, 0 };
+	GuidePath* guide = &guidePath;
+#endif
+	double3 color = (double3)(0, 0, 0);
+	for (int i = 0; inside && i < sampleNum; i++) {
+		Ray startRay = getPixelRay(cam, coord.x, coord.y, width, height, &seed);
+		color += emitRay(startRay, sphere, sphereSize, shape, shapeSize, &seed, &bounces PATH_STATS_PASS GUIDE_PASS);
+	}
+
+	if (inside) sumColor[idx] += color;
 
-	Ray startRay = getPixelRay(cam, coord.x, coord.y, &seed);
+#ifdef MEASURE_UTILIZATION
+	__local int groupStats[2];
+	recordUtilization(bounces, utilization, groupStats);
+#endif
+#ifdef PATH_STATS
+	__local uint groupPathStats[PATH_STATS_SIZE];
+	recordPathStats(stats, pathStats, groupPathStats);
+#endif
+}
 
-	int sampleNum = 1;
+// Persistent threads: only enough work items to fill the device are launched
+// and each pulls pixels from workCounter, in slot order. A lane starts its
+// next path as soon as the current one terminates instead of idling until the
+// longest path in its SIMD group is done.
+__kernel void kernelPersistent(TRACE_KERNEL_ARGS, PATH_KERNEL_ARGS, volatile __global int* workCounter) {
+	int2 coord;
+	int slot = nextSlot(workCounter, width, height, &coord);
+	int samplesLeft = sampleNum;
+	int depth = 0, bounces = 0;
+#ifdef PATH_STATS
+	int stats[PATH_STATS_SIZE] = { 0 };
+#endif
+#ifdef CAUSTIC_PATHS
+	int pathFlags = 0;
+#endif
+#ifdef PATH_GUIDING
+	GuidePath guidePath = { guideGrid, guideTrain, guideCdf, 0 };
+	GuidePath* guide = &guidePath;
+#endif
+	Seed64 seed;
+	Ray ray;
 	double3 color = (double3)(0, 0, 0);
-	for (int i = 0; i < sampleNum; i++)
-		color += emitRay(startRay, sphere, sphereSize, &seed);
-	color /= sampleNum;
-
-	sumColor[idx] += color;
-	color = sqrt(sumColor[idx] / frame);
-	pixels[idx].x = (float)color.x * 255;
-	pixels[idx].y = (float)color.y * 255;
-	pixels[idx].z = (float)color.z * 255;
-}
\ No newline at end of file
+	double3 brightness = (double3)(1, 1, 1);
+
+	if (slot >= 0) {
+		seed = pixelSeed(Seed, coord.x, coord.y);
+		ray = getPixelRay(cam, coord.x, coord.y, width, height, &seed);
+	}
+
+	while (slot >= 0) {
+		bool alive = bounce(&ray, &brightness, &color, sphere, sphereSize, shape, shapeSize, &seed
+			PATH_STATS_PASS CAUSTIC_PASS GUIDE_PASS);
+		bounces++;
+		if (alive && ++depth < MAX_DEPTH) continue;
+		PATH_END(alive ? depth : depth + 1, alive);
+
+		if (--samplesLeft == 0) {
+			// one lane owns a pixel for all of its samples, no atomics needed
+			sumColor[slot] += color;
+			color = (double3)(0, 0, 0);
+			samplesLeft = sampleNum;
+			slot = nextSlot(workCounter, width, height, &coord);
+			if (slot < 0) break;
+			seed = pixelSeed(Seed, coord.x, coord.y);
+		}
+		ray = getPixelRay(cam, coord.x, coord.y, width, height, &seed);
+		brightness = (double3)(1, 1, 1);
+		depth = 0;
+		CAUSTIC_RESET();
+		GUIDE_START();
+	}
+
+#ifdef MEASURE_UTILIZATION
+	__local int groupStats[2];
+	recordUtilization(bounces, utilization, groupStats);
+#endif
+#ifdef PATH_STATS
+	__local uint groupPathStats[PATH_STATS_SIZE];
+	recordPathStats(stats, pathStats, groupPathStats);
+#endif
+}
+
@@ -0,0 +1,198 @@
+// Direct lighting by spatiotemporal reservoir resampling (ReSTIR). Each
+// sample draws RESTIR_CANDIDATES lights the way Shadow.cl draws one and keeps
+// one of them in a per-pixel reservoir, picked in proportion to its
+// unshadowed contribution. kernelMain merges that with the pixel's reservoir
+// from the previous sample (temporal reuse); restirShade, which the host
+// enqueues right behind it, merges in the reservoirs of RESTIR_NEIGHBORS
+// nearby pixels (spatial reuse), casts the one shadow ray and passes the
+// result on to the next sample. Reservoirs are only shared between similar
+// surfaces, and there is no reprojection, so a moving camera mostly falls
+// back to fresh candidates. Reuse is weighted 1 / M, which trades a little
+// bias at geometric edges for far less noise. Built after Common.cl.
+
+#ifndef RESTIR_CANDIDATES
+#define RESTIR_CANDIDATES 32
+#endif
+// most candidates the history may stand for, in samples' worth
+#define RESTIR_HISTORY 20
+#define RESTIR_NEIGHBORS 5
+// in pixels
+#define RESTIR_RADIUS 30
+// reuse only across normals within this cosine and depths within this ratio
+#define RESTIR_NORMAL_COS 0.9
+#define RESTIR_DEPTH 0.1
+
+// A pixel's reservoir, mirrored in Scene.h for the buffer size.
+typedef struct Reservoir {
+	// light point kept
+	double3 y;
+	// surface it was made for: normal facing the viewer and distance from the film
+	double3 nd;
+	double wSum;
+	// contribution weight, what the kept sample's contribution is scaled by
+	double W;
+	double depth;
+	// sphere of the light point, -1 for none
+	int light;
+	// candidates seen
+	int M;
+} Reservoir;
+
+double luminance(double3 c) {
+	return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+// Unshadowed radiance light point y sends to the viewer off hit, per unit
+// light area.
+double3 lightContribution(const Hit* hit, double3 nd, double3 vd, __constant Sphere* sphere, int light, double3 y) {
+	double3 d = y - hit->pos;
+	double dist2 = norm2(d);
+	double3 ld = d / sqrt(dist2);
+	double cosX = dot(nd, ld);
+	double cosY = -dot(normalize(y - sphere[light].pos), ld);
+	if (cosX <= 0 || cosY <= 0) return (double3)(0, 0, 0);
+	return blinnPhongBrdf(&hit->mat, nd, ld, vd) * sphere[light].mat.color * cosX * cosY / dist2;
+}
+
+// What the reservoirs resample towards.
+double targetPdf(const Hit* hit, double3 nd, double3 vd, __constant Sphere* sphere, int light, double3 y) {
+	return light >= 0 ? luminance(lightContribution(hit, nd, vd, sphere, light, y)) : 0;
+}
+
+Reservoir emptyReservoir(double3 nd, double depth) {
+	Reservoir r;
+	r.y = (double3)(0, 0, 0);
+	r.nd = nd;
+	r.wSum = r.W = 0;
+	r.depth = depth;
+	r.light = -1;
+	r.M = 0;
+	return r;
+}
+
+// Streams in a sample of weight w standing for m candidates.
+void reservoirUpdate(Reservoir* r, int light, double3 y, double w, int m, Seed64* seed) {
+	r->wSum += w;
+	r->M += m;
+	if (w > 0 && rand(seed) * r->wSum < w) {
+		r->light = light;
+		r->y = y;
+	}
+}
+
+// Streams in the sample q kept, weighed by its target at r's surface.
+void reservoirMerge(Reservoir* r, const Reservoir* q, const Hit* hit, __constant Sphere* sphere, double3 vd,
+	Seed64* seed) {
+	double p = targetPdf(hit, r->nd, vd, sphere, q->light, q->y);
+	reservoirUpdate(r, q->light, q->y, p * q->W * q->M, q->M, seed);
+}
+
+// Sets the contribution weight once every sample is in.
+void reservoirFinish(Reservoir* r, const Hit* hit, __constant Sphere* sphere, double3 vd) {
+	double p = targetPdf(hit, r->nd, vd, sphere, r->light, r->y);
+	r->W = p > 0 ? r->wSum / (r->M * p) : 0;
+}
+
+bool similarSurface(const Reservoir* q, double3 nd, double depth) {
+	return q->M > 0 && dot(q->nd, nd) > RESTIR_NORMAL_COS && fabs(q->depth - depth) < RESTIR_DEPTH * depth;
+}
+
+// Fresh candidates plus the pixel's history, into reservoirs. Lights and the
+// sky get an empty reservoir.
+__kernel void kernelMain(TRACE_KERNEL_ARGS, __global const Reservoir* history, __global Reservoir* reservoirs) {
+	uint idx;
+	int2 coord = workItemPixel(width, &idx);
+	if (coord.x >= width || coord.y >= height) return;
+
+	Seed64 seed = pixelSeed(Seed, coord.x, coord.y);
+	Ray ray = getPixelRay(cam, coord.x, coord.y, width, height, &seed);
+	Hit hit;
+	if (!intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit) || hit.mat.type == 0) {
+		reservoirs[idx] = emptyReservoir((double3)(0, 0, 0), 0);
+		return;
+	}
+	double3 nd = dot(hit.nd, ray.dir) > 0 ? -hit.nd : hit.nd;
+	double3 vd = -ray.dir;
+	double depth = distance(hit.pos, ray.pos);
+
+	Reservoir fresh = emptyReservoir(nd, depth);
+	for (int i = 0; i < RESTIR_CANDIDATES; i++) {
+		double pickPdf;
+		int lightId = pickLight(hit.pos, lights, lightNodes, lightCount, lightNodeCount, &seed, &pickPdf);
+		if (lightId == -1) break;
+		Sphere light = sphere[lightId];
+		double3 ld;
+		double solidAngle = sampleSphereLight(hit.pos, &light, &seed, &ld);
+		Ray toLight;
+		toLight.pos = hit.pos;
+		toLight.dir = ld;
+		double t = solidAngle > 0 ? getFirstCollideWithSphere(&toLight, &light) : -1;
+		double3 y = hit.pos + t * ld;
+		double w = 0;
+		if (t > 0) {
+			// density of y over the light's area
+			double pdf = pickPdf / solidAngle * -dot(normalize(y - light.pos), ld) / (t * t);
+			if (pdf > 0) w = targetPdf(&hit, nd, vd, sphere, lightId, y) / pdf;
+		}
+		reservoirUpdate(&fresh, lightId, y, w, 1, &seed);
+	}
+	reservoirFinish(&fresh, &hit, sphere, vd);
+
+	Reservoir prev = history[idx];
+	if (!similarSurface(&prev, nd, depth)) {
+		reservoirs[idx] = fresh;
+		return;
+	}
+	prev.M = min(prev.M, RESTIR_HISTORY * RESTIR_CANDIDATES);
+	Reservoir r = emptyReservoir(nd, depth);
+	reservoirMerge(&r, &fresh, &hit, sphere, vd, &seed);
+	reservoirMerge(&r, &prev, &hit, sphere, vd, &seed);
+	reservoirFinish(&r, &hit, sphere, vd);
+	reservoirs[idx] = r;
+}
+
+// Spatial reuse and shading of the sample kernelMain just resampled, with
+// the same seed. The reservoir shaded becomes the pixel's history; one
+// whose light turned out to be occluded is passed on with no weight.
+__kernel void restirShade(TRACE_KERNEL_ARGS, __global const Reservoir* reservoirs, __global Reservoir* history) {
+	uint idx;
+	int2 coord = workItemPixel(width, &idx);
+	if (coord.x >= width || coord.y >= height) return;
+
+	Seed64 seed = pixelSeed(Seed, coord.x, coord.y);
+	Ray ray = getPixelRay(cam, coord.x, coord.y, width, height, &seed);
+	// kernelMain's ray; the rest draws from a stream of its own
+	seed = pixelSeed(~Seed, coord.x, coord.y);
+	Hit hit;
+	bool found = intersectScene(&ray, sphere, sphereSize, shape, shapeSize, &hit);
+	if (!found || hit.mat.type == 0) {
+		history[idx] = reservoirs[idx];
+		if (found) sumColor[idx] += hit.mat.color;
+		return;
+	}
+	double3 vd = -ray.dir;
+	Reservoir own = reservoirs[idx];
+	Reservoir r = emptyReservoir(own.nd, own.depth);
+	reservoirMerge(&r, &own, &hit, sphere, vd, &seed);
+	for (int i = 0; i < RESTIR_NEIGHBORS; i++) {
+		int x = clamp(coord.x + (int)((2 * rand(&seed) - 1) * RESTIR_RADIUS), 0, width - 1);
+		int y = clamp(coord.y + (int)((2 * rand(&seed) - 1) * RESTIR_RADIUS), 0, height - 1);
+		if (x == coord.x && y == coord.y) continue;
+		Reservoir q = reservoirs[pixelSlot(x, y, width)];
+		if (similarSurface(&q, own.nd, own.depth)) reservoirMerge(&r, &q, &hit, sphere, vd, &seed);
+	}
+	reservoirFinish(&r, &hit, sphere, vd);
+
+	double3 color = (double3)(0, 0, 0);
+	if (r.W > 0) {
+		Ray shadowRay;
+		shadowRay.pos = hit.pos;
+		shadowRay.dir = normalize(r.y - hit.pos);
+		Hit blocker;
+		if (intersectScene(&shadowRay, sphere, sphereSize, shape, shapeSize, &blocker) && blocker.sphere == r.light)
+			color = lightContribution(&hit, r.nd, vd, sphere, r.light, r.y) * r.W;
+		else r.W = 0;
+	}
+	history[idx] = r;
+	sumColor[idx] += color;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+// Chooses the internal render resolution from the measured kernel time.
+// Kernel time is roughly proportional to the pixel count, so the linear scale
+// follows sqrt(target / measured).
+class ResolutionController {
+private:
+	const double minScale = 0.25;
+	const int alignment = 8;
+
+	int fullWidth = 0, fullHeight = 0;
+	int width = 0, height = 0;
+	double scale = 1.0;
+	// cap for when the full resolution doesn't fit the device
+	double maxScale = 1.0;
+	double targetMs = 33.0;
+	double avgMs = 0;
+
+	int alignDown(double v) const {
+		int ret = (int)v / alignment * alignment;
+		return std::max(ret, alignment);
+	}
+
+	int scaled(int full, double s) const {
+		return s == 1.0 ? full : alignDown(full * s);
+	}
+
+public:
+	void init(int w, int h) {
+		fullWidth = w;
+		fullHeight = h;
+		scale = maxScale;
+		width = scaled(w, scale);
+		height = scaled(h, scale);
+		avgMs = 0;
+	}
+
+	// Never renders above s of the full resolution; resets to that size.
+	void setMaxScale(double s) {
+		maxScale = std::min(1.0, std::max(minScale, s));
+		init(fullWidth, fullHeight);
+	}
+
+	void setTargetFrameTime(double ms) {
+		targetMs = ms;
+	}
+
+	double getTargetFrameTime() const { return targetMs; }
+	double getScale() const { return scale; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getMaxWidth() const { return scaled(fullWidth, maxScale); }
+	int getMaxHeight() const { return scaled(fullHeight, maxScale); }
+
+	// Returns true when the render resolution changed.
+	bool update(double kernelMs, bool cameraMoving) {
+		avgMs = avgMs == 0 ? kernelMs : avgMs * 0.8 + kernelMs * 0.2;
+
+		double next = maxScale;
+		if (cameraMoving) {
+			double ratio = targetMs / avgMs;
+			// keep a dead band so the resolution doesn't oscillate
+			if (ratio > 0.9 && ratio < 1.25) return false;
+			next = std::min(maxScale, std::max(minScale, scale * sqrt(ratio)));
+		}
+
+		int w = scaled(fullWidth, next);
+		int h = scaled(fullHeight, next);
+		if (w == width && h == height) return false;
+
+		// the time average was measured at the old pixel count
+		avgMs *= (double)w * h / ((double)width * height);
+		width = w;
+		height = h;
+		scale = next;
+		return true;
+	}
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+
+// Splits a per-frame time budget into kernel launches of several samples per
+// pixel each. Cost is tracked per pixel-sample so it survives resolution changes.
+class SampleScheduler {
+private:
+	// longest single launch, keeps the driver watchdog and input latency happy
+	const double maxLaunchMs = 20.0;
+	const int maxSamplesPerLaunch = 64;
+	const int maxLaunchesPerFrame = 16;
+
+	double budgetMs = 33.0;
+	double nsPerSample = 0;
+	int samplesPerLaunch = 1;
+	int launchesPerFrame = 1;
+
+public:
+	void setFrameBudget(double ms) {
+		budgetMs = ms;
+	}
+
+	double getFrameBudget() const { return budgetMs; }
+	int getSamplesPerLaunch() const { return samplesPerLaunch; }
+	int getLaunchesPerFrame() const { return launchesPerFrame; }
+
+	void record(double kernelMs, int samples, long long pixels) {
+		double ns = kernelMs * 1e6 / ((double)samples * pixels);
+		nsPerSample = nsPerSample == 0 ? ns : nsPerSample * 0.8 + ns * 0.2;
+	}
+
+	void plan(long long pixels) {
+		if (nsPerSample == 0) {
+			samplesPerLaunch = launchesPerFrame = 1;
+			return;
+		}
+		double msPerSpp = nsPerSample * pixels * 1e-6;
+		int total = std::max(1, (int)(budgetMs / msPerSpp));
+		samplesPerLaunch = std::min(total, std::max(1, std::min(maxSamplesPerLaunch, (int)(maxLaunchMs / msPerSpp))));
+		launchesPerFrame = std::max(1, std::min(maxLaunchesPerFrame, total / samplesPerLaunch));
+	}
+
+	// Forgets the measured cost, e.g. when the kernel changes.
+	void reset() {
+		nsPerSample = 0;
+	}
+
+	// Interactive frames go back to one sample in one launch.
+	void single() {
+		samplesPerLaunch = launchesPerFrame = 1;
+	}
+};
@@ -1,3 +1,5 @@
+#include <cmath>
+
 #include "Scene.h"
 
 cl_double3& operator /= (cl_double3& o1, const double o2)
@@ -13,13 +15,91 @@ cl_double3 operator / (const cl_double3 o1, const double o2)
 	return ret;
 }
 
-void initScene1(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int winHeight) {
+cl_double3& operator += (cl_double3& o1, const cl_double3 o2)
+{
+	o1.x += o2.x, o1.y += o2.y, o1.z += o2.z;
+	return o1;
+}
+
+cl_double3 operator + (const cl_double3 o1, const cl_double3 o2)
+{
+	cl_double3 ret = o1;
+	ret += o2;
+	return ret;
+}
+
+cl_double3 operator * (const cl_double3 o1, const double o2)
+{
+	cl_double3 ret = o1;
+	ret.x *= o2, ret.y *= o2, ret.z *= o2;
+	return ret;
+}
+
+cl_double3 cross(const cl_double3 o1, const cl_double3 o2)
+{
+	cl_double3 ret;
+	ret.x = o1.y * o2.z - o1.z * o2.y;
+	ret.y = o1.z * o2.x - o1.x * o2.z;
+	ret.z = o1.x * o2.y - o1.y * o2.x;
+	return ret;
+}
+
+Shape makePlane(cl_double3 point, cl_double3 normal, const Material& mat)
+{
+	Shape ret = {};
+	ret.type = SHAPE_PLANE;
+	ret.a = point;
+	ret.b = normal / sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+	ret.mat = mat;
+	return ret;
+}
+
+Shape makeQuad(cl_double3 corner, cl_double3 u, cl_double3 v, const Material& mat)
+{
+	Shape ret = {};
+	ret.type = SHAPE_QUAD;
+	ret.a = corner;
+	ret.b = u;
+	ret.c = v;
+	ret.mat = mat;
+	return ret;
+}
+
+Shape makeBox(cl_double3 lo, cl_double3 hi, const Material& mat)
+{
+	Shape ret = {};
+	ret.type = SHAPE_BOX;
+	ret.a = lo;
+	ret.b = hi;
+	ret.mat = mat;
+	return ret;
+}
+
+void planesToSpheres(std::vector<Sphere>& sphere, std::vector<Shape>& shape, double radius)
+{
+	std::vector<Shape> kept;
+	for (const Shape& s : shape) {
+		if (s.type != SHAPE_PLANE) {
+			kept.push_back(s);
+			continue;
+		}
+		Sphere o;
+		o.radius = radius;
+		o.pos = s.a + s.b * -radius;
+		o.mat = s.mat;
+		sphere.push_back(o);
+	}
+	shape = kept;
+}
+
+void initScene1(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight) {
 	cam.pos = cl_double3{ 0.0,0.0,0.0 };
 	cam.up = cl_double3{ 0.0,1.0,0.0 };
 	cam.lookAt = cl_double3{ 1.0,0.0,0.0 };
 	cam.theta = CL_M_PI / 3.0;
 	cam.winWidth = winWidth;
 	cam.winHeight = winHeight;
+	cam.window = cl_double4{ 0.0, 0.0, 1.0, 1.0 };
 
 	Material diffuseMat, metalMat, dielectricMat, fuzzMetalMat;
 	Material lightMat, leftWallMat, rightWallMat, floorMat;
@@ -55,72 +135,50 @@ void initScene1(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int
 	rightWallMat.color = cl_double3{ 0xFF,0x00,0x33 } / 256.0;
 	floorMat.color = cl_double3{ 0xDD,0xDD,0xDD } / 256.0;
 
-	sphereSize = 12;
-	const cl_double INF = 1e6;
-	// light
+	sphere.assign(6, Sphere());
+	// light, poking through the ceiling
 	sphere[0].radius = 1000;
 	sphere[0].pos = cl_double3{ 800, sphere[0].radius + winHeight - 20, 0 };
 	sphere[0].mat = lightMat;
 
-	// mask
-	sphere[1].radius = INF / 10;
-	sphere[1].pos = cl_double3{ 0, INF / 10 + winHeight, 0 };
-	sphere[1].mat = floorMat;
-
-	// left wall 
-	sphere[2].radius = INF;
-	sphere[2].pos = cl_double3{ 0, 0, -INF - winWidth };
-	sphere[2].mat = leftWallMat;
-
-	// right wall
-	sphere[3].radius = INF;
-	sphere[3].pos = cl_double3{ 0, 0, INF + winWidth };
-	sphere[3].mat = rightWallMat;
-
-	// ceil
-	sphere[4].radius = INF;
-	sphere[4].pos = cl_double3{ 0, INF + winHeight, 0 };
-	sphere[4].mat = floorMat;
-
-	// floor
-	sphere[5].radius = INF;
-	sphere[5].pos = cl_double3{ 0, -INF - winHeight, 0 };
-	sphere[5].mat = floorMat;
-
-	// back
-	sphere[6].radius = INF;
-	sphere[6].pos = cl_double3{ 2000 + INF, 0, 0 };
-	sphere[6].mat = floorMat;
-
 	// balls
-	sphere[7].radius = 200;
-	sphere[7].pos = cl_double3{ 1000, sphere[7].radius - winHeight, 350 };
-	sphere[7].mat = metalMat;
+	sphere[1].radius = 200;
+	sphere[1].pos = cl_double3{ 1000, sphere[1].radius - winHeight, 350 };
+	sphere[1].mat = metalMat;
+
+	sphere[2].radius = 150;
+	sphere[2].pos = cl_double3{ 1300, sphere[2].radius - winHeight, 100 };
+	sphere[2].mat = diffuseMat;
 
-	sphere[8].radius = 150;
-	sphere[8].pos = cl_double3{ 1300, sphere[8].radius - winHeight, 100 };
-	sphere[8].mat = diffuseMat;
+	sphere[3].radius = 50;
+	sphere[3].pos = cl_double3{ 800, sphere[3].radius - winHeight, 300 };
+	sphere[3].mat = fuzzMetalMat;
 
-	sphere[9].radius = 50;
-	sphere[9].pos = cl_double3{ 800, sphere[9].radius - winHeight, 300 };
-	sphere[9].mat = fuzzMetalMat;
+	sphere[4].radius = 250;
+	sphere[4].pos = cl_double3{ 1100, sphere[4].radius - winHeight, -225 };
+	sphere[4].mat = dielectricMat;
 
-	sphere[10].radius = 250;
-	sphere[10].pos = cl_double3{ 1100, sphere[10].radius - winHeight, -225 };
-	sphere[10].mat = dielectricMat;
+	sphere[5].radius = 100;
+	sphere[5].pos = cl_double3{ 800, sphere[5].radius - winHeight, -400 };
+	sphere[5].mat = dielectricMat;
 
-	sphere[11].radius = 100;
-	sphere[11].pos = cl_double3{ 800, sphere[11].radius - winHeight, -400 };
-	sphere[11].mat = dielectricMat;
+	shape.assign(5, Shape());
+	// left and right wall, ceil, floor, back
+	shape[0] = makePlane(cl_double3{ 0, 0, -(double)winWidth }, cl_double3{ 0, 0, 1 }, leftWallMat);
+	shape[1] = makePlane(cl_double3{ 0, 0, (double)winWidth }, cl_double3{ 0, 0, -1 }, rightWallMat);
+	shape[2] = makePlane(cl_double3{ 0, (double)winHeight, 0 }, cl_double3{ 0, -1, 0 }, floorMat);
+	shape[3] = makePlane(cl_double3{ 0, -(double)winHeight, 0 }, cl_double3{ 0, 1, 0 }, floorMat);
+	shape[4] = makePlane(cl_double3{ 2000, 0, 0 }, cl_double3{ -1, 0, 0 }, floorMat);
 }
 
-void initScene2(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int winHeight) {
+void initScene2(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight) {
 	cam.pos = cl_double3{ 0.0,0.0,0.0 };
 	cam.up = cl_double3{ 0.0,1.0,0.0 };
 	cam.lookAt = cl_double3{ 1.0,0.0,0.0 };
 	cam.theta = CL_M_PI / 3.0;
 	cam.winWidth = winWidth;
 	cam.winHeight = winHeight;
+	cam.window = cl_double4{ 0.0, 0.0, 1.0, 1.0 };
 
 	Material metalMat, dielectricMat;
 	Material lightMat, backMat, floorMat;
@@ -146,34 +204,47 @@ void initScene2(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int
 	//floorMat.color = cl_double3{ 0xDD,0x00,0x00 } / 256.0;
 	floorMat.color = cl_double3{ 0xFF,0xFF,0xFF } / 256.0;
 
-	sphereSize = 6;
-	const cl_double INF = 1e6;
+	sphere.assign(3, Sphere());
 	// light
 	sphere[0].radius = 1000;
 	sphere[0].pos = cl_double3{ -2000, sphere[0].radius + winHeight, 0 };
 	sphere[0].mat = lightMat;
 
-	// floor
-	sphere[1].radius = INF;
-	sphere[1].pos = cl_double3{ 0, -INF - winHeight, 0 };
-	sphere[1].mat = floorMat;
-
-	// back
-	sphere[2].radius = INF;
-	sphere[2].pos = cl_double3{ 3000 + INF, 0, 0 };
-	sphere[2].mat = backMat;
-
-	// ceil
-	sphere[3].radius = INF;
-	sphere[3].pos = cl_double3{ 0, INF +2*winWidth, 0 };
-	sphere[3].mat = floorMat;
-
 	// balls
-	sphere[4].radius = 200;
-	sphere[4].pos = cl_double3{ 700, -200, 100 };
-	sphere[4].mat = metalMat;
+	sphere[1].radius = 200;
+	sphere[1].pos = cl_double3{ 700, -200, 100 };
+	sphere[1].mat = metalMat;
+
+	sphere[2].radius = 200;
+	sphere[2].pos = cl_double3{ 500, 0, 0 };
+	sphere[2].mat = dielectricMat;
+
+	shape.assign(3, Shape());
+	// floor, back, ceil
+	shape[0] = makePlane(cl_double3{ 0, -(double)winHeight, 0 }, cl_double3{ 0, 1, 0 }, floorMat);
+	shape[1] = makePlane(cl_double3{ 3000, 0, 0 }, cl_double3{ -1, 0, 0 }, backMat);
+	shape[2] = makePlane(cl_double3{ 0, 2.0 * winWidth, 0 }, cl_double3{ 0, -1, 0 }, floorMat);
+}
 
-	sphere[5].radius = 200;
-	sphere[5].pos = cl_double3{ 500, 0, 0 };
-	sphere[5].mat = dielectricMat;
-}
\ No newline at end of file
+void initScene3(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight) {
+	initScene1(cam, sphere, shape, winWidth, winHeight);
+
+	// rows x rows lights under the ceiling instead of the big one, tinted so
+	// that neighbours differ
+	const int rows = 12;
+	const double radius = 15;
+	const cl_double3 tints[] = {
+		cl_double3{ 1.0, 0.7, 0.4 }, cl_double3{ 1.0, 1.0, 1.0 }, cl_double3{ 0.5, 0.7, 1.0 } };
+	sphere.erase(sphere.begin());
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < rows; j++) {
+			Sphere o = {};
+			o.radius = radius;
+			o.pos = cl_double3{ 300 + 1600.0 * i / (rows - 1), winHeight - 3 * radius,
+				(2.0 * j / (rows - 1) - 1) * (winWidth - 100) };
+			o.mat.color = tints[(i + j) % 3] * 12.0;
+			o.mat.type = 0;
+			sphere.push_back(o);
+		}
+	}
+}
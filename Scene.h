@@ -1,14 +1,24 @@
 #pragma once
 #include <CL/opencl.h>
+#include <vector>
+
+// host copies of the device structs must match OpenCL C alignment
+#ifdef _MSC_VER
+#define CL_ALIGN(n) __declspec(align(n))
+#else
+#define CL_ALIGN(n) __attribute__((aligned(n)))
+#endif
 
 //__declspec(align(16))
 struct Camera {
 	cl_double theta;
 	cl_double winWidth;
 	cl_double winHeight;
-	cl_double3 __declspec(align(16)) pos; // Ļмλ
+	cl_double3 CL_ALIGN(16) pos; // Ļмλ
 	cl_double3 up;
 	cl_double3 lookAt;
+	// part of the image rendered, see Cam in Common.cl
+	cl_double4 window;
 };
 
 struct Material {
@@ -22,18 +32,80 @@ struct Material {
 	* 4: fuzz metal
 	*/
 	cl_int type;
-	cl_double3 __declspec(align(16)) color;
+	cl_double3 CL_ALIGN(16) color;
 };
 
 struct Sphere {
 	cl_double radius;
-	cl_double3 __declspec(align(32)) pos;
+	cl_double3 CL_ALIGN(32) pos;
+	Material mat;
+};
+
+// Plane, quad or axis-aligned box, see Shape in Common.cl for a, b and c.
+enum ShapeType {
+	SHAPE_PLANE = 0,
+	SHAPE_QUAD = 1,
+	SHAPE_BOX = 2
+};
+
+struct Shape {
+	cl_int type;
+	cl_double3 CL_ALIGN(32) a;
+	cl_double3 b;
+	cl_double3 c;
 	Material mat;
 };
 
+// One alias table slot: keep this light with probability prob, else take alias.
+struct LightEntry {
+	cl_double prob;
+	// probability of drawing this light
+	cl_double pdf;
+	cl_int alias;
+	cl_int sphere;
+};
+
+// Light tree node. Leaves have right == -1 and left set to a LightEntry index.
+struct LightNode {
+	cl_double3 CL_ALIGN(32) center;
+	cl_double radius;
+	cl_double power;
+	cl_int left;
+	cl_int right;
+};
+
+// A pixel's reservoir in the ReSTIR mode (ReSTIR.cl), for its buffer size.
+struct Reservoir {
+	cl_double3 CL_ALIGN(32) y;
+	cl_double3 nd;
+	cl_double wSum;
+	cl_double W;
+	cl_double depth;
+	cl_int light;
+	cl_int M;
+};
+
 cl_double3& operator /= (cl_double3& o1, const double o2);
 
 cl_double3 operator / (const cl_double3 o1, const double o2);
 
-void initScene1(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int winHeight);
-void initScene2(Camera& cam, Sphere sphere[], int& sphereSize, int winWidth, int winHeight);
\ No newline at end of file
+cl_double3& operator += (cl_double3& o1, const cl_double3 o2);
+
+cl_double3 operator + (const cl_double3 o1, const cl_double3 o2);
+
+cl_double3 operator * (const cl_double3 o1, const double o2);
+
+cl_double3 cross(const cl_double3 o1, const cl_double3 o2);
+
+Shape makePlane(cl_double3 point, cl_double3 normal, const Material& mat);
+Shape makeQuad(cl_double3 corner, cl_double3 u, cl_double3 v, const Material& mat);
+Shape makeBox(cl_double3 lo, cl_double3 hi, const Material& mat);
+
+// Swaps every plane for a sphere of the given radius touching it from behind,
+// the way walls were built before planes existed. Only for comparisons.
+void planesToSpheres(std::vector<Sphere>& sphere, std::vector<Shape>& shape, double radius);
+
+void initScene1(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight);
+void initScene2(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight);
+// scene 1's room lit by a grid of small colored lights, enough for the light tree
+void initScene3(Camera& cam, std::vector<Sphere>& sphere, std::vector<Shape>& shape, int winWidth, int winHeight);
\ No newline at end of file
@@ -0,0 +1,335 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tiled RGB8 TIFF written one tile at a time, in any order. Tile data is
+// appended as it arrives and only its offset is patched into the tables
+// reserved after the header, so memory doesn't grow with the image. Files
+// past 4 GB are written as BigTIFF.
+class TiledTiffWriter {
+private:
+	static const int entryCount = 11;
+	static const int tileOffsetsEntry = 9, tileByteCountsEntry = 10;
+
+	FILE* file = nullptr;
+	bool big = false;
+	int width, height, tile, tilesAcross, tilesDown;
+	uint64_t tileBytes, offsetsAt, end;
+
+	bool seek(uint64_t pos) {
+#ifdef _WIN32
+		return _fseeki64(file, pos, SEEK_SET) == 0;
+#else
+		return fseeko(file, pos, SEEK_SET) == 0;
+#endif
+	}
+
+	// little-endian
+	void put(uint64_t value, int bytes) {
+		unsigned char buffer[8];
+		for (int i = 0; i < bytes; i++) buffer[i] = (value >> (8 * i)) & 0xff;
+		fwrite(buffer, 1, bytes, file);
+	}
+
+	int countBytes() const { return big ? 8 : 4; }
+
+	// Where the value field of IFD entry i lies.
+	uint64_t valueAt(int i) const {
+		uint64_t ifdAt = big ? 16 : 8;
+		return ifdAt + (big ? 8 : 2) + i * (big ? 20 : 12) + 4 + countBytes();
+	}
+
+	void entry(uint16_t tag, uint16_t type, uint64_t count, uint64_t value) {
+		put(tag, 2);
+		put(type, 2);
+		put(count, countBytes());
+		put(value, countBytes());
+	}
+
+public:
+	bool open(const std::string& path, int w, int h, int tileSize) {
+		width = w;
+		height = h;
+		tile = tileSize;
+		tilesAcross = (w + tile - 1) / tile;
+		tilesDown = (h + tile - 1) / tile;
+		uint64_t tiles = (uint64_t)tilesAcross * tilesDown;
+		tileBytes = (uint64_t)tile * tile * 3;
+		big = tiles * (tileBytes + 16) + 4096 >= (1ull << 32);
+
+#ifdef _WIN32
+		fopen_s(&file, path.c_str(), "wb");
+#else
+		file = fopen(path.c_str(), "wb");
+#endif
+		if (!file) return false;
+
+		// tile offsets and byte counts, LONG8 in BigTIFF
+		const uint16_t offsetType = big ? 16 : 4;
+		int offsetBytes = countBytes();
+		uint64_t ifdAt = big ? 16 : 8;
+		uint64_t ifdSize = big ? 8 + entryCount * 20 + 8 : 2 + entryCount * 12 + 4;
+		uint64_t dataAt = ifdAt + ifdSize;
+
+		// BitsPerSample only fits in the entry for BigTIFF
+		uint64_t bitsValue = 8 | (8ull << 16) | (8ull << 32);
+		if (!big) {
+			bitsValue = dataAt;
+			dataAt += 8;
+		}
+		// tables that fit in their entry (a single tile) stay there
+		bool inlineTables = tiles * offsetBytes <= (uint64_t)countBytes();
+		offsetsAt = inlineTables ? valueAt(tileOffsetsEntry) : dataAt;
+		uint64_t countsAt = inlineTables ? valueAt(tileByteCountsEntry) : dataAt + tiles * offsetBytes;
+		end = inlineTables ? dataAt : countsAt + tiles * offsetBytes;
+
+		if (big) {
+			put('I' | ('I' << 8), 2);
+			put(43, 2);
+			put(8, 2);
+			put(0, 2);
+			put(ifdAt, 8);
+			put(entryCount, 8);
+		} else {
+			put('I' | ('I' << 8), 2);
+			put(42, 2);
+			put(ifdAt, 4);
+			put(entryCount, 2);
+		}
+		entry(256, 4, 1, width);
+		entry(257, 4, 1, height);
+		entry(258, 3, 3, bitsValue);
+		entry(259, 3, 1, 1);
+		entry(262, 3, 1, 2);
+		entry(277, 3, 1, 3);
+		entry(284, 3, 1, 1);
+		entry(322, 4, 1, tile);
+		entry(323, 4, 1, tile);
+		entry(324, offsetType, tiles, inlineTables ? 0 : offsetsAt);
+		entry(325, offsetType, tiles, inlineTables ? tileBytes : countsAt);
+		put(0, countBytes());
+		if (!big) {
+			for (int i = 0; i < 3; i++) put(8, 2);
+			put(0, 2);
+		}
+
+		// empty offsets, every byte count is the same
+		for (uint64_t i = 0; !inlineTables && i < tiles; i++) put(0, offsetBytes);
+		for (uint64_t i = 0; !inlineTables && i < tiles; i++) put(tileBytes, offsetBytes);
+		return ferror(file) == 0;
+	}
+
+	// rgb holds tile x tile pixels, the part past the image edge is padding.
+	bool writeTile(int tx, int ty, const unsigned char* rgb) {
+		uint64_t index = (uint64_t)ty * tilesAcross + tx;
+		if (!seek(end) || fwrite(rgb, 1, tileBytes, file) != tileBytes) return false;
+		if (!seek(offsetsAt + index * countBytes())) return false;
+		put(end, countBytes());
+		end += tileBytes;
+		return ferror(file) == 0;
+	}
+
+	void close() {
+		if (file) fclose(file);
+		file = nullptr;
+	}
+
+	~TiledTiffWriter() {
+		close();
+	}
+};
+
+// Background thread that hands finished tiles to a TiledTiffWriter. There
+// are only depth tile buffers: acquire() blocks the renderer while all of
+// them are queued, so host memory stays bounded however large the image is.
+class TileWriter {
+private:
+	struct Job {
+		int tx, ty, width, height;
+		std::vector<unsigned char>* pixels;
+	};
+
+	TiledTiffWriter tiff;
+	int tile;
+	std::vector<std::vector<unsigned char>> buffers;
+	std::vector<std::vector<unsigned char>*> freeBuffers;
+	std::deque<Job> jobs;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread thread;
+	bool closing = false, failed = false;
+	// time the renderer spent waiting for a free buffer
+	double waitSeconds = 0;
+
+	void run() {
+		std::vector<unsigned char> rgb((size_t)tile * tile * 3);
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [this]() { return closing || !jobs.empty(); });
+			if (jobs.empty()) return;
+			Job job = jobs.front();
+			jobs.pop_front();
+			lock.unlock();
+
+			// RGBx texels from toneMap, packed into the padded tile
+			std::fill(rgb.begin(), rgb.end(), 0);
+			for (int y = 0; y < job.height; y++)
+				for (int x = 0; x < job.width; x++)
+					for (int c = 0; c < 3; c++)
+						rgb[((size_t)y * tile + x) * 3 + c] = (*job.pixels)[((size_t)y * job.width + x) * 4 + c];
+			bool ok = tiff.writeTile(job.tx, job.ty, rgb.data());
+
+			lock.lock();
+			failed |= !ok;
+			freeBuffers.push_back(job.pixels);
+			changed.notify_all();
+		}
+	}
+
+public:
+	bool open(const std::string& path, int width, int height, int tileSize, int depth) {
+		tile = tileSize;
+		if (!tiff.open(path, width, height, tile)) return false;
+		buffers.assign(depth, std::vector<unsigned char>((size_t)tile * tile * 4));
+		for (auto& buffer : buffers) freeBuffers.push_back(&buffer);
+		thread = std::thread(&TileWriter::run, this);
+		return true;
+	}
+
+	// A buffer for tile x tile RGBx texels, once the writer has one free.
+	std::vector<unsigned char>& acquire() {
+		auto start = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return !freeBuffers.empty(); });
+		waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::vector<unsigned char>* ret = freeBuffers.back();
+		freeBuffers.pop_back();
+		return *ret;
+	}
+
+	void submit(int tx, int ty, int width, int height, std::vector<unsigned char>& pixels) {
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back({ tx, ty, width, height, &pixels });
+		changed.notify_all();
+	}
+
+	// Writes the queued tiles and closes the file, false if a write failed.
+	bool close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+			changed.notify_all();
+		}
+		if (thread.joinable()) thread.join();
+		tiff.close();
+		return !failed;
+	}
+
+	double getWaitSeconds() const { return waitSeconds; }
+
+	~TileWriter() {
+		close();
+	}
+};
+
+// Background thread writing whole frames of RGBx texels as binary PPM,
+// with the same bounded buffer pool as TileWriter.
+class FrameWriter {
+private:
+	struct Job {
+		std::string path;
+		std::vector<unsigned char>* pixels;
+	};
+
+	int width, height;
+	std::vector<std::vector<unsigned char>> buffers;
+	std::vector<std::vector<unsigned char>*> freeBuffers;
+	std::deque<Job> jobs;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread thread;
+	bool closing = false, failed = false;
+	double waitSeconds = 0;
+
+	void run() {
+		std::vector<unsigned char> rgb((size_t)width * height * 3);
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [this]() { return closing || !jobs.empty(); });
+			if (jobs.empty()) return;
+			Job job = jobs.front();
+			jobs.pop_front();
+			lock.unlock();
+
+			for (size_t i = 0; i < (size_t)width * height; i++)
+				for (int c = 0; c < 3; c++) rgb[i * 3 + c] = (*job.pixels)[i * 4 + c];
+			FILE* file = nullptr;
+#ifdef _WIN32
+			fopen_s(&file, job.path.c_str(), "wb");
+#else
+			file = fopen(job.path.c_str(), "wb");
+#endif
+			bool ok = file != nullptr;
+			if (ok) {
+				fprintf(file, "P6\n%d %d\n255\n", width, height);
+				ok = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+				fclose(file);
+			}
+
+			lock.lock();
+			failed |= !ok;
+			freeBuffers.push_back(job.pixels);
+			changed.notify_all();
+		}
+	}
+
+public:
+	void open(int w, int h, int depth) {
+		width = w;
+		height = h;
+		buffers.assign(depth, std::vector<unsigned char>((size_t)w * h * 4));
+		for (auto& buffer : buffers) freeBuffers.push_back(&buffer);
+		thread = std::thread(&FrameWriter::run, this);
+	}
+
+	std::vector<unsigned char>& acquire() {
+		auto start = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return !freeBuffers.empty(); });
+		waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::vector<unsigned char>* ret = freeBuffers.back();
+		freeBuffers.pop_back();
+		return *ret;
+	}
+
+	void submit(const std::string& path, std::vector<unsigned char>& pixels) {
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back({ path, &pixels });
+		changed.notify_all();
+	}
+
+	// Writes the queued frames, false if a write failed.
+	bool close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+			changed.notify_all();
+		}
+		if (thread.joinable()) thread.join();
+		return !failed;
+	}
+
+	double getWaitSeconds() const { return waitSeconds; }
+
+	~FrameWriter() {
+		close();
+	}
+};
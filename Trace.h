@@ -0,0 +1,176 @@
+#pragma once
+#include <CL/opencl.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of host spans and OpenCL commands, written as Chrome trace-event
+// JSON (chrome://tracing, Perfetto). Spans go into a fixed ring buffer: a
+// writer claims a slot with one atomic increment and publishes it by storing
+// its sequence number last, so recording takes no lock and the newest
+// capacity events survive. Names must be string literals or otherwise
+// outlive the recording.
+//
+// Device timestamps are moved onto the host clock with an offset measured
+// whenever the host sees a command complete: host time minus the command's
+// end time is never below the true offset, so the smallest sample is kept.
+class Tracer {
+public:
+	// device tracks, as thread ids of the device process
+	enum Track { TraceQueue, DisplayQueue };
+
+private:
+	struct Event {
+		const char* name;
+		int pid, tid;
+		double ts, dur;
+		std::atomic<unsigned long long> seq{ 0 };
+	};
+
+	static const int capacity = 1 << 16;
+	std::vector<Event> events = std::vector<Event>(capacity);
+	std::atomic<unsigned long long> next{ 0 };
+	// first event of the current recording
+	unsigned long long first = 0;
+	std::atomic<bool> on{ false };
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+	std::mutex mutex;
+	std::vector<std::string> threadNames;
+	double deviceOffsetUs = 0;
+	bool deviceSynced = false;
+
+	static int threadId() {
+		static std::atomic<int> threads{ 0 };
+		static thread_local int id = threads++;
+		return id;
+	}
+
+	void record(const char* name, int pid, int tid, double ts, double dur) {
+		unsigned long long i = next++;
+		Event& e = events[i % capacity];
+		e.seq.store(0, std::memory_order_relaxed);
+		e.name = name;
+		e.pid = pid;
+		e.tid = tid;
+		e.ts = ts;
+		e.dur = dur;
+		e.seq.store(i + 1, std::memory_order_release);
+	}
+
+public:
+	// Closes a host span when it goes out of scope.
+	class Span {
+	private:
+		Tracer* tracer;
+		const char* name;
+		double start;
+
+	public:
+		Span(Tracer& t, const char* spanName) : tracer(t.recording() ? &t : nullptr), name(spanName),
+			start(tracer ? t.nowUs() : 0) {}
+		~Span() {
+			if (tracer) tracer->record(name, 0, threadId(), start, tracer->nowUs() - start);
+		}
+	};
+
+	bool recording() const {
+		return on.load(std::memory_order_relaxed);
+	}
+
+	// Starts a new recording, dropping the previous one.
+	void start() {
+		first = next;
+		on = true;
+	}
+
+	void stop() {
+		on = false;
+	}
+
+	double nowUs() const {
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// Labels the calling thread's track.
+	void nameThread(const char* name) {
+		int id = threadId();
+		std::lock_guard<std::mutex> lock(mutex);
+		if ((int)threadNames.size() <= id) threadNames.resize(id + 1);
+		threadNames[id] = name;
+	}
+
+	// Call right after the host has waited for done to complete.
+	void syncDevice(cl_event done) {
+		double host = nowUs();
+		cl_ulong end;
+		if (clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS) return;
+		double offset = host - end * 1e-3;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!deviceSynced || offset < deviceOffsetUs) deviceOffsetUs = offset;
+		deviceSynced = true;
+	}
+
+	// Records a completed command of a profiling queue.
+	void deviceSpan(const char* name, Track track, cl_event event) {
+		if (!recording()) return;
+		cl_ulong start, end;
+		if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) != CL_SUCCESS
+			|| clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS)
+			return;
+		double offset;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!deviceSynced) return;
+			offset = deviceOffsetUs;
+		}
+		record(name, 1, track, start * 1e-3 + offset, (end - start) * 1e-3);
+	}
+
+	// Writes the events still in the ring. Spans being recorded meanwhile
+	// are skipped.
+	bool write(const std::string& path) {
+		FILE* file = nullptr;
+#ifdef _WIN32
+		fopen_s(&file, path.c_str(), "w");
+#else
+		file = fopen(path.c_str(), "w");
+#endif
+		if (!file) return false;
+		fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+		fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"host\"}},\n");
+		fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"device\"}}");
+		const char* queues[] = { "trace queue", "display queue" };
+		for (int i = 0; i < 2; i++)
+			fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+				i, queues[i]);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < threadNames.size(); i++)
+				if (!threadNames[i].empty())
+					fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+						"\"args\": {\"name\": \"%s\"}}", (int)i, threadNames[i].c_str());
+		}
+		unsigned long long end = next;
+		for (unsigned long long i = std::max(first, end > capacity ? end - capacity : 0); i < end; i++) {
+			Event& e = events[i % capacity];
+			if (e.seq.load(std::memory_order_acquire) != i + 1) continue;
+			const char* name = e.name;
+			int pid = e.pid, tid = e.tid;
+			double ts = e.ts, dur = e.dur;
+			// overwritten while copying
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (e.seq.load(std::memory_order_relaxed) != i + 1) continue;
+			fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				name, pid, tid, ts, dur);
+		}
+		fprintf(file, "\n]}\n");
+		bool ok = ferror(file) == 0;
+		fclose(file);
+		return ok;
+	}
+};
@@ -1,6 +1,9 @@
 #include <memory>
 #include <iostream>
 #include <cstring>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
 
 // OpenCL
 #include <CL/opencl.h>
@@ -10,14 +13,69 @@
 #include <GLFW/glfw3.h>
 
 #include "GraphicManager.h"
+#include "Microbench.h"
 #include "util.h"
 
 
 const int WIN_WIDTH = 600;
 const int WIN_HEIGHT = 600;
+const double TARGET_FRAME_MS = 33.0;
+const double FRAME_BUDGET_MS = 33.0;
+const double MOVE_SPEED = 400.0;
+const double TURN_SPEED = 1.0;
+// build the kernels with SIMD utilization counters (shown in the title bar)
+const bool MEASURE_UTILIZATION = false;
+// build the path tracer with path statistics (title bar and --converge JSON), or pass --path-stats
+const bool PATH_STATS = false;
+// learn where light comes from while tracing and guide diffuse bounces there (toggled with G)
+const bool PATH_GUIDING = false;
+// bundled scene to start with: 0 and 1 the sphere rooms, 2 the first room lit by 144 small lights; or pass --scene
+const int SCENE = 0;
+// 0 row-major, 1 Morton order inside tiles, 2 row-major tiles; TILE_SIZE is a power of two
+const int PIXEL_ORDER = 1;
+const int TILE_SIZE = 8;
+// build the kernels for the loaded scene (sphere count, material types, depth)
+const bool SPECIALIZE_SCENE = true;
+// 0 shared PBO, 1 shared texture (zero-copy), 2 mapped buffers (no CL/GL sharing needed);
+// half float texels instead of RGBA8 for the shared texture
+const int DISPLAY_PATH = 1;
+const bool HALF_FLOAT_DISPLAY = false;
+// trace on a thread of its own, so the window presents at monitor rate
+const bool RENDER_THREAD = true;
+// part of a "platform / device" name to render on, empty to calibrate every
+// device and take the fastest; CPU devices leave HOST_CORES cores to the host
+const char* DEVICE = "";
+const int HOST_CORES = 2;
+// device memory to stay within in MB, 0 for all of it, or pass --mem-budget
+const int MEMORY_BUDGET_MB = 0;
+// checkpoint the accumulation of a still camera this often, empty path for none
+const char* CHECKPOINT_PATH = "render.checkpoint";
+const double CHECKPOINT_SECONDS = 60.0;
 
 GLFWwindow* window;
 GraphicManager cl;
+double lstInputTime;
+std::atomic<bool> rendering;
+bool benchSpecialize = false;
+bool benchShapes = false;
+bool microbench = false;
+bool pathStats = PATH_STATS;
+// trace timeline, recorded from the start with --trace and toggled with T
+std::string tracePath = "trace.json";
+bool traceFromStart = false;
+std::string deviceName = DEVICE;
+int memoryBudgetMB = MEMORY_BUDGET_MB;
+int scene = SCENE;
+// offline render: size, samples per pixel and TIFF path, 0 width for none
+int posterWidth = 0, posterHeight = 0, posterSpp = 0;
+std::string posterPath;
+bool resume = false;
+// batch render: keyframe file, samples per frame and output pattern
+std::string animationPath, framePattern;
+int animationSpp = 0;
+// convergence benchmark: time budget per kernel and scene, output prefix
+double convergeSeconds = 0;
+std::string convergePrefix;
 
 void initOpenGL() {
 	glfwInit();
@@ -25,6 +83,8 @@ void initOpenGL() {
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+	// offline renders only need the context
+	glfwWindowHint(GLFW_VISIBLE, posterWidth || animationSpp || convergeSeconds > 0 ? GLFW_FALSE : GLFW_TRUE);
 
 	// Create window
 	window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Ray Tracer Demo", NULL, NULL);
@@ -46,32 +106,181 @@ void initOpenGL() {
 
 void initOpenCL() {
 	cl.setWidthAndHeight(WIN_WIDTH, WIN_HEIGHT);
+	cl.setTargetFrameTime(TARGET_FRAME_MS);
+	cl.setFrameBudget(FRAME_BUDGET_MS);
+	cl.setMeasureUtilization(MEASURE_UTILIZATION);
+	cl.setPathStats(pathStats);
+	cl.setGuiding(PATH_GUIDING);
+	cl.setScene(scene);
+	cl.setPixelOrder(PIXEL_ORDER, TILE_SIZE);
+	cl.setSpecialize(SPECIALIZE_SCENE, benchSpecialize);
+	cl.setBenchShapes(benchShapes);
+	cl.setDisplayFormat(HALF_FLOAT_DISPLAY);
+	cl.setDisplayPath(DISPLAY_PATH);
+	cl.setDevice(deviceName, HOST_CORES);
+	cl.setMemoryBudget(memoryBudgetMB);
+	cl.setTracePath(tracePath);
+	if (!posterWidth && !animationSpp && convergeSeconds <= 0) cl.setCheckpoint(CHECKPOINT_PATH, CHECKPOINT_SECONDS, resume);
 	cl.init();
+	lstInputTime = glfwGetTime();
+}
+
+// True only on the frame the key goes down.
+bool keyPressed(GLFWwindow* window, int key) {
+	static std::unordered_map<int, bool> lstState;
+	bool down = glfwGetKey(window, key) == GLFW_PRESS;
+	bool ret = down && !lstState[key];
+	lstState[key] = down;
+	return ret;
 }
 
 void processInput(GLFWwindow* window)
 {
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
+	if (keyPressed(window, GLFW_KEY_P))
+		cl.togglePersistent();
+	if (keyPressed(window, GLFW_KEY_M))
+		cl.cyclePixelOrder();
+	if (keyPressed(window, GLFW_KEY_J))
+		cl.toggleSpecialize();
+	if (keyPressed(window, GLFW_KEY_Z))
+		cl.cycleDisplayPath();
+	if (keyPressed(window, GLFW_KEY_T))
+		cl.toggleTrace();
+	if (keyPressed(window, GLFW_KEY_G))
+		cl.toggleGuiding();
+	for (int i = 0; i < 7; i++)
+		if (keyPressed(window, GLFW_KEY_1 + i)) cl.setMode(i);
+
+	double nowTime = glfwGetTime();
+	double dt = nowTime - lstInputTime;
+	lstInputTime = nowTime;
+
+	double forward = 0, right = 0, up = 0, yaw = 0;
+	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) forward += MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) forward -= MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) right += MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) right -= MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) up += MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) up -= MOVE_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) yaw += TURN_SPEED * dt;
+	if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) yaw -= TURN_SPEED * dt;
+
+	if (forward != 0 || right != 0 || up != 0) cl.moveCamera(forward, right, up);
+	if (yaw != 0) cl.rotateCamera(yaw);
 }
 
 void mainLoop() {
 	processInput(window);
 
-	cl.runKernel();
+	if (!RENDER_THREAD) cl.runKernel();
 	cl.render(window);
 
+	Tracer::Span span(cl.getTracer(), "glfwPollEvents");
 	glfwPollEvents();
 }
 
+// Device-function microbenchmarks on every device whose name contains
+// deviceName, without a window. Returns the exit code.
+int runMicrobench() {
+	DeviceSelector selector(HOST_CORES);
+	bool ok = true;
+	for (size_t i = 0; i < selector.count(); i++) {
+		const DeviceCandidate& c = selector.get(i);
+		if (c.name.find(deviceName) == std::string::npos) continue;
+		std::cout << c.name << ":" << std::endl;
+		CLManager probe;
+		probe.initProbe(c.platform, c.device);
+		ok &= probe.queue != 0 && Microbench(probe).run();
+	}
+	return ok ? 0 : 1;
+}
+
+// Keeps the device busy; never waits on vsync or window events.
+void renderLoop() {
+	cl.getTracer().nameThread("render");
+	while (rendering)
+		cl.runKernel();
+}
+
 int main(int argc, char** argv) {
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--autotune") == 0) cl.setAutotune(true);
+		else if (strcmp(argv[i], "--bench-specialize") == 0) benchSpecialize = true;
+		else if (strcmp(argv[i], "--bench-shapes") == 0) benchShapes = true;
+		else if (strcmp(argv[i], "--microbench") == 0) microbench = true;
+		else if (strcmp(argv[i], "--path-stats") == 0) pathStats = true;
+		else if (strcmp(argv[i], "--resume") == 0) resume = true;
+		else if (strcmp(argv[i], "--animate") == 0 && i + 3 < argc) {
+			animationPath = argv[++i];
+			animationSpp = atoi(argv[++i]);
+			framePattern = argv[++i];
+		}
+		else if (strcmp(argv[i], "--converge") == 0 && i + 2 < argc) {
+			convergeSeconds = atof(argv[++i]);
+			convergePrefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+			traceFromStart = true;
+		}
+		else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) deviceName = argv[++i];
+		else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) memoryBudgetMB = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) scene = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--poster") == 0 && i + 4 < argc) {
+			posterWidth = atoi(argv[++i]);
+			posterHeight = atoi(argv[++i]);
+			posterSpp = atoi(argv[++i]);
+			posterPath = argv[++i];
+		}
+
+	if (microbench) return runMicrobench();
+
 	initOpenGL();
 
 	initOpenCL();
 
+	if (posterWidth > 0 && posterHeight > 0 && posterSpp > 0) {
+		bool ok = cl.renderPoster(posterWidth, posterHeight, posterSpp, posterPath);
+		cl.shutdown();
+		glfwTerminate();
+		return ok ? 0 : 1;
+	}
+
+	if (animationSpp > 0) {
+		Animation animation;
+		bool ok = animation.load(animationPath);
+		if (!ok) std::cerr << "Couldn't read keyframes from " << animationPath << std::endl;
+		else ok = cl.renderAnimation(animation, animationSpp, framePattern);
+		cl.shutdown();
+		glfwTerminate();
+		return ok ? 0 : 1;
+	}
+
+	if (convergeSeconds > 0) {
+		bool ok = cl.benchmarkConvergence(convergeSeconds, convergePrefix);
+		cl.shutdown();
+		glfwTerminate();
+		return ok ? 0 : 1;
+	}
+
+	glfwSwapInterval(1);
+	cl.getTracer().nameThread(RENDER_THREAD ? "display" : "main");
+	if (traceFromStart) cl.toggleTrace();
+	rendering = true;
+	std::thread renderThread;
+	if (RENDER_THREAD) renderThread = std::thread(renderLoop);
+
 	while (!glfwWindowShouldClose(window))
 		mainLoop();
 
+	rendering = false;
+	if (renderThread.joinable()) renderThread.join();
+	// still recording: write what's in the ring
+	if (cl.getTracer().recording()) cl.toggleTrace();
+
+	cl.shutdown();
 	glfwTerminate();
 
 	return 0;
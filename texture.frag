@@ -1,7 +1,50 @@
+#version 130
+
 uniform sampler2D tex;
+// the frame covers this many texels in the corner of tex
+uniform vec2 renderSize;
 out vec4 new_color;
 
+// Catmull-Rom upscaling from the internal render resolution to the window,
+// done with 9 bilinear taps. Exact at texel centers, so a full resolution
+// frame passes through unchanged. Taps are clamped to the rendered region,
+// the rest of a window-sized texture holds stale texels.
+vec3 sampleCatmullRom(vec2 uv) {
+   vec2 texSize = vec2(textureSize(tex, 0));
+   vec2 samplePos = uv * renderSize;
+   vec2 texPos1 = floor(samplePos - 0.5) + 0.5;
+   vec2 f = samplePos - texPos1;
+
+   vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+   vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+   vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+   vec2 w3 = f * f * (-0.5 + 0.5 * f);
+
+   vec2 w12 = w1 + w2;
+   vec2 offset12 = w2 / w12;
+
+   vec2 lo = 0.5 / texSize;
+   vec2 hi = (renderSize - 0.5) / texSize;
+   vec2 texPos0 = clamp((texPos1 - 1.0) / texSize, lo, hi);
+   vec2 texPos3 = clamp((texPos1 + 2.0) / texSize, lo, hi);
+   vec2 texPos12 = clamp((texPos1 + offset12) / texSize, lo, hi);
+
+   vec3 result = vec3(0.0);
+   result += texture(tex, vec2(texPos0.x, texPos0.y)).rgb * w0.x * w0.y;
+   result += texture(tex, vec2(texPos12.x, texPos0.y)).rgb * w12.x * w0.y;
+   result += texture(tex, vec2(texPos3.x, texPos0.y)).rgb * w3.x * w0.y;
+
+   result += texture(tex, vec2(texPos0.x, texPos12.y)).rgb * w0.x * w12.y;
+   result += texture(tex, vec2(texPos12.x, texPos12.y)).rgb * w12.x * w12.y;
+   result += texture(tex, vec2(texPos3.x, texPos12.y)).rgb * w3.x * w12.y;
+
+   result += texture(tex, vec2(texPos0.x, texPos3.y)).rgb * w0.x * w3.y;
+   result += texture(tex, vec2(texPos12.x, texPos3.y)).rgb * w12.x * w3.y;
+   result += texture(tex, vec2(texPos3.x, texPos3.y)).rgb * w3.x * w3.y;
+   return max(result, vec3(0.0));
+}
+
 void main() {
-   vec3 color = vec3(texture(tex, gl_TexCoord[0].st));
+   vec3 color = sampleCatmullRom(gl_TexCoord[0].st);
    new_color = vec4(color, 1.0);
 }
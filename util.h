@@ -22,23 +22,28 @@
 #pragma once
 #include <stdio.h>
 #include <stdlib.h>
-#include <tchar.h>
+#include <stdarg.h>
 #include <memory.h>
+#ifdef _WIN32
+#include <tchar.h>
 #include <windows.h>
+#endif
 #include <string>
 
  // Suppress a compiler warning about undefined CL_TARGET_OPENCL_VERSION
  // Khronos ICD supports only latest OpenCL version
 #define CL_TARGET_OPENCL_VERSION 220
 
-#include "CL\cl.h"
-#include "CL\cl_ext.h"
+#include "CL/cl.h"
+#include "CL/cl_ext.h"
 #include <assert.h>
 
 
 //we want to use POSIX functions
+#ifdef _MSC_VER
 #pragma warning( push )
 #pragma warning( disable : 4996 )
+#endif
 
 
 static void LogInfo(const char* str, ...)
@@ -75,7 +80,11 @@ static int ReadSourceFromFile(const char* fileName, char** source, size_t* sourc
     int errorCode = CL_SUCCESS;
 
     FILE* fp = NULL;
+#ifdef _WIN32
     fopen_s(&fp, fileName, "r");
+#else
+    fp = fopen(fileName, "r");
+#endif
     if (fp == NULL)
     {
         LogError("Error: Couldn't find program source file '%s'.\n", fileName);
@@ -104,6 +113,18 @@ static int ReadSourceFromFile(const char* fileName, char** source, size_t* sourc
     return errorCode;
 }
 
+// FNV-1a, stable across runs and compilers so it can key files on disk
+static unsigned long long HashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 void compileShader(GLint shader) {
     GLint success;
     GLsizei log_size;
@@ -192,4 +213,6 @@ static const char* TranslateOpenCLError(cl_int errorCode)
         return "UNKNOWN ERROR CODE";
     }
 }
-#pragma warning( pop )
\ No newline at end of file
+#ifdef _MSC_VER
+#pragma warning( pop )
+#endif